@@ -1,10 +1,10 @@
 #pragma once
 
-#define LOG_DEBUG(str, ...) Logger::Log(Logger::LogLevel::DEBUG,  LOG_SECTION, str, __VA_ARGS__)
-#define LOG_INFO(str, ...)  Logger::Log(Logger::LogLevel::INFO,   LOG_SECTION, str, __VA_ARGS__)
-#define LOG_WARN(str, ...)  Logger::Log(Logger::LogLevel::WARN,   LOG_SECTION, str, __VA_ARGS__)
-#define LOG_ERROR(str, ...) Logger::Log(Logger::LogLevel::ERROR_, LOG_SECTION, str, __VA_ARGS__)
-#define LOG_FATAL(str, ...) Logger::Log(Logger::LogLevel::FATAL,  LOG_SECTION, str, __VA_ARGS__)
+#define LOG_DEBUG(str, ...) Logger::Log(Logger::LogLevel::DEBUG,  LOG_SECTION, str, ##__VA_ARGS__)
+#define LOG_INFO(str, ...)  Logger::Log(Logger::LogLevel::INFO,   LOG_SECTION, str, ##__VA_ARGS__)
+#define LOG_WARN(str, ...)  Logger::Log(Logger::LogLevel::WARN,   LOG_SECTION, str, ##__VA_ARGS__)
+#define LOG_ERROR(str, ...) Logger::Log(Logger::LogLevel::ERROR_, LOG_SECTION, str, ##__VA_ARGS__)
+#define LOG_FATAL(str, ...) Logger::Log(Logger::LogLevel::FATAL,  LOG_SECTION, str, ##__VA_ARGS__)
 
 #define LOG_VA_DEBUG(str, va) Logger::Log(Logger::LogLevel::DEBUG,  LOG_SECTION, str, va)
 #define LOG_VA_INFO(str, va)  Logger::Log(Logger::LogLevel::INFO,   LOG_SECTION, str, va)
@@ -12,6 +12,9 @@
 #define LOG_VA_ERROR(str, va) Logger::Log(Logger::LogLevel::ERROR_, LOG_SECTION, str, va)
 #define LOG_VA_FATAL(str, va) Logger::Log(Logger::LogLevel::FATAL,  LOG_SECTION, str, va)
 
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
 #include <functional>
 #include <memory>
 #include <thread>
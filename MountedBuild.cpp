@@ -6,6 +6,7 @@
 #define MB_SDDL_DATA  "P(A;ID;FRFX;;;WD)" // Protected from inheritance, allows it and it's children to give read and execure access to everyone
 #define SDDL_ROOT  L"D:" MB_SDDL_DATA
 #define SDDL_FILE  L"O:" MB_SDDL_OWNER "G:" MB_SDDL_OWNER "D:" MB_SDDL_DATA
+#define PRELOAD_TRANSFERS_PER_CONNECTION 4 // downloads kept in flight per connection, so connections don't sit idle between them
 
 #ifndef LOG_SECTION
 #define LOG_SECTION "MountedBuild"
@@ -21,13 +22,12 @@
 #include <numeric>
 #include <sddl.h>
 #include <set>
-#include <unordered_set>
 
-MountedBuild::MountedBuild(Manifest manifest, fs::path mountDir, fs::path cachePath, uint32_t storageFlags, uint32_t memoryPoolCapacity) :
+MountedBuild::MountedBuild(Manifest manifest, fs::path mountDir, fs::path cachePath, uint32_t storageFlags, size_t memoryPoolCapacity, size_t compressedCacheCapacity, uint32_t retainedBuildCount, uint32_t archiveAfterDays) :
     Build(manifest),
     MountDir(mountDir),
     CacheDir(cachePath),
-    StorageData(storageFlags, memoryPoolCapacity, CacheDir, Build.CloudDir)
+    StorageData(storageFlags, memoryPoolCapacity, compressedCacheCapacity, retainedBuildCount, archiveAfterDays, CacheDir, Build.CloudDir, Build.BuildVersion, Build.ChunkManifestList)
 {
     LOG_DEBUG("new (v: %s, mount: %s, cache: %s)", Build.BuildVersion.c_str(), MountDir.string().c_str(), CacheDir.string().c_str());
 
@@ -103,20 +103,6 @@ MountedBuild::~MountedBuild() {
 
 }
 
-// 0: valid
-// 1: bad parent
-// 2: at base dir
-inline int ValidChunkFile(fs::path& CacheDir, fs::path ChunkPath) {
-    if (ChunkPath.parent_path() == CacheDir) {
-        return 2;
-    }
-    if (ChunkPath.parent_path().parent_path() != CacheDir) {
-        return 1;
-    }
-    auto name = ChunkPath.parent_path().filename().string();
-    return (name.size() == 2 && isxdigit(name[0]) && isxdigit(name[1])) ? 0 : 1;
-}
-
 bool MountedBuild::SetupCacheDirectory(fs::path CacheDir) {
     if (!fs::is_directory(CacheDir) && !fs::create_directories(CacheDir)) {
         LOG_ERROR("can't create cachedir", CacheDir.string().c_str());
@@ -158,7 +144,7 @@ void MountedBuild::PreloadFile(File& File, uint32_t ThreadCount, cancel_flag& fl
 
         
         threads.emplace_back([&, this]() {
-            StorageData.GetChunkPart(chunkPart, flag);
+            StorageData.GetChunkPart(chunkPart, flag, FetchPriority::Prefetch);
         });
     }
 
@@ -291,81 +277,103 @@ void MountedBuild::PreloadAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHa
     LOG_DEBUG("preloading");
     setMax(Build.ChunkManifestList.size());
 
+    // downloading in file order lets the pack files lay them out the way the game reads them
+    auto chunkOrder = Build.GetChunksInFileOrder();
+
     auto purgeThread = std::thread([&, this] {
         PurgeUnusedChunks(flag);
+        StorageData.MigrateLooseChunks(chunkOrder, flag);
     });
 
     auto setMaxThread = std::thread([&, this] {
         setMax(GetMissingChunkCount());
     });
 
-    auto threads = std::make_unique<std::thread[]>(threadCount);
-
-    std::mutex iterMtx;
-    std::condition_variable iterCv;
-
-    auto chunkIter = Build.ChunkManifestList.begin();
-    auto chunkEnd = Build.ChunkManifestList.end();
-    std::atomic_bool chunkDone = false;
-
-    auto GetChunk = [&] {
-        std::unique_lock<std::mutex> lk(iterMtx);
-        for (; chunkIter != chunkEnd; ++chunkIter) {
-            if (!StorageData.IsChunkDownloaded(*chunkIter)) {
-                return chunkIter++;
-            }
-        }
-        chunkDone = true;
-        lk.unlock();
-        iterCv.notify_all();
-        return chunkEnd;
+    // the downloads run on Storage's event loops, this thread only keeps enough of them in flight and hands them to the writer
+    // threadCount is how many connections they're spread over
+    struct PreloadSlot {
+        std::shared_ptr<Chunk> Chunk;
+        std::shared_ptr<char[]> Data;
+        bool Done;
     };
-
-    auto threadJob = [&, this] {
-        while (!chunkDone && !flag.cancelled()) {
-            auto chunk = GetChunk();
-            if (chunk == chunkEnd) {
-                return;
+    auto maxInFlight = threadCount * PRELOAD_TRANSFERS_PER_CONNECTION;
+    std::deque<PreloadSlot> inFlight; // in the order they were started, deque keeps the slots in place while the callbacks fill them
+    std::mutex inFlightMtx;
+    std::condition_variable inFlightCv;
+
+    auto StoreDone = [&](std::unique_lock<std::mutex>& lk) {
+        // written in the order they were started, not the order they finished in, to keep the file order
+        while (!inFlight.empty() && inFlight.front().Done) {
+            auto slot = std::move(inFlight.front());
+            inFlight.pop_front();
+            if (slot.Data && !flag.cancelled()) {
+                lk.unlock();
+                // the download callbacks can't block, so the write queue's backpressure lands here
+                StorageData.StoreChunk(slot.Chunk, slot.Data);
+                onProg();
+                lk.lock();
             }
-            StorageData.DownloadChunk(*chunk, flag);
-            onProg();
         }
     };
 
-    Client::SetPoolSize(threadCount);
+    StorageData.SetDownloadConnections(threadCount);
 
-    for (int i = 0; i < threadCount; ++i) {
-        threads[i] = std::thread(threadJob);
+    for (auto& chunk : chunkOrder) {
+        if (flag.cancelled()) {
+            break;
+        }
+        if (StorageData.IsChunkDownloaded(chunk)) {
+            continue;
+        }
+        PreloadSlot* slot;
+        {
+            std::unique_lock<std::mutex> lk(inFlightMtx);
+            inFlightCv.wait(lk, [&] { return inFlight.size() < maxInFlight || inFlight.front().Done || flag.cancelled(); });
+            StoreDone(lk);
+            if (flag.cancelled()) {
+                break;
+            }
+            slot = &inFlight.emplace_back(PreloadSlot{ chunk, nullptr, false });
+        }
+        StorageData.DownloadChunkAsync(chunk, flag, [&, slot](Compressor::buffer_value chunkData) {
+            {
+                std::lock_guard<std::mutex> lk(inFlightMtx);
+                slot->Data = chunkData.first;
+                slot->Done = true;
+            }
+            inFlightCv.notify_all();
+        });
     }
 
-    std::unique_lock<std::mutex> lk(iterMtx);
-    iterCv.wait(lk, [&] { return chunkDone || flag.cancelled(); });
-
-    Client::SetPoolSize(-1);
-
-    for (int i = 0; i < threadCount; ++i) {
-        threads[i].join();
+    {
+        // everything started still calls back, so this doesn't return while they can touch anything here
+        std::unique_lock<std::mutex> lk(inFlightMtx);
+        while (!inFlight.empty()) {
+            if (flag.cancelled()) {
+                // other readers could be sharing these downloads, so this only stops us waiting on them
+                lk.unlock();
+                StorageData.CancelDownloads(flag);
+                lk.lock();
+            }
+            inFlightCv.wait_for(lk, std::chrono::milliseconds(50), [&] { return inFlight.front().Done; });
+            StoreDone(lk);
+        }
     }
 
+    StorageData.SetDownloadConnections(-1);
+
     purgeThread.join();
     setMaxThread.join();
+    StorageData.FlushWrites();
     onFinish();
     LOG_DEBUG("preloaded");
 }
 
 void MountedBuild::VerifyAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHandler onProg, ProgressFinishHandler onFinish, cancel_flag& flag, uint32_t threadCount) {
     LOG_DEBUG("verifying");
-    setMax(Build.ChunkManifestList.size());
+    setMax(Build.ChunkManifestList.size() - StorageData.GetMissingChunkCount());
 
     std::deque<std::thread> threads;
-    threads.emplace_back([&, this]() {
-        size_t cnt = std::count_if(fs::recursive_directory_iterator(CacheDir), fs::recursive_directory_iterator(),
-            [this](const fs::directory_entry& f) {
-                return f.is_regular_file() && ValidChunkFile(CacheDir, f.path()) == 0;
-            });
-        setMax((std::min)(Build.ChunkManifestList.size(), cnt));
-    });
-
     for (auto& chunk : Build.ChunkManifestList) {
         if (!StorageData.IsChunkDownloaded(chunk)) {
             continue;
@@ -395,52 +403,54 @@ void MountedBuild::VerifyAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHan
     for (auto& thread : threads) {
         thread.join();
     }
+    StorageData.FlushWrites();
     onFinish();
     LOG_DEBUG("preloaded");
 }
 
-#define HTONLL(x) ((1==htonl(1)) ? (x) : (((uint64_t)htonl((x) & 0xFFFFFFFFUL)) << 32) | htonl((uint32_t)((x) >> 32)))
-#define NTOHLL(x) ((1==ntohl(1)) ? (x) : (((uint64_t)ntohl((x) & 0xFFFFFFFFUL)) << 32) | ntohl((uint32_t)((x) >> 32)))
-auto guidHash = [](const char* n) { return (*((uint64_t*)n)) ^ (*(((uint64_t*)n) + 1)); };
-auto guidEqual = [](const char* a, const char* b) {return !memcmp(a, b, 16); };
-void MountedBuild::PurgeUnusedChunks(cancel_flag& flag) {
-    LOG_DEBUG("purging");
-    std::unordered_set<char*, decltype(guidHash), decltype(guidEqual)> ManifestGuids;
-    ManifestGuids.reserve(Build.ChunkManifestList.size());
-    for (auto& chunk : Build.ChunkManifestList) {
-        ManifestGuids.insert(chunk->Guid);
-    }
+void MountedBuild::RecompressAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHandler onProg, ProgressFinishHandler onFinish, cancel_flag& flag, float cpuShare, uint64_t ioBytesPerSec) {
+    LOG_DEBUG("recompressing");
+    setMax(Build.ChunkManifestList.size());
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
 
-    char guidBuffer[16];
-    char guidBuffer2[16];
-    auto iterator = fs::recursive_directory_iterator(CacheDir);
-    for (auto& p : iterator) {
+    // chunks that were converted already are skipped, so a cancelled run picks up where it left off
+    auto ioStart = std::chrono::steady_clock::now();
+    uint64_t ioBytes = 0;
+    size_t recompressCount = 0;
+    for (auto& chunk : Build.ChunkManifestList) {
         if (flag.cancelled()) {
-            return;
-        }
-
-        if (!p.is_regular_file()) {
-            continue;
-        }
-
-        auto res = ValidChunkFile(CacheDir, p.path());
-        if (res == 1) {
-            iterator.pop();
-            continue;
-        }
-        else if (res == 2) {
-            continue;
+            break;
         }
 
-        auto filename = p.path().filename().string();
-        if (filename.size() == 32 && sscanf(filename.c_str(), "%016llX%016llX", guidBuffer2, guidBuffer2 + 8) == 2) {
-            *(unsigned long long*)guidBuffer = HTONLL(*(unsigned long long*)guidBuffer2);
-            *(unsigned long long*)(guidBuffer + 8) = HTONLL(*(unsigned long long*)(guidBuffer2 + 8));
-            if (!ManifestGuids.erase(guidBuffer)) {
-                fs::remove(p);
+        auto chunkStart = std::chrono::steady_clock::now();
+        auto chunkBytes = StorageData.RecompressChunk(chunk, flag);
+        if (chunkBytes) {
+            recompressCount++;
+            auto now = std::chrono::steady_clock::now();
+
+            // stay idle long enough to only use cpuShare of the time, and to keep the io under ioBytesPerSec
+            auto resumeTime = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>((now - chunkStart) * ((1 - cpuShare) / cpuShare));
+            ioBytes += chunkBytes;
+            if (ioBytesPerSec) {
+                resumeTime = std::max(resumeTime, ioStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((double)ioBytes / ioBytesPerSec)));
             }
+            std::this_thread::sleep_until(resumeTime);
         }
+        onProg();
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    if (!flag.cancelled()) {
+        onFinish();
     }
+    LOG_DEBUG("recompressed %zu chunks", recompressCount);
+}
+
+void MountedBuild::PurgeUnusedChunks(cancel_flag& flag) {
+    LOG_DEBUG("purging");
+    // the storage journal knows about every stored chunk, no need to walk the cache dir
+    // chunks of the other retained builds are kept
+    StorageData.PurgeUnusedChunks(flag);
     LOG_DEBUG("purged");
 }
 
@@ -478,12 +488,13 @@ void MountedBuild::QueryChunks(QueryChunkCallback onQuery, cancel_flag& flag, ui
             data.Chunk = chunk;
             if (StorageData.IsChunkDownloaded(chunk)) {
                 data.Downloaded = true;
-                StorageData.GetChunkMetadata(chunk, data.Flags, data.FileSize);
+                StorageData.GetChunkMetadata(chunk, data.Flags, data.FileSize, data.Linked);
             }
             else {
                 data.Downloaded = false;
                 data.Flags = 0;
                 data.FileSize = 0;
+                data.Linked = false;
             }
             SAFE_FLAG_RETURN();
             onQuery(data, false);
@@ -508,7 +519,12 @@ void MountedBuild::QueryChunks(QueryChunkCallback onQuery, cancel_flag& flag, ui
 
 uint32_t MountedBuild::GetMissingChunkCount()
 {
-   return std::count_if(Build.ChunkManifestList.begin(), Build.ChunkManifestList.end(), [&](auto& a) { return !StorageData.IsChunkDownloaded(a); });
+    return StorageData.GetMissingChunkCount();
+}
+
+void MountedBuild::SetBackgroundLimits(uint64_t downloadBytesPerSec, uint64_t writeBytesPerSec)
+{
+    StorageData.SetBackgroundLimits(downloadBytesPerSec, writeBytesPerSec);
 }
 
 void MountedBuild::LaunchGame(const char* additionalArgs) {
@@ -538,6 +554,10 @@ void MountedBuild::FileRead(PVOID Handle, PVOID Buffer, UINT64 offset, ULONG len
         uint32_t BytesRead = 0;
         for (auto chunkPart = file->ChunkParts.begin() + ChunkStartIndex; chunkPart != file->ChunkParts.end(); chunkPart++) {
             auto chunkBuffer = StorageData.GetChunkPart(*chunkPart, cancel_flag());
+            if (!chunkBuffer) {
+                LOG_ERROR("Could not get chunk %s for %s", chunkPart->Chunk->GetGuid().c_str(), file->FileName.c_str());
+                break;
+            }
             if (((int64_t)length - (int64_t)BytesRead) > (int64_t)chunkPart->Size - (int64_t)ChunkStartOffset) { // copy the entire buffer over
                 //LOG_DEBUG("Copying to %d, size %d", BytesRead, chunkPart->Size - ChunkStartOffset);
                 memcpy((char*)Buffer + BytesRead, chunkBuffer.get() + ChunkStartOffset, chunkPart->Size - ChunkStartOffset);
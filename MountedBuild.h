@@ -18,13 +18,14 @@ struct ChunkMetadata {
 	bool Downloaded;
 	size_t FileSize;
 	uint16_t Flags;
+	bool Linked; // deduplicated, FileSize is shared with another chunk
 };
 
 typedef std::function<void(const ChunkMetadata& meta, bool lastUpdate)> QueryChunkCallback;
 
 class MountedBuild {
 public:
-	MountedBuild(Manifest manifest, fs::path mountDir, fs::path cachePath, uint32_t storageFlags, uint32_t memoryPoolCapacity);
+	MountedBuild(Manifest manifest, fs::path mountDir, fs::path cachePath, uint32_t storageFlags, size_t memoryPoolCapacity, size_t compressedCacheCapacity, uint32_t retainedBuildCount, uint32_t archiveAfterDays);
 	~MountedBuild();
 
 	static bool SetupCacheDirectory(fs::path CacheDir);
@@ -32,8 +33,14 @@ public:
 	void PreloadAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHandler onProg, ProgressFinishHandler onFinish, cancel_flag& flag, uint32_t threadCount);
 	void VerifyAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHandler onProg, ProgressFinishHandler onFinish, cancel_flag& flag, uint32_t threadCount);
 	void PurgeUnusedChunks(cancel_flag& flag);
+	// Converts stored chunks to the current compression settings in the background
+	// cpuShare is the fraction of time it's allowed to spend working, ioBytesPerSec caps the bytes it reads and writes
+	void RecompressAllChunks(ProgressSetMaxHandler setMax, ProgressIncrHandler onProg, ProgressFinishHandler onFinish, cancel_flag& flag, float cpuShare, uint64_t ioBytesPerSec);
 	void QueryChunks(QueryChunkCallback onQuery, cancel_flag& flag, uint32_t threadCount);
 	uint32_t GetMissingChunkCount();
+	// Caps preloading downloads and background writes in bytes per second, 0 is unlimited, can be changed while they're running
+	// Reads from the mounted game are never held to them
+	void SetBackgroundLimits(uint64_t downloadBytesPerSec, uint64_t writeBytesPerSec);
 	void LaunchGame(const char* additionalArgs);
 
 	const fs::path& GetCachePath() const {
@@ -91,6 +91,21 @@ void Stats::UpdateData()
 	Data.provide = (provide - prevProvide) * refreshScale;
 	Data.download = (download - prevDownload) * refreshScale;
 	Data.latency = ((double)(latNs - prevLatNs) / (latOp - prevLatOp)) / 1000000 * refreshScale;
+	Data.queue = WriteQueueCount.load(std::memory_order_relaxed);
+	Data.fetchInteractive = FetchQueueInteractive.load(std::memory_order_relaxed);
+	Data.fetchPrefetch = FetchQueuePrefetch.load(std::memory_order_relaxed);
+	Data.fetchBackground = FetchQueueBackground.load(std::memory_order_relaxed);
+	{
+		// since starting, hedges are rare enough that a second's worth doesn't say much
+		auto fetches = FetchCount.load(std::memory_order_relaxed);
+		auto hedges = HedgeCount.load(std::memory_order_relaxed);
+		Data.hedgeRate = fetches ? hedges * 100.f / fetches : 0;
+		Data.hedgeWinRate = hedges ? HedgeWinCount.load(std::memory_order_relaxed) * 100.f / hedges : 0;
+	}
+	{
+		auto recompressTotal = RecompressTotal.load(std::memory_order_relaxed);
+		Data.recompress = recompressTotal ? RecompressDone.load(std::memory_order_relaxed) * 100.f / recompressTotal : 0;
+	}
 
 	prevRead = read;
 	prevWrite = write;
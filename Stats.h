@@ -20,6 +20,13 @@ struct StatsUpdateData {
 	DEFINE_STAT(download, size_t)
 	DEFINE_STAT(latency, float)
 	DEFINE_STAT(threads, int)
+	DEFINE_STAT(queue, size_t)
+	DEFINE_STAT(fetchInteractive, size_t)
+	DEFINE_STAT(fetchPrefetch, size_t)
+	DEFINE_STAT(fetchBackground, size_t)
+	DEFINE_STAT(hedgeRate, float)
+	DEFINE_STAT(hedgeWinRate, float)
+	DEFINE_STAT(recompress, float)
 
 #undef DEFINE_STAT
 };
@@ -78,6 +85,15 @@ public:
 	static inline std::atomic_uint64_t DownloadCount = 0;
 	static inline std::atomic_uint64_t LatOpCount = 0;
 	static inline std::atomic_uint64_t LatNsCount = 0;
+	static inline std::atomic_uint32_t WriteQueueCount = 0; // chunks waiting to be compressed and written, not a running total
+	static inline std::atomic_uint32_t FetchQueueInteractive = 0; // downloads waiting for a connection by priority, not running totals either
+	static inline std::atomic_uint32_t FetchQueuePrefetch = 0;
+	static inline std::atomic_uint32_t FetchQueueBackground = 0;
+	static inline std::atomic_uint64_t FetchCount = 0; // chunk requests that finished
+	static inline std::atomic_uint64_t HedgeCount = 0; // of those, ones that were hedged because the server was slow to answer
+	static inline std::atomic_uint64_t HedgeWinCount = 0; // and ones where the hedge finished first
+	static inline std::atomic_uint32_t RecompressDone = 0; // progress of the background recompression, reset when it starts
+	static inline std::atomic_uint32_t RecompressTotal = 0;
 
 private:
 	static inline StatsUpdateData Data;
@@ -0,0 +1,569 @@
+/*
+Benchmarks every codec and level Compressor can store chunks with, plus zlib through libdeflate
+
+Usage:
+CodecBench <dir> [--limit <chunk count>] [--threads N] [--json out.json]
+CodecBench --synthetic <chunk count> [--threads N] [--json out.json]
+
+<dir> can be a cache folder, its loose chunk files and pack records are decoded and benchmarked (dictionaries in <dir>/dicts are loaded for that)
+Any other folder has its files split into 1 MB pieces instead, like a game install
+--limit only loads a random sample of that many chunks, everything is kept in memory while benchmarking
+Chunks are compressed in CHUNK_BLOCK_SIZE blocks like Storage does (LZMA in one block, like archived cold chunks), so the ratios and speeds match what the cache gets
+
+*/
+
+#include "../storage/compression.h"
+#include "../storage/pack.h"
+#include "../storage/record.h"
+
+#include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+namespace ch = std::chrono;
+
+#define RAW_CHUNK_SIZE (1024 * 1024) // what files that aren't chunks are split into, the usual chunk window size
+
+struct CODEC {
+	const char* Name;
+	const char* Level;
+	uint32_t StorageFlags; // 0 for zlib and LZMA, they aren't storage methods
+	uint16_t ChunkFlags;
+	int ZlibLevel;
+};
+
+// LZMA is what cold chunks are archived with, as a single block per chunk
+inline bool IsArchive(const CODEC& Codec) {
+	return Codec.ChunkFlags == ChunkFlagLZMA;
+}
+
+struct RESULT {
+	const CODEC* Codec;
+	size_t RawSize;
+	size_t StoredSize;
+	double CompressSecs;
+	double DecompressSecs;
+	double DecodeP50; // per chunk, in microseconds
+	double DecodeP99;
+	size_t Failures; // chunks that didn't decompress back to the same bytes
+};
+
+static const char* LevelNames[] = { "Fastest", "Fast", "Normal", "Slow", "Slowest" };
+static const uint32_t LevelFlags[] = { StorageCompressFastest, StorageCompressFast, StorageCompressNormal, StorageCompressSlow, StorageCompressSlowest };
+static const int ZlibLevels[] = { 1, 3, 6, 9, 12 };
+
+std::vector<CODEC> GetCodecs() {
+	std::vector<CODEC> codecs;
+	codecs.push_back({ "None", "-", StorageDecompressed, ChunkFlagDecompressed, 0 });
+	for (int i = 0; i < 5; ++i) {
+		codecs.push_back({ "Zstd", LevelNames[i], StorageZstd | LevelFlags[i], ChunkFlagZstd, 0 });
+	}
+	for (int i = 0; i < 5; ++i) {
+		codecs.push_back({ "LZ4HC", LevelNames[i], StorageLZ4 | LevelFlags[i], ChunkFlagLZ4, 0 });
+	}
+#ifdef _WIN32
+	for (int i = 0; i < 5; ++i) {
+		codecs.push_back({ "Selkie", LevelNames[i], StorageSelkie | LevelFlags[i], ChunkFlagOodle, 0 });
+	}
+#endif
+	for (int i = 0; i < 5; ++i) {
+		codecs.push_back({ "Zlib", LevelNames[i], 0, ChunkFlagZlib, ZlibLevels[i] });
+	}
+	codecs.push_back({ "LZMA", "Archive", 0, ChunkFlagLZMA, 0 });
+	return codecs;
+}
+
+// Where a chunk to benchmark is, only read once the sample is picked
+struct CHUNK_SOURCE {
+	fs::path Path;
+	uint64_t Offset;
+	uint64_t Size;
+	bool Stored; // a stored chunk (loose file or pack record) that has to be decoded, not a piece of some other file
+};
+
+inline bool ReadFile(const fs::path& path, std::vector<char>& data) {
+	auto fp = fopen(path.string().c_str(), "rb");
+	if (!fp) {
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	auto size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	auto readSize = fread(data.data(), 1, data.size(), fp);
+	fclose(fp);
+	return readSize == data.size();
+}
+
+// Loose chunk files are in XX/<32 hex chars>, same as Chunk::GetFilePath
+inline bool IsChunkFile(const fs::path& path) {
+	auto name = path.filename().string();
+	auto dir = path.parent_path().filename().string();
+	return name.size() == 32 && dir.size() == 2 && name.compare(0, 2, dir) == 0 &&
+		std::all_of(name.begin(), name.end(), [](char c) { return isxdigit((unsigned char)c); });
+}
+
+// Pack indexes are <dir>/packs/index, and its packs are next to it
+inline bool IsPackIndex(const fs::path& path) {
+	return path.filename() == "index" && path.parent_path().filename() == "packs";
+}
+
+// Replays the index like PackStore does, later records replace earlier ones and 0 sized ones are removals
+bool AddPackRecords(const fs::path& indexPath, std::vector<CHUNK_SOURCE>& sources) {
+	auto fp = fopen(indexPath.string().c_str(), "rb");
+	if (!fp) {
+		return false;
+	}
+	PACK_INDEX_HEADER header;
+	if (fread(&header, sizeof(PACK_INDEX_HEADER), 1, fp) != 1 || header.Magic != PACK_INDEX_MAGIC || header.Version != PACK_INDEX_VERSION) {
+		fclose(fp);
+		return false;
+	}
+	std::unordered_map<guid_key, PACK_INDEX_ENTRY, guid_hash> index;
+	PACK_INDEX_ENTRY entry;
+	while (fread(&entry, sizeof(PACK_INDEX_ENTRY), 1, fp) == 1) {
+		if (entry.Size) {
+			index[entry.Guid] = entry;
+		}
+		else {
+			index.erase(entry.Guid);
+		}
+	}
+	fclose(fp);
+
+	char packName[10];
+	for (auto& record : index) {
+		sprintf(packName, "%04hX.pack", record.second.Pack);
+		sources.push_back({ indexPath.parent_path() / packName, record.second.Offset, record.second.Size, true });
+	}
+	return true;
+}
+
+// Returns the chunk's raw data from a stored chunk file
+bool DecodeStoredChunk(Compressor& compressor, const std::vector<char>& data, std::vector<char>& out) {
+	if (data.size() < sizeof(CHUNK_HEADER)) {
+		return false;
+	}
+	auto header = (const CHUNK_HEADER*)data.data();
+	if (header->version == CHUNK_VERSION_BLOCKS) {
+		auto blockHeader = GetBlockHeader(data.data(), data.size());
+		if (!blockHeader) {
+			return false;
+		}
+		auto dictId = header->flags & ChunkFlagDictionary ? *(const uint32_t*)(blockHeader + 1) : 0;
+		auto blockEnds = (const uint32_t*)(data.data() + GetBlockTableOffset(header->flags));
+		auto blocks = (const char*)(blockEnds + blockHeader->BlockCount);
+		out.resize(blockHeader->DecompressedSize);
+		for (uint32_t i = 0; i < blockHeader->BlockCount; ++i) {
+			auto blockStart = i ? blockEnds[i - 1] : 0;
+			auto blockSize = (std::min)(blockHeader->BlockSize, blockHeader->DecompressedSize - i * blockHeader->BlockSize);
+			if (blockEnds[i] < blockStart ||
+				!compressor.DecompressInto(header->flags, blocks + blockStart, blockEnds[i] - blockStart, out.data() + i * blockHeader->BlockSize, blockSize, dictId)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	if (header->version != 0) {
+		return false;
+	}
+
+	auto payload = data.data() + sizeof(CHUNK_HEADER);
+	auto payloadSize = data.size() - sizeof(CHUNK_HEADER);
+	Compressor::buffer_value decoded;
+	switch (header->flags & ChunkFlagCompMask)
+	{
+	case ChunkFlagDecompressed:
+		out.assign(payload, payload + payloadSize);
+		return true;
+	case ChunkFlagZstd:
+		decoded = compressor.ZstdDecompress(payload, payloadSize);
+		break;
+	case ChunkFlagZlib:
+		decoded = compressor.ZlibDecompress(payload, payloadSize);
+		break;
+	case ChunkFlagLZ4:
+		decoded = compressor.LZ4Decompress(payload, payloadSize);
+		break;
+	case ChunkFlagOodle:
+		decoded = compressor.OodleDecompress(payload, payloadSize);
+		break;
+	default:
+		return false;
+	}
+	if (!decoded.first) {
+		return false;
+	}
+	out.assign(decoded.first.get(), decoded.first.get() + decoded.second);
+	return true;
+}
+
+// Reads Source into data, fp is kept open for the next source if it's in the same file
+bool ReadSource(const CHUNK_SOURCE& Source, FILE*& fp, fs::path& openPath, std::vector<char>& data) {
+	if (!fp || openPath != Source.Path) {
+		if (fp) {
+			fclose(fp);
+		}
+		fp = fopen(Source.Path.string().c_str(), "rb");
+		openPath = Source.Path;
+		if (!fp) {
+			return false;
+		}
+	}
+	data.resize(Source.Size);
+#ifdef _WIN32
+	auto seekFailed = _fseeki64(fp, Source.Offset, SEEK_SET);
+#else
+	auto seekFailed = fseeko(fp, Source.Offset, SEEK_SET);
+#endif
+	return !seekFailed && fread(data.data(), 1, data.size(), fp) == data.size();
+}
+
+bool LoadDirectory(const fs::path& dir, size_t limit, std::vector<std::vector<char>>& chunks) {
+	std::vector<CHUNK_SOURCE> stored;
+	std::vector<CHUNK_SOURCE> raw;
+	size_t packCount = 0;
+	bool hasPackIndex = false;
+	std::error_code ec;
+	for (auto& p : fs::recursive_directory_iterator(dir, ec)) {
+		if (!p.is_regular_file(ec)) {
+			continue;
+		}
+		auto size = p.file_size(ec);
+		if (IsChunkFile(p.path())) {
+			stored.push_back({ p.path(), 0, size, true });
+		}
+		else if (IsPackIndex(p.path())) {
+			if (!AddPackRecords(p.path(), stored)) {
+				printf("Could not read the pack index %s\n", p.path().string().c_str());
+			}
+			hasPackIndex = true;
+		}
+		else if (p.path().extension() == ".pack") {
+			packCount++; // read through the index
+		}
+		else {
+			for (uint64_t pos = 0; pos < size; pos += RAW_CHUNK_SIZE) {
+				raw.push_back({ p.path(), pos, (std::min)(size - pos, (uint64_t)RAW_CHUNK_SIZE), false });
+			}
+		}
+	}
+	if (stored.empty() && (packCount || hasPackIndex)) {
+		// benchmarking the packs as raw data would just measure how well already compressed chunks compress
+		printf("%s has pack files but no readable pack index, nothing to benchmark\n", dir.string().c_str());
+		return false;
+	}
+
+	// not a cache, so it's probably a game install
+	auto& sources = stored.empty() ? raw : stored;
+	if (limit && sources.size() > limit) {
+		std::mt19937 rng(2020); // fixed, so runs can be compared
+		std::shuffle(sources.begin(), sources.end(), rng);
+		sources.resize(limit);
+	}
+	// in file order, so the packs are read front to back
+	std::sort(sources.begin(), sources.end(), [](const CHUNK_SOURCE& a, const CHUNK_SOURCE& b) {
+		return std::tie(a.Path, a.Offset) < std::tie(b.Path, b.Offset);
+	});
+
+	// the decompressed method doesn't create CDicts, but the DDicts are all that's needed here
+	Compressor decoder(StorageDecompressed);
+	std::vector<char> data;
+	if (!stored.empty()) {
+		for (auto& p : fs::directory_iterator(dir / "dicts", ec)) {
+			if (p.path().extension() == ".dict" && ReadFile(p.path(), data)) {
+				decoder.AddDictionary(data.data(), data.size());
+			}
+		}
+	}
+
+	FILE* fp = nullptr;
+	fs::path openPath;
+	size_t badCount = 0;
+	for (auto& source : sources) {
+		if (!ReadSource(source, fp, openPath, data)) {
+			badCount++;
+			continue;
+		}
+		if (!source.Stored) {
+			chunks.emplace_back(std::move(data));
+			continue;
+		}
+		std::vector<char> chunk;
+		if (DecodeStoredChunk(decoder, data, chunk) && !chunk.empty()) {
+			chunks.emplace_back(std::move(chunk));
+		}
+		else {
+			badCount++;
+		}
+	}
+	if (fp) {
+		fclose(fp);
+	}
+	if (badCount) {
+		printf("Skipped %zu chunks that couldn't be read or decoded\n", badCount);
+	}
+	return true;
+}
+
+// A mix of what game files look like: text, small structured records, runs of zeroes, and incompressible (already compressed) data
+void MakeSyntheticChunks(size_t count, std::vector<std::vector<char>>& chunks) {
+	static const char* words[] = { "Actor", "Mesh", "Texture", "Material", "Sound", "Anim", "Blueprint", "Default", "Component", "Level", "_C", "/Game/", "Athena", "Weapon", "Shader" };
+	std::mt19937 rng(2020); // fixed, so runs can be compared
+	for (size_t i = 0; i < count; ++i) {
+		std::vector<char> chunk(RAW_CHUNK_SIZE);
+		switch (i % 4)
+		{
+		case 0:
+			for (size_t pos = 0; pos < chunk.size();) {
+				auto word = words[rng() % (sizeof(words) / sizeof(*words))];
+				auto len = (std::min)(strlen(word), chunk.size() - pos);
+				memcpy(chunk.data() + pos, word, len);
+				pos += len;
+				if (pos < chunk.size()) {
+					chunk[pos++] = rng() % 8 ? ' ' : '\n';
+				}
+			}
+			break;
+		case 1:
+			for (size_t pos = 0; pos + sizeof(uint32_t) <= chunk.size(); pos += sizeof(uint32_t)) {
+				uint32_t value = pos / 64 + rng() % 16;
+				memcpy(chunk.data() + pos, &value, sizeof(uint32_t));
+			}
+			break;
+		case 2:
+			for (auto& c : chunk) {
+				c = rng();
+			}
+			break;
+		case 3:
+			for (size_t pos = 0; pos < chunk.size(); pos += 4096) {
+				if (rng() % 2) { // the rest stays zeroed
+					for (size_t j = pos; j < (std::min)(pos + 4096, chunk.size()); ++j) {
+						chunk[j] = rng();
+					}
+				}
+			}
+			break;
+		}
+		chunks.emplace_back(std::move(chunk));
+	}
+}
+
+// Runs Func(chunkIndex, threadIndex) for every chunk on threadCount threads, returns the wall time in seconds
+template<typename F>
+double RunThreads(size_t chunkCount, uint32_t threadCount, F&& Func) {
+	std::atomic_size_t next = 0;
+	std::vector<std::thread> threads;
+	auto start = ch::steady_clock::now();
+	for (uint32_t t = 0; t < threadCount; ++t) {
+		threads.emplace_back([&, t]() {
+			for (auto i = next++; i < chunkCount; i = next++) {
+				Func(i, t);
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	return ch::duration<double>(ch::steady_clock::now() - start).count();
+}
+
+RESULT Benchmark(const CODEC& codec, const std::vector<std::vector<char>>& chunks, uint32_t threadCount) {
+	RESULT result{};
+	result.Codec = &codec;
+
+	Compressor compressor(codec.StorageFlags ? codec.StorageFlags : (uint32_t)StorageDecompressed);
+	std::vector<libdeflate_compressor*> zlibCompressors(threadCount);
+	if (codec.ZlibLevel) {
+		for (auto& zlibCompressor : zlibCompressors) {
+			zlibCompressor = libdeflate_alloc_compressor(codec.ZlibLevel);
+		}
+	}
+
+	// [chunk][block]
+	std::vector<std::vector<Compressor::buffer_value>> compressed(chunks.size());
+	result.CompressSecs = RunThreads(chunks.size(), threadCount, [&](size_t i, uint32_t t) {
+		auto& chunk = chunks[i];
+		auto blockSize = IsArchive(codec) ? chunk.size() : CHUNK_BLOCK_SIZE;
+		for (size_t pos = 0; pos < chunk.size(); pos += blockSize) {
+			auto size = (std::min)(chunk.size() - pos, blockSize);
+			if (IsArchive(codec)) {
+				compressed[i].emplace_back(compressor.ArchiveCompress(chunk.data() + pos, size));
+			}
+			else if (codec.ZlibLevel) {
+				auto bound = libdeflate_zlib_compress_bound(zlibCompressors[t], size);
+				auto buffer = std::shared_ptr<char[]>(new char[bound]);
+				auto outSize = libdeflate_zlib_compress(zlibCompressors[t], chunk.data() + pos, size, buffer.get(), bound);
+				compressed[i].emplace_back(buffer, outSize);
+			}
+			else {
+				compressed[i].emplace_back(compressor.StorageCompress(chunk.data() + pos, size));
+			}
+		}
+	});
+
+	for (auto& zlibCompressor : zlibCompressors) {
+		if (zlibCompressor) {
+			libdeflate_free_compressor(zlibCompressor);
+		}
+	}
+
+	std::vector<std::vector<double>> latencies(threadCount);
+	std::vector<std::vector<char>> outBuffers(threadCount);
+	std::atomic_size_t failures = 0;
+	result.DecompressSecs = RunThreads(chunks.size(), threadCount, [&](size_t i, uint32_t t) {
+		auto& chunk = chunks[i];
+		auto& out = outBuffers[t];
+		out.resize(chunk.size());
+
+		bool ok = true;
+		auto blockSize = IsArchive(codec) ? chunk.size() : CHUNK_BLOCK_SIZE;
+		auto start = ch::steady_clock::now();
+		for (size_t b = 0; b < compressed[i].size(); ++b) {
+			auto pos = b * blockSize;
+			auto size = (std::min)(chunk.size() - pos, blockSize);
+			ok &= compressor.DecompressInto(codec.ChunkFlags, compressed[i][b].first.get(), compressed[i][b].second, out.data() + pos, size);
+		}
+		latencies[t].emplace_back(ch::duration<double, std::micro>(ch::steady_clock::now() - start).count());
+
+		if (!ok || memcmp(out.data(), chunk.data(), chunk.size())) {
+			failures++;
+		}
+	});
+	result.Failures = failures;
+
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		result.RawSize += chunks[i].size();
+		for (auto& block : compressed[i]) {
+			result.StoredSize += block.second;
+		}
+	}
+
+	std::vector<double> allLatencies;
+	for (auto& threadLatencies : latencies) {
+		allLatencies.insert(allLatencies.end(), threadLatencies.begin(), threadLatencies.end());
+	}
+	std::sort(allLatencies.begin(), allLatencies.end());
+	if (!allLatencies.empty()) {
+		result.DecodeP50 = allLatencies[(std::min)(allLatencies.size() - 1, allLatencies.size() / 2)];
+		result.DecodeP99 = allLatencies[(std::min)(allLatencies.size() - 1, allLatencies.size() * 99 / 100)];
+	}
+	return result;
+}
+
+inline double GetMBps(size_t bytes, double secs) {
+	return secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+}
+
+void PrintTable(const std::vector<RESULT>& results) {
+	printf("%-8s %-8s %8s %12s %12s %10s %10s %8s\n", "Codec", "Level", "Ratio", "Comp MB/s", "Decomp MB/s", "p50 us", "p99 us", "Failed");
+	for (auto& result : results) {
+		printf("%-8s %-8s %7.2f%% %12.1f %12.1f %10.1f %10.1f %8zu\n",
+			result.Codec->Name, result.Codec->Level,
+			result.RawSize ? result.StoredSize * 100. / result.RawSize : 100.,
+			GetMBps(result.RawSize, result.CompressSecs), GetMBps(result.RawSize, result.DecompressSecs),
+			result.DecodeP50, result.DecodeP99, result.Failures);
+	}
+}
+
+bool WriteJson(const char* path, const std::vector<RESULT>& results, size_t chunkCount, size_t byteCount, uint32_t threadCount) {
+	auto fp = fopen(path, "wb");
+	if (!fp) {
+		return false;
+	}
+	fprintf(fp, "{\n\t\"chunks\": %zu,\n\t\"bytes\": %zu,\n\t\"threads\": %u,\n\t\"block_size\": %u,\n\t\"results\": [\n", chunkCount, byteCount, threadCount, CHUNK_BLOCK_SIZE);
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto& result = results[i];
+		fprintf(fp, "\t\t{ \"codec\": \"%s\", \"level\": \"%s\", \"ratio\": %.4f, \"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, \"decode_p50_us\": %.2f, \"decode_p99_us\": %.2f, \"failures\": %zu }%s\n",
+			result.Codec->Name, result.Codec->Level,
+			result.RawSize ? (double)result.StoredSize / result.RawSize : 1.,
+			GetMBps(result.RawSize, result.CompressSecs), GetMBps(result.RawSize, result.DecompressSecs),
+			result.DecodeP50, result.DecodeP99, result.Failures,
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(fp, "\t]\n}\n");
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	const char* dir = nullptr;
+	size_t syntheticCount = 0;
+	size_t limit = 0;
+	uint32_t threadCount = (std::max)(std::thread::hardware_concurrency(), 1u);
+	const char* jsonPath = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--synthetic" && i + 1 < argc) {
+			syntheticCount = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--limit" && i + 1 < argc) {
+			limit = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			threadCount = (std::max)(atoi(argv[++i]), 1);
+		}
+		else if (arg == "--json" && i + 1 < argc) {
+			jsonPath = argv[++i];
+		}
+		else if (!dir && arg.compare(0, 2, "--")) {
+			dir = argv[i];
+		}
+		else {
+			printf("Unknown argument %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (!dir == !syntheticCount) {
+		printf("Usage: %s <dir> [--limit <chunk count>] | --synthetic <chunk count> [--threads N] [--json out.json]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<std::vector<char>> chunks;
+	if (dir) {
+		if (!LoadDirectory(dir, limit, chunks)) {
+			return 1;
+		}
+	}
+	else {
+		MakeSyntheticChunks(syntheticCount, chunks);
+	}
+	if (chunks.empty()) {
+		printf("No chunks to benchmark\n");
+		return 1;
+	}
+	size_t byteCount = 0;
+	for (auto& chunk : chunks) {
+		byteCount += chunk.size();
+	}
+	printf("Benchmarking %zu chunks (%.1f MB) on %u threads\n\n", chunks.size(), byteCount / (1024. * 1024), threadCount);
+
+	auto codecs = GetCodecs();
+	std::vector<RESULT> results;
+	for (auto& codec : codecs) {
+		results.emplace_back(Benchmark(codec, chunks, threadCount));
+	}
+
+	PrintTable(results);
+	if (jsonPath && !WriteJson(jsonPath, results, chunks.size(), byteCount, threadCount)) {
+		printf("Could not write %s\n", jsonPath);
+		return 1;
+	}
+
+	for (auto& result : results) {
+		if (result.Failures) {
+			return 2;
+		}
+	}
+	return 0;
+}
\ No newline at end of file
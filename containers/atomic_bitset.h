@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <memory>
+
+// Fixed size bitset where every bit can be set/tested from any thread without locking
+class atomic_bitset {
+public:
+	atomic_bitset(size_t size) :
+		bit_count(size),
+		words(std::make_unique<std::atomic_uint64_t[]>(word_count())) { }
+
+	bool test(size_t index) const {
+		return words[index / 64].load(std::memory_order_acquire) & mask(index);
+	}
+
+	void set(size_t index) {
+		words[index / 64].fetch_or(mask(index), std::memory_order_release);
+	}
+
+	void reset(size_t index) {
+		words[index / 64].fetch_and(~mask(index), std::memory_order_release);
+	}
+
+	size_t count() const {
+		size_t ret = 0;
+		for (size_t i = 0; i < word_count(); ++i) {
+			ret += std::popcount(words[i].load(std::memory_order_relaxed));
+		}
+		return ret;
+	}
+
+	size_t size() const {
+		return bit_count;
+	}
+
+private:
+	static constexpr uint64_t mask(size_t index) {
+		return 1ull << (index % 64);
+	}
+
+	size_t word_count() const {
+		return (bit_count + 63) / 64;
+	}
+
+	size_t bit_count;
+	std::unique_ptr<std::atomic_uint64_t[]> words;
+};
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Chunk guids stored by value, so lookups don't depend on the lifetime of the manifest's Chunk objects
+struct guid_key {
+	uint64_t lo;
+	uint64_t hi;
+
+	guid_key() : lo(0), hi(0) { }
+
+	guid_key(const char guid[16]) {
+		memcpy(&lo, guid, 8);
+		memcpy(&hi, guid + 8, 8);
+	}
+
+	// Parses the 32 character hex form (Chunk::GetGuid, chunk file names)
+	static bool parse(const char* str, guid_key& out) {
+		char guid[16];
+		for (int i = 0; i < 16; ++i) {
+			int hi = hex_value(str[i * 2]);
+			int lo = hi < 0 ? -1 : hex_value(str[i * 2 + 1]);
+			if (lo < 0) {
+				return false;
+			}
+			guid[i] = (hi << 4) | lo;
+		}
+		out = guid_key(guid);
+		return true;
+	}
+
+	bool operator==(const guid_key& other) const {
+		return lo == other.lo && hi == other.hi;
+	}
+
+	bool operator!=(const guid_key& other) const {
+		return !(*this == other);
+	}
+
+private:
+	static int hex_value(char c) {
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		if (c >= 'A' && c <= 'F') {
+			return c - 'A' + 10;
+		}
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		return -1;
+	}
+};
+
+// guids are random, no need for anything fancier
+struct guid_hash {
+	size_t operator()(const guid_key& key) const {
+		return key.lo ^ key.hi;
+	}
+};
\ No newline at end of file
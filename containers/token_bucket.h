@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Limits how many bytes per second go through it, 0 bytes per second is unlimited
+// Taking more than there is goes into debt instead of failing, the caller just waits it off before using them
+// Changing the rate wakes up anything waiting in consume, setting it to 0 forgives the debt and lets them all through
+class token_bucket {
+public:
+	using clock = std::chrono::steady_clock;
+
+	token_bucket(uint64_t bytes_per_sec = 0) :
+		rate(bytes_per_sec),
+		tokens(0),
+		last(clock::now()) { }
+
+	void set_rate(uint64_t bytes_per_sec) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			refill();
+			rate = bytes_per_sec;
+			tokens = rate ? std::min(tokens, burst()) : 0;
+		}
+		cv.notify_all();
+	}
+
+	uint64_t get_rate() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return rate;
+	}
+
+	// Takes count bytes, returns how long to wait before using them (zero if they're there already)
+	clock::duration take(uint64_t count) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!rate) {
+			return clock::duration::zero();
+		}
+		refill();
+		tokens -= count;
+		if (tokens >= 0) {
+			return clock::duration::zero();
+		}
+		return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-tokens / rate));
+	}
+
+	// Takes count bytes, and blocks until they can be used (or the limit is lifted)
+	void consume(uint64_t count) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (!rate) {
+			return;
+		}
+		refill();
+		tokens -= count;
+		// the wait is worked out again after every wakeup, the rate could've changed
+		while (rate && tokens < 0) {
+			cv.wait_for(lock, std::chrono::duration<double>(-tokens / rate));
+			refill();
+		}
+	}
+
+private:
+	// half a second of savings at most, so an idle limiter can't let a huge burst through
+	double burst() const {
+		return rate / 2.;
+	}
+
+	void refill() {
+		auto now = clock::now();
+		tokens = std::min(tokens + std::chrono::duration<double>(now - last).count() * rate, burst());
+		last = now;
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv; // consume waits on it, set_rate signals it
+	uint64_t rate;
+	double tokens;
+	clock::time_point last;
+};
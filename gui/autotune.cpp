@@ -0,0 +1,293 @@
+#include "autotune.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "AutoTune"
+#endif
+
+#include "../Logger.h"
+#include "../storage/compression.h"
+#include "../storage/record.h"
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+namespace ch = std::chrono;
+
+#define TUNE_DISK_FILE      "autotune.tmp"
+#define TUNE_DISK_SIZE      (64 * 1024 * 1024)      // bigger than most drives' own caches
+#define TUNE_CHUNK_SIZE     (1024 * 1024)           // reads and samples are the size of a usual chunk
+#define TUNE_SAMPLE_COUNT   4
+#define TUNE_DECODE_TIME    ch::milliseconds(100)   // each candidate decompresses the sample for at least this long
+#define TUNE_CANDIDATE_TIME ch::seconds(5)          // a candidate that takes longer than this is too slow to be picked anyway
+#define TUNE_RAW_RATIO      .97                     // blocks that don't compress below this are stored raw, like StorageAdaptive does
+#define TUNE_MIN_COMPRESS   (48. * 1024 * 1024)     // bytes/s all cores have to compress, so updates aren't held back by the CPU
+#define TUNE_READ_MARGIN    1.03                    // candidates this close to the fastest one are picked by ratio instead
+#define TUNE_BUFFERS_PER_MS 64                      // buffers to keep per ms it takes to read a chunk again
+#define TUNE_MIN_BUFFERS    32
+#define TUNE_MAX_BUFFERS    512                     // what the setup slider goes up to
+
+struct TUNE_RESULT {
+	SettingsCompressionMethod Method;
+	SettingsCompressionLevel Level;
+	double Ratio;         // stored size / chunk size
+	double CompressSpeed; // bytes/s on a single core
+	double DecodeSpeed;   // bytes/s on a single core
+	double ReadTime;      // seconds to read and decompress a chunk that isn't buffered
+};
+
+static const char* MethodNames[] = { "No Compression", "Zstandard", "LZ4", "Oodle Selkie" };
+static const char* LevelNames[] = { "Fastest", "Fast", "Normal", "Slow", "Slowest" };
+
+// Bytes/s the drive reads chunk sized pieces in a random order, without the OS cache
+double GetDiskReadSpeed(const fs::path& Dir, cancel_flag& flag) {
+	auto path = Dir / TUNE_DISK_FILE;
+	// unbuffered reads and writes need a sector aligned buffer, VirtualAlloc is page aligned
+	auto buffer = (char*)VirtualAlloc(NULL, TUNE_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!buffer) {
+		return 0;
+	}
+
+	auto file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		LOG_ERROR("Could not create %s", path.string().c_str());
+		VirtualFree(buffer, 0, MEM_RELEASE);
+		return 0;
+	}
+
+	// random data, so drives and folders that compress don't make it look faster
+	std::mt19937 rng(TUNE_DISK_SIZE);
+	for (size_t i = 0; i < TUNE_CHUNK_SIZE / sizeof(uint32_t); ++i) {
+		((uint32_t*)buffer)[i] = rng();
+	}
+
+	bool ok = true;
+	std::vector<uint32_t> order(TUNE_DISK_SIZE / TUNE_CHUNK_SIZE);
+	for (uint32_t i = 0; i < order.size() && ok && !flag.cancelled(); ++i) {
+		order[i] = i;
+		*(uint32_t*)buffer = i;
+		DWORD written;
+		ok = WriteFile(file, buffer, TUNE_CHUNK_SIZE, &written, NULL) && written == TUNE_CHUNK_SIZE;
+	}
+	std::shuffle(order.begin(), order.end(), rng);
+
+	auto start = ch::steady_clock::now();
+	for (auto i = order.begin(); i != order.end() && ok && !flag.cancelled(); ++i) {
+		LARGE_INTEGER offset;
+		offset.QuadPart = (long long)*i * TUNE_CHUNK_SIZE;
+		DWORD read;
+		ok = SetFilePointerEx(file, offset, NULL, FILE_BEGIN) && ReadFile(file, buffer, TUNE_CHUNK_SIZE, &read, NULL) && read == TUNE_CHUNK_SIZE;
+	}
+	auto secs = ch::duration<double>(ch::steady_clock::now() - start).count();
+
+	CloseHandle(file);
+	VirtualFree(buffer, 0, MEM_RELEASE);
+	if (flag.cancelled()) {
+		return 0;
+	}
+	if (!ok) {
+		LOG_ERROR("Could not test the drive %s is on", Dir.string().c_str());
+		return 0;
+	}
+	return TUNE_DISK_SIZE / (std::max)(secs, 1e-6);
+}
+
+// Chunks are made of a few kinds of data, so every 64 KB block is one of them: text (like ini and json files),
+// tables of small numbers (like meshes and animations), and data that's already compressed (like textures and audio)
+// The compressed blocks get stored raw whatever the method is, TestCandidate scores them that way
+std::vector<char> MakeSample() {
+	static const char* words[] = { "Actor", "Mesh", "Texture", "Material", "Sound", "Anim", "Blueprint", "Default", "Component", "Level", "_C", "/Game/", "Athena", "Weapon", "Shader" };
+	std::vector<char> sample(TUNE_SAMPLE_COUNT * TUNE_CHUNK_SIZE);
+	std::mt19937 rng(TUNE_CHUNK_SIZE); // fixed, so machines are compared on the same data
+	for (size_t blockStart = 0; blockStart < sample.size(); blockStart += CHUNK_BLOCK_SIZE) {
+		auto block = sample.data() + blockStart;
+		switch (rng() % 3)
+		{
+		case 0:
+			for (size_t pos = 0; pos < CHUNK_BLOCK_SIZE;) {
+				auto word = words[rng() % (sizeof(words) / sizeof(*words))];
+				auto len = (std::min)(strlen(word), CHUNK_BLOCK_SIZE - pos);
+				memcpy(block + pos, word, len);
+				pos += len;
+				if (pos < CHUNK_BLOCK_SIZE) {
+					block[pos++] = rng() % 8 ? ' ' : '\n';
+				}
+			}
+			break;
+		case 1:
+			for (size_t pos = 0; pos < CHUNK_BLOCK_SIZE; pos += sizeof(uint32_t)) {
+				uint32_t value = pos / 64 + rng() % 16;
+				memcpy(block + pos, &value, sizeof(uint32_t));
+			}
+			break;
+		case 2:
+			for (size_t pos = 0; pos < CHUNK_BLOCK_SIZE; pos += sizeof(uint32_t)) {
+				((uint32_t*)(block + pos))[0] = rng();
+			}
+			break;
+		}
+	}
+	return sample;
+}
+
+inline uint16_t GetChunkFlag(SettingsCompressionMethod Method) {
+	switch (Method)
+	{
+	case SettingsCompressionMethod::Zstandard:
+		return ChunkFlagZstd;
+	case SettingsCompressionMethod::LZ4:
+		return ChunkFlagLZ4;
+	case SettingsCompressionMethod::OodleSelkie:
+		return ChunkFlagOodle;
+	default:
+		return ChunkFlagDecompressed;
+	}
+}
+
+// Compresses the sample in blocks like Storage does, then times decompressing it again
+// Returns false if it was cancelled or took longer than TUNE_CANDIDATE_TIME
+bool TestCandidate(SETTINGS Settings, const std::vector<char>& Sample, double DiskSpeed, TUNE_RESULT& Result, cancel_flag& flag) {
+	Compressor compressor(SettingsGetStorageFlags(&Settings));
+
+	// blocks that didn't compress well enough are kept raw (nullptr), they're only copied when read
+	std::vector<Compressor::buffer_value> blocks;
+	size_t storedSize = 0;
+	auto start = ch::steady_clock::now();
+	for (size_t pos = 0; pos < Sample.size(); pos += CHUNK_BLOCK_SIZE) {
+		if (flag.cancelled() || ch::steady_clock::now() - start > TUNE_CANDIDATE_TIME) {
+			return false;
+		}
+		auto block = compressor.StorageCompress(Sample.data() + pos, CHUNK_BLOCK_SIZE);
+		if (!block.first || block.second > CHUNK_BLOCK_SIZE * TUNE_RAW_RATIO) {
+			block = std::make_pair(nullptr, CHUNK_BLOCK_SIZE);
+		}
+		storedSize += block.second;
+		blocks.emplace_back(std::move(block));
+	}
+	auto compressSecs = ch::duration<double>(ch::steady_clock::now() - start).count();
+
+	auto chunkFlag = GetChunkFlag(Settings.CompressionMethod);
+	auto out = std::make_unique<char[]>(CHUNK_BLOCK_SIZE);
+	size_t decodedSize = 0;
+	start = ch::steady_clock::now();
+	auto end = start;
+	do {
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			if (blocks[i].first) {
+				compressor.DecompressInto(chunkFlag, blocks[i].first.get(), blocks[i].second, out.get(), CHUNK_BLOCK_SIZE);
+			}
+			else {
+				memcpy(out.get(), Sample.data() + i * CHUNK_BLOCK_SIZE, CHUNK_BLOCK_SIZE);
+			}
+		}
+		decodedSize += Sample.size();
+		end = ch::steady_clock::now();
+		if (flag.cancelled() || end - start > TUNE_CANDIDATE_TIME) {
+			return false;
+		}
+	} while (end - start < TUNE_DECODE_TIME);
+	auto decodeSecs = ch::duration<double>(end - start).count();
+
+	Result.Method = Settings.CompressionMethod;
+	Result.Level = Settings.CompressionLevel;
+	Result.Ratio = (double)storedSize / Sample.size();
+	Result.CompressSpeed = Sample.size() / (std::max)(compressSecs, 1e-6);
+	Result.DecodeSpeed = decodedSize / (std::max)(decodeSecs, 1e-6);
+	// a chunk that isn't buffered is read from the drive and then decompressed before anything gets it
+	Result.ReadTime = Result.Ratio * TUNE_CHUNK_SIZE / DiskSpeed + TUNE_CHUNK_SIZE / Result.DecodeSpeed;
+	LOG_DEBUG("%s %s: %.1f%% size, %.0f MB/s compress, %.0f MB/s decode, %.3f ms read", MethodNames[(int)Result.Method], LevelNames[(int)Result.Level],
+		Result.Ratio * 100, Result.CompressSpeed / (1024 * 1024), Result.DecodeSpeed / (1024 * 1024), Result.ReadTime * 1000);
+	return true;
+}
+
+// More buffers the longer it takes to get a chunk again, up to 1/16th of the RAM
+uint16_t GetBufferCount(double ReadTime) {
+	MEMORYSTATUSEX memStatus;
+	memStatus.dwLength = sizeof(memStatus);
+	size_t maxBuffers = TUNE_MAX_BUFFERS;
+	if (GlobalMemoryStatusEx(&memStatus)) {
+		maxBuffers = std::clamp<size_t>(memStatus.ullTotalPhys / 16 / TUNE_CHUNK_SIZE, TUNE_MIN_BUFFERS, TUNE_MAX_BUFFERS);
+	}
+	auto count = (size_t)(ReadTime * 1000 * TUNE_BUFFERS_PER_MS);
+	count = (count + 15) / 16 * 16;
+	return std::clamp<size_t>(count, TUNE_MIN_BUFFERS, maxBuffers);
+}
+
+bool SettingsAutoTune(SETTINGS* Settings, std::function<void(uint32_t)> onSetMaximum, std::function<void()> onProgress, cancel_flag& flag) {
+	static const SettingsCompressionMethod methods[] = { SettingsCompressionMethod::Decompressed, SettingsCompressionMethod::LZ4, SettingsCompressionMethod::Zstandard, SettingsCompressionMethod::OodleSelkie };
+	auto levelCount = (int)SettingsCompressionLevel::Slowest - (int)SettingsCompressionLevel::Fastest + 1;
+	// the drive, then every level of every method but no compression
+	onSetMaximum(1 + 1 + (sizeof(methods) / sizeof(*methods) - 1) * levelCount);
+
+	auto diskSpeed = GetDiskReadSpeed(Settings->CacheDir, flag);
+	if (!diskSpeed) {
+		return false;
+	}
+	LOG_INFO("Drive reads at %.0f MB/s", diskSpeed / (1024 * 1024));
+	onProgress();
+
+	auto sample = MakeSample();
+	auto minCompressSpeed = TUNE_MIN_COMPRESS / (std::max)(std::thread::hardware_concurrency(), 1u);
+	std::vector<TUNE_RESULT> results;
+	TUNE_RESULT result;
+	for (auto method : methods) {
+		auto candidate = *Settings;
+		candidate.CompressionMethod = method;
+		if (method == SettingsCompressionMethod::Decompressed) {
+			candidate.CompressionLevel = SettingsCompressionLevel::Normal;
+			if (TestCandidate(candidate, sample, diskSpeed, result, flag)) {
+				results.emplace_back(result);
+			}
+			onProgress();
+			continue;
+		}
+		// every level decompresses at about the same speed, so only how fast it compresses keeps the higher ones out
+		for (int level = (int)SettingsCompressionLevel::Fastest; level <= (int)SettingsCompressionLevel::Slowest; ++level) {
+			candidate.CompressionLevel = (SettingsCompressionLevel)level;
+			auto tested = TestCandidate(candidate, sample, diskSpeed, result, flag);
+			if (flag.cancelled()) {
+				return false;
+			}
+			if (!tested || (result.CompressSpeed < minCompressSpeed && level != (int)SettingsCompressionLevel::Fastest)) {
+				LOG_DEBUG("%s %s and above are too slow", MethodNames[(int)method], LevelNames[level]);
+				for (; level <= (int)SettingsCompressionLevel::Slowest; ++level) {
+					onProgress();
+				}
+				break; // higher levels are only slower
+			}
+			results.emplace_back(result);
+			onProgress();
+		}
+	}
+	if (flag.cancelled() || results.empty()) {
+		return false;
+	}
+
+	std::sort(results.begin(), results.end(), [](const TUNE_RESULT& a, const TUNE_RESULT& b) {
+		return a.ReadTime < b.ReadTime;
+	});
+	// if a few are about as fast, the smallest one saves the most space
+	auto best = results.begin();
+	for (auto i = results.begin() + 1; i != results.end() && i->ReadTime <= results.front().ReadTime * TUNE_READ_MARGIN; ++i) {
+		if (i->Ratio < best->Ratio) {
+			best = i;
+		}
+	}
+	auto runnerUp = std::find_if(results.begin(), results.end(), [&](const TUNE_RESULT& result) {
+		return result.Method != best->Method;
+	});
+
+	Settings->CompressionMethod = best->Method;
+	Settings->CompressionLevel = best->Level;
+	Settings->BufferCount = GetBufferCount(best->ReadTime);
+	snprintf(Settings->TuneRationale, sizeof(Settings->TuneRationale), "%s %s: %.0f%% size, %.0f MB/s decompression, %.2f ms per chunk from a %.0f MB/s drive (%s: %.2f ms), %u buffers",
+		MethodNames[(int)best->Method], LevelNames[(int)best->Level], best->Ratio * 100, best->DecodeSpeed / (1024 * 1024), best->ReadTime * 1000, diskSpeed / (1024 * 1024),
+		runnerUp != results.end() ? MethodNames[(int)runnerUp->Method] : "-", runnerUp != results.end() ? runnerUp->ReadTime * 1000 : 0.,
+		Settings->BufferCount);
+	LOG_INFO("Tuned: %s", Settings->TuneRationale);
+	return true;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "../containers/cancel_flag.h"
+#include "settings.h"
+
+#include <functional>
+
+// Benchmarks the drive CacheDir is on and how fast each method decompresses on this CPU, then sets the
+// compression method, level and BufferCount that make reading a chunk the fastest, and why in TuneRationale
+// Takes a few seconds, so it's meant for a worker thread, onProgress is called once per drive test and candidate
+// Returns false (and leaves Settings alone) if the drive couldn't be tested or it was cancelled
+bool SettingsAutoTune(SETTINGS* Settings, std::function<void(uint32_t)> onSetMaximum, std::function<void()> onProgress, cancel_flag& flag);
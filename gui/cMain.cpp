@@ -7,6 +7,9 @@
 
 #define MOUNT_FOLDER	   "fn"
 
+#define RECOMPRESS_CPU_SHARE .25f               // the background recompression works 25% of the time at most
+#define RECOMPRESS_IO_RATE   (32 * 1024 * 1024) // and reads/writes 32 mb/s at most
+
 #ifndef LOG_SECTION
 #define LOG_SECTION "cMain"
 #endif
@@ -115,6 +118,10 @@ GameUpdateAvailable(false) {
 			CREATE_STAT(download, LSTR(MAIN_STATS_DOWNLOAD), 64 * 1024 * 1024); // 512 mbps
 			CREATE_STAT(latency, LSTR(MAIN_STATS_LATENCY), 1000); // divide by 10 to get ms
 			CREATE_STAT(threads, LSTR(MAIN_STATS_THREADS), 192); // 192 threads (threads don't ruin performance, probably just indicates overhead)
+			CREATE_STAT(queue, LSTR(MAIN_STATS_QUEUE), 64); // 64 chunks (the write queue's capacity, downloads wait when it's full)
+			CREATE_STAT(recompress, LSTR(MAIN_STATS_RECOMPRESS), 1000); // divide by 10 to get %
+			CREATE_STAT(fetchQueue, LSTR(MAIN_STATS_FETCHQUEUE), 256); // 256 chunks (a full preload keeps 4 per connection queued at the default 64)
+			CREATE_STAT(hedge, LSTR(MAIN_STATS_HEDGE), 100); // divide by 10 to get %, full at 10% (hedging at the 95th percentile should keep it around 5%)
 
 			statsSizer->Add(statsSizerL);
 			statsSizer->AddStretchSpacer();
@@ -217,6 +224,27 @@ GameUpdateAvailable(false) {
 		STAT_VALUE(threads)->SetValue(192);
 		STAT_VALUE(threads)->SetValue(std::min(data.threads, 192));
 		STAT_TEXT(threads)->SetLabel(wxString::Format("%d", data.threads));
+
+		STAT_VALUE(queue)->SetValue(64);
+		STAT_VALUE(queue)->SetValue(std::min(data.queue, (size_t)64));
+		STAT_TEXT(queue)->SetLabel(wxString::Format("%zu", data.queue));
+
+		STAT_VALUE(recompress)->SetValue(1000);
+		STAT_VALUE(recompress)->SetValue(std::min(data.recompress * 10, 1000.f));
+		STAT_TEXT(recompress)->SetLabel(wxString::Format("%.1f%%", data.recompress));
+
+		{
+			auto fetchQueue = data.fetchInteractive + data.fetchPrefetch + data.fetchBackground;
+			STAT_VALUE(fetchQueue)->SetValue(256);
+			STAT_VALUE(fetchQueue)->SetValue(std::min(fetchQueue, (size_t)256));
+			// reads, prefetches, and background downloads (preload and verify)
+			STAT_TEXT(fetchQueue)->SetLabel(wxString::Format("%zu/%zu/%zu", data.fetchInteractive, data.fetchPrefetch, data.fetchBackground));
+		}
+
+		STAT_VALUE(hedge)->SetValue(100);
+		STAT_VALUE(hedge)->SetValue(std::min(data.hedgeRate * 10, 100.f));
+		// downloads that were hedged, and how many of those the hedge won
+		STAT_TEXT(hedge)->SetLabel(wxString::Format("%.1f%%/%.0f%%", data.hedgeRate, data.hedgeWinRate));
 		return true;
 	});
 
@@ -243,6 +271,9 @@ GameUpdateAvailable(false) {
 		if (ct) {
 			OnGameUpdate(GameUpdater->GetLatestVersion());
 		}
+		else {
+			StartRecompress();
+		}
 	}).detach();
 
 	std::thread([=]() {
@@ -258,7 +289,7 @@ GameUpdateAvailable(false) {
 }
 
 cMain::~cMain() {
-
+	StopRecompress();
 }
 
 void cMain::OnSettingsClicked(bool onStartup) {
@@ -276,6 +307,9 @@ void cMain::OnSettingsClicked(bool onStartup) {
 			if (GameUpdater) {
 				GameUpdater->SetInterval(SettingsGetUpdateInterval(&Settings));
 			}
+			if (Build) {
+				Build->SetBackgroundLimits(SettingsGetBackgroundDownloadRate(&Settings), SettingsGetBackgroundWriteRate(&Settings));
+			}
 			SetupWnd.reset();
 			this->Raise();
 			this->SetFocus();
@@ -426,14 +460,38 @@ void cMain::SetStatus(const wxString& string) {
 }
 
 void cMain::Mount(const std::string& Url) {
+	// it uses the build that's about to be replaced
+	StopRecompress();
 	LOG_INFO("Setting up cache directory");
 	MountedBuild::SetupCacheDirectory(Settings.CacheDir);
 	LOG_INFO("Mounting new url: %s", Url.c_str());
-	Build.reset(new MountedBuild(GameUpdater->GetManifest(Url), fs::path(Settings.CacheDir) / MOUNT_FOLDER, Settings.CacheDir, SettingsGetStorageFlags(&Settings), Settings.BufferCount));
+	Build.reset(new MountedBuild(GameUpdater->GetManifest(Url), fs::path(Settings.CacheDir) / MOUNT_FOLDER, Settings.CacheDir, SettingsGetStorageFlags(&Settings), SettingsGetPoolCapacity(&Settings), SettingsGetCompressedCacheCapacity(&Settings), Settings.RetainedBuildCount, SettingsGetArchiveAfterDays(&Settings)));
+	Build->SetBackgroundLimits(SettingsGetBackgroundDownloadRate(&Settings), SettingsGetBackgroundWriteRate(&Settings));
 	LOG_INFO("Setting up game dir");
 	Build->SetupGameDirectory([](unsigned int m) {}, []() {}, []() {}, cancel_flag(), Settings.ThreadCount);
 }
 
+void cMain::StartRecompress() {
+	StopRecompress();
+	RecompressFlag = std::make_unique<cancel_flag>();
+	Stats::RecompressDone = 0;
+	Stats::RecompressTotal = 0;
+	RecompressThread = std::thread([this]() {
+		Build->RecompressAllChunks(
+			[](uint32_t m) { Stats::RecompressTotal = m; },
+			[]() { Stats::RecompressDone++; },
+			[]() { LOG_INFO("Stored chunks match the compression settings"); },
+			*RecompressFlag, RECOMPRESS_CPU_SHARE, RECOMPRESS_IO_RATE);
+	});
+}
+
+void cMain::StopRecompress() {
+	if (RecompressThread.joinable()) {
+		RecompressFlag->cancel();
+		RecompressThread.join();
+	}
+}
+
 void cMain::OnGameUpdate(const std::string& Version, const std::optional<std::string>& Url)
 {
 	GameUpdateAvailable = true;
@@ -52,6 +52,10 @@ protected:
 	DEFINE_STAT(download)
 	DEFINE_STAT(latency)
 	DEFINE_STAT(threads)
+	DEFINE_STAT(queue)
+	DEFINE_STAT(recompress)
+	DEFINE_STAT(fetchQueue)
+	DEFINE_STAT(hedge)
 
 #undef DEFINE_STAT
 
@@ -70,6 +74,12 @@ protected:
 private:
 	void Mount(const std::string& Url);
 
+	// Converts the stored chunks to the current compression settings while idle, stopped before the build is remounted
+	void StartRecompress();
+	void StopRecompress();
+	std::thread RecompressThread;
+	std::unique_ptr<cancel_flag> RecompressFlag;
+
 	wxWeakRef<wxApp> App;
 	wxSharedPtr<wxTaskBarIcon> Systray;
 	wxWindowPtr<cProgress> VerifyWnd;
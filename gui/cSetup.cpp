@@ -1,5 +1,6 @@
 #include "cSetup.h"
 
+#include "autotune.h"
 #include "Localization.h"
 #include "wxHelpButton.h"
 #include "wxLabelSlider.h"
@@ -153,18 +154,32 @@ cSetup::cSetup(wxWindow* main, SETTINGS* settings, bool startupInvalid, cSetup::
 
 	DEFINE_SECTION(advanced, LSTR(SETUP_ADVANCED_LABEL));
 	ADD_ITEM_SLIDER(advanced, bufCount, SETUP_ADVANCED_BUFCT, 1, 512, uint16_t, BufferCount);
+	ADD_ITEM_SLIDER(advanced, compBufCount, SETUP_ADVANCED_COMPBUFCT, 0, 2048, uint16_t, CompressedBufferCount);
 	ADD_ITEM_SLIDER(advanced, threadCount, SETUP_ADVANCED_THDCT, 1, 128, uint16_t, ThreadCount);
+	ADD_ITEM_SLIDER(advanced, retainedBuilds, SETUP_ADVANCED_RETAINBUILDS, 1, 16, uint16_t, RetainedBuildCount);
+	ADD_ITEM_SLIDER(advanced, archiveDays, SETUP_ADVANCED_ARCHIVEDAYS, 0, 365, uint16_t, ArchiveAfterDays);
+	ADD_ITEM_SLIDER(advanced, downloadLimit, SETUP_ADVANCED_DOWNLOADLIMIT, 0, 1000, uint16_t, BackgroundDownloadLimit);
+	ADD_ITEM_SLIDER(advanced, writeLimit, SETUP_ADVANCED_WRITELIMIT, 0, 1000, uint16_t, BackgroundWriteLimit);
 	ADD_ITEM_TEXT(advanced, cmdArgs, SETUP_ADVANCED_CMDARGS, CommandArgs);
+	ADD_ITEM_CHOICE(advanced, storageLayout, SETUP_ADVANCED_LAYOUT,
+		GetChoices(
+			LSTR(SETUP_LAYOUT_LOOSE),
+			LSTR(SETUP_LAYOUT_PACK)
+		),
+		SettingsStorageLayout, StorageLayout);
 
 	APPEND_SECTION_FIRST(general);
 	APPEND_SECTION(advanced);
 
 	auto applySettingsPanel = new wxBoxSizer(wxHORIZONTAL);
 
+	AutoTuneBtn = new wxButton(panel, wxID_ANY, LSTR(SETUP_BTN_AUTOTUNE));
 	auto okBtn = new wxButton(panel, wxID_ANY, LSTR(SETUP_BTN_OK));
 	auto cancelBtn = new wxButton(panel, wxID_ANY, LSTR(SETUP_BTN_CANCEL));
+	AutoTuneBtn->Bind(wxEVT_BUTTON, std::bind(&cSetup::AutoTuneClicked, this));
 	okBtn->Bind(wxEVT_BUTTON, std::bind(&cSetup::OkClicked, this));
 	cancelBtn->Bind(wxEVT_BUTTON, std::bind(&cSetup::CancelClicked, this));
+	applySettingsPanel->Add(AutoTuneBtn, wxSizerFlags().Border(wxRIGHT, 5));
 	applySettingsPanel->Add(okBtn, wxSizerFlags().Border(wxRIGHT, 5));
 	applySettingsPanel->Add(cancelBtn);
 
@@ -185,13 +200,14 @@ cSetup::cSetup(wxWindow* main, SETTINGS* settings, bool startupInvalid, cSetup::
 }
 
 cSetup::~cSetup() {
-	
+	StopAutoTune();
 }
 
 void cSetup::ReadConfig() {
 	for (auto& bind : ReadBinds) {
 		bind(Settings);
 	}
+	AutoTuneBtn->SetToolTip(Settings->TuneRationale);
 }
 
 void cSetup::WriteConfig() {
@@ -200,6 +216,82 @@ void cSetup::WriteConfig() {
 	}
 }
 
+void cSetup::AutoTuneClicked()
+{
+	WriteConfig();
+	if (!Validator(Settings)) { // The install folder has to exist to test its drive
+		return;
+	}
+
+	// a cancelled run could still be finishing up
+	StopAutoTune();
+	AutoTuneFlag = std::make_shared<cancel_flag>();
+	AutoTuneBtn->Disable();
+	AutoTuneWnd = new cProgress(this, LSTR(SETUP_BTN_AUTOTUNE), *AutoTuneFlag, [this]() {
+		AutoTuneWnd->Destroy();
+		AutoTuneWnd.reset();
+		AutoTuneBtn->Enable();
+	});
+	AutoTuneWnd->Show(true);
+
+	// it takes a few seconds, the progress window is updated from the ui thread
+	AutoTuneThread = std::thread([this, flag = AutoTuneFlag, tunedSettings = *Settings]() mutable {
+		auto tuned = SettingsAutoTune(&tunedSettings,
+			[this, flag](uint32_t m) {
+				CallAfter([this, flag, m]() {
+					if (AutoTuneWnd && !flag->cancelled()) {
+						AutoTuneWnd->SetMaximum(m);
+					}
+				});
+			},
+			[this, flag]() {
+				CallAfter([this, flag]() {
+					if (AutoTuneWnd && !flag->cancelled()) {
+						AutoTuneWnd->Increment();
+					}
+				});
+			},
+			*flag);
+		if (!flag->cancelled()) {
+			CallAfter([this, tuned, tunedSettings]() {
+				AutoTuneFinished(tuned, tunedSettings);
+			});
+		}
+	});
+}
+
+void cSetup::AutoTuneFinished(bool tuned, const SETTINGS& tunedSettings)
+{
+	if (!AutoTuneWnd) { // cancelled right as it finished
+		return;
+	}
+	AutoTuneWnd->Finish();
+	AutoTuneWnd->Destroy();
+	AutoTuneWnd.reset();
+	AutoTuneBtn->Enable();
+
+	if (!tuned) {
+		wxMessageBox(LSTR(SETUP_AUTOTUNE_FAILED), LTITLE(LSTR(APP_ERROR)), wxICON_ERROR | wxOK, this);
+		return;
+	}
+	// only what it tunes, anything else could've been changed while it was running
+	WriteConfig();
+	Settings->CompressionMethod = tunedSettings.CompressionMethod;
+	Settings->CompressionLevel = tunedSettings.CompressionLevel;
+	Settings->BufferCount = tunedSettings.BufferCount;
+	strcpy_s(Settings->TuneRationale, tunedSettings.TuneRationale);
+	ReadConfig();
+	wxMessageBox(Settings->TuneRationale, LTITLE(LSTR(SETUP_BTN_AUTOTUNE)), wxICON_INFORMATION | wxOK, this);
+}
+
+void cSetup::StopAutoTune()
+{
+	if (AutoTuneThread.joinable()) {
+		AutoTuneFlag->cancel();
+		AutoTuneThread.join();
+	}
+}
+
 void cSetup::OkClicked()
 {
 	WriteConfig();
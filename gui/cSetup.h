@@ -1,8 +1,11 @@
 #pragma once
 
+#include "cProgress.h"
 #include "settings.h"
 #include "wxModalWindow.h"
 
+#include <memory>
+#include <thread>
 #include <vector>
 #include <functional>
 #include <wx/wx.h>
@@ -28,9 +31,17 @@ private:
 	validate_callback Validator;
 	exit_callback OnExit;
 
+	wxButton* AutoTuneBtn;
+	wxWindowPtr<cProgress> AutoTuneWnd;
+	std::thread AutoTuneThread;
+	std::shared_ptr<cancel_flag> AutoTuneFlag;
+
 	void ReadConfig();
 	void WriteConfig();
 
+	void AutoTuneClicked();
+	void AutoTuneFinished(bool tuned, const SETTINGS& tunedSettings);
+	void StopAutoTune();
 	void OkClicked();
 	void CancelClicked();
 	void ApplyClicked();
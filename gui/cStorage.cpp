@@ -70,6 +70,15 @@ cStorage::cStorage(wxWindow* main, std::unique_ptr<MountedBuild>& build, uint32_
 		diskBarSizer->Add(diskTxtSizer, wxSizerFlags().Expand());
 	}
 
+	auto dedupSizer = new wxBoxSizer(wxHORIZONTAL);
+	{
+		dedupTxt = new wxStaticText(panel, wxID_ANY, "0 B");
+
+		dedupSizer->Add(new wxStaticText(panel, wxID_ANY, "Saved by Deduplication"));
+		dedupSizer->AddStretchSpacer();
+		dedupSizer->Add(dedupTxt);
+	}
+
 	auto compSizer = new wxGridBagSizer(4, 2);
 
 	compSizer->Add(new wxStaticText(panel, wxID_ANY, "Method"), wxGBPosition(0, 0));
@@ -105,6 +114,9 @@ cStorage::cStorage(wxWindow* main, std::unique_ptr<MountedBuild>& build, uint32_
 		case 4:
 			compName = "Oodle";
 			break;
+		case 5:
+			compName = "LZMA (Archived)";
+			break;
 		}
 
 		compTexts[i][0] = new wxStaticText(panel, wxID_ANY, "0 B");
@@ -123,7 +135,8 @@ cStorage::cStorage(wxWindow* main, std::unique_ptr<MountedBuild>& build, uint32_
 
 	mainSizer->Add(storageBarSizer, wxSizerFlags().Expand().Border(wxUP | wxLEFT | wxRIGHT, 5));
 	mainSizer->Add(downloadBarSizer, wxSizerFlags().Expand().Border(wxUP | wxLEFT | wxRIGHT, 5));
-	mainSizer->Add(diskBarSizer, wxSizerFlags().Expand().Border(wxALL, 5));
+	mainSizer->Add(diskBarSizer, wxSizerFlags().Expand().Border(wxUP | wxLEFT | wxRIGHT, 5));
+	mainSizer->Add(dedupSizer, wxSizerFlags().Expand().Border(wxALL, 5));
 	mainSizer->Add(new wxStaticLine(panel, wxID_ANY), wxSizerFlags().Expand().Border(wxALL, 5));
 	mainSizer->Add(compSizer, wxSizerFlags().Expand().Border(wxALL, 5));
 
@@ -139,6 +152,7 @@ cStorage::cStorage(wxWindow* main, std::unique_ptr<MountedBuild>& build, uint32_
 	}
 	compMainStats[0] = 0;
 	compMainStats[1] = 0;
+	dedupSaved = 0;
 
 	lastUpdate = std::chrono::steady_clock::now();
 	std::thread([=, &build] {
@@ -160,6 +174,12 @@ void cStorage::AddChunkData(const ChunkMetadata& meta, bool isLast)
 		if (meta.Downloaded) {
 			chunkDlCount++;
 
+			// its data is already counted under the chunk it's linked to
+			if (meta.Linked) {
+				dedupSaved += meta.FileSize;
+				return;
+			}
+
 			int chunkI;
 			switch (meta.Flags & ChunkFlagCompMask)
 			{
@@ -178,6 +198,9 @@ void cStorage::AddChunkData(const ChunkMetadata& meta, bool isLast)
 			case ChunkFlagOodle:
 				chunkI = 4;
 				break;
+			case ChunkFlagLZMA:
+				chunkI = 5;
+				break;
 			default:
 				return;
 			}
@@ -212,6 +235,8 @@ void cStorage::AddChunkData(const ChunkMetadata& meta, bool isLast)
 	storageBar->SetValue(round(storageP * 10));
 	storageTxt->SetLabel(wxString::Format("%.*f%%", (std::max)(2 - (int)floor(log10(storageP)), 0), storageP));
 
+	dedupTxt->SetLabel(Stats::GetReadableSize(dedupSaved));
+
 	float downloadP = chunkDlCount * 100.f / chunkCount;
 	downloadBar->SetValue(round(downloadP * 10));
 	downloadTxt->SetLabel(wxString::Format("%.*f%%", (std::max)(2 - (int)floor(log10(downloadP)), 0), downloadP));
@@ -24,12 +24,15 @@ private:
 	wxGauge* diskBar;
 	wxStaticText* diskTxt;
 
+	wxStaticText* dedupTxt;
+
 	// [decomp, decomp%, comp, comp%, compRatio]
 	wxStaticText* compTexts[ChunkFlagCompCount][5];
 
 	// [decompressed, compressed]
 	std::atomic_size_t compStats[ChunkFlagCompCount][2];
 	std::atomic_size_t compMainStats[2];
+	std::atomic_size_t dedupSaved; // stored bytes of chunks that are linked instead of stored again
 
 	cancel_flag flag;
 	std::atomic_uint32_t chunkCount = 0;
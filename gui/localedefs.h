@@ -37,6 +37,10 @@
     LS(MAIN_STATS_DOWNLOAD)            /* Download speed                                                                        */ \
     LS(MAIN_STATS_LATENCY)             /* Latency between program requesting data and recieving data                            */ \
     LS(MAIN_STATS_THREADS)             /* Number of threads running in EGL2                                                     */ \
+    LS(MAIN_STATS_QUEUE)               /* Number of downloaded chunks waiting to be written to the drive                        */ \
+    LS(MAIN_STATS_RECOMPRESS)          /* Progress of converting stored data to the current compression settings                */ \
+    LS(MAIN_STATS_FETCHQUEUE)          /* Downloads waiting for a connection, as file reads/prefetches/preload and verify        */ \
+    LS(MAIN_STATS_HEDGE)               /* Downloads sent again because the server was slow, as % of downloads/% that beat it    */ \
     LS(MAIN_PROG_VERIFY)               /* Title of progress window when verifying                                               */ \
     LS(MAIN_PROG_UPDATE)               /* Title of progress window when updating                                                */ \
     LS(MAIN_EXIT_VETOMSG)              /* Message to show if Fortnite is running with EGL2                                      */ \
@@ -53,6 +57,8 @@
     LS(SETUP_COMP_METHOD_ZSTD)         /* zstd compression method                                                               */ \
     LS(SETUP_COMP_METHOD_LZ4)          /* lz4 compression method                                                                */ \
     LS(SETUP_COMP_METHOD_SELKIE)       /* Oodle's Selkie compression method                                                     */ \
+    LS(SETUP_LAYOUT_LOOSE)             /* Storage layout where each chunk is its own file                                       */ \
+    LS(SETUP_LAYOUT_PACK)              /* Storage layout where chunks are appended to a few large pack files                    */ \
     LS(SETUP_COMP_LEVEL_FASTEST)       /* Fastest compression speed                                                             */ \
     LS(SETUP_COMP_LEVEL_FAST)          /* Fast compression speed                                                                */ \
     LS(SETUP_COMP_LEVEL_NORMAL)        /* Normal compression speed                                                              */ \
@@ -74,8 +80,16 @@
     LS(SETUP_GENERAL_UPDATEINT)        /* Update interval (how often EGL2 checks for Fortnite updates)                          */ \
     LS(SETUP_ADVANCED_LABEL)           /* Advanced settings section title                                                       */ \
     LS(SETUP_ADVANCED_BUFCT)           /* Number of chunks/buffers to keep in memory before reading from disk again             */ \
+    LS(SETUP_ADVANCED_COMPBUFCT)       /* Megabytes of compressed chunks to keep in memory under the buffers                    */ \
     LS(SETUP_ADVANCED_THDCT)           /* Number of threads to use when verifying or updating                                   */ \
+    LS(SETUP_ADVANCED_RETAINBUILDS)    /* Number of builds whose chunks are kept in the install folder                          */ \
+    LS(SETUP_ADVANCED_ARCHIVEDAYS)     /* Days a chunk has to go unread before it's archived with stronger compression          */ \
+    LS(SETUP_ADVANCED_DOWNLOADLIMIT)   /* Speed limit in Mbps for downloads done in the background (0 is unlimited)             */ \
+    LS(SETUP_ADVANCED_WRITELIMIT)      /* Speed limit in MB/s for disk writes done in the background (0 is unlimited)           */ \
     LS(SETUP_ADVANCED_CMDARGS)         /* Command arguments to launch with Fortnite                                             */ \
+    LS(SETUP_ADVANCED_LAYOUT)          /* How downloaded chunks are stored in the install folder                                */ \
+    LS(SETUP_BTN_AUTOTUNE)             /* Button in setup that picks the compression and buffer count by testing the computer   */ \
+    LS(SETUP_AUTOTUNE_FAILED)          /* Error to show if the install folder's drive couldn't be tested                        */ \
     LS(SETUP_BTN_OK)                   /* OK button in setup                                                                    */ \
     LS(SETUP_BTN_CANCEL)               /* Cancel button in setup                                                                */
 
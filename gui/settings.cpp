@@ -114,6 +114,111 @@ inline bool ReadVersion(SETTINGS* Settings, FILE* File, SettingsVersion Version)
 		Settings->ThreadCount = ReadValue<uint16_t>(File);
 
 		ReadString(Settings->CommandArgs, File);
+		return true;
+	case SettingsVersion::PackFiles:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		return true;
+	case SettingsVersion::CompressedCache:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		Settings->CompressedBufferCount = ReadValue<uint16_t>(File);
+		return true;
+	case SettingsVersion::RetainedBuilds:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		Settings->CompressedBufferCount = ReadValue<uint16_t>(File);
+		Settings->RetainedBuildCount = ReadValue<uint16_t>(File);
+		return true;
+	case SettingsVersion::AutoTune:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		Settings->CompressedBufferCount = ReadValue<uint16_t>(File);
+		Settings->RetainedBuildCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->TuneRationale, File);
+		return true;
+	case SettingsVersion::ColdArchive:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		Settings->CompressedBufferCount = ReadValue<uint16_t>(File);
+		Settings->RetainedBuildCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->TuneRationale, File);
+		Settings->ArchiveAfterDays = ReadValue<uint16_t>(File);
+		return true;
+	case SettingsVersion::RateLimits:
+		ReadString(Settings->CacheDir, File);
+
+		Settings->CompressionMethod = ReadValue<SettingsCompressionMethod>(File);
+		Settings->CompressionLevel = ReadValue<SettingsCompressionLevel>(File);
+		Settings->UpdateInterval = ReadValue<SettingsUpdateInterval>(File);
+
+		Settings->BufferCount = ReadValue<uint16_t>(File);
+		Settings->ThreadCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->CommandArgs, File);
+
+		Settings->StorageLayout = ReadValue<SettingsStorageLayout>(File);
+		Settings->CompressedBufferCount = ReadValue<uint16_t>(File);
+		Settings->RetainedBuildCount = ReadValue<uint16_t>(File);
+
+		ReadString(Settings->TuneRationale, File);
+		Settings->ArchiveAfterDays = ReadValue<uint16_t>(File);
+
+		Settings->BackgroundDownloadLimit = ReadValue<uint16_t>(File);
+		Settings->BackgroundWriteLimit = ReadValue<uint16_t>(File);
+		return true;
 	default:
 		return false;
 	}
@@ -126,7 +231,12 @@ bool SettingsRead(SETTINGS* Settings, FILE* File) {
 		return false;
 	}
 
-	return ReadVersion(Settings, File, (SettingsVersion)ntohs(ReadValue<uint16_t>(File)));
+	auto version = (SettingsVersion)ntohs(ReadValue<uint16_t>(File));
+	// caches from before pack files stay loose, packing them is opt in (new installs get packs from SettingsDefault)
+	if (version < SettingsVersion::PackFiles) {
+		Settings->StorageLayout = SettingsStorageLayout::LooseFiles;
+	}
+	return ReadVersion(Settings, File, version);
 }
 
 template <typename T>
@@ -157,6 +267,16 @@ void SettingsWrite(SETTINGS* Settings, FILE* File)
 	WriteValue<uint16_t>(Settings->ThreadCount, File);
 
 	WriteString(Settings->CommandArgs, File);
+
+	WriteValue<SettingsStorageLayout>(Settings->StorageLayout, File);
+	WriteValue<uint16_t>(Settings->CompressedBufferCount, File);
+	WriteValue<uint16_t>(Settings->RetainedBuildCount, File);
+
+	WriteString(Settings->TuneRationale, File);
+	WriteValue<uint16_t>(Settings->ArchiveAfterDays, File);
+
+	WriteValue<uint16_t>(Settings->BackgroundDownloadLimit, File);
+	WriteValue<uint16_t>(Settings->BackgroundWriteLimit, File);
 }
 
 SETTINGS SettingsDefault() {
@@ -167,7 +287,14 @@ SETTINGS SettingsDefault() {
 		.UpdateInterval = SettingsUpdateInterval::Minute1,
 		.BufferCount = 128,
 		.ThreadCount = 64,
-		.CommandArgs = ""
+		.CommandArgs = "",
+		.StorageLayout = SettingsStorageLayout::PackFiles,
+		.CompressedBufferCount = 256,
+		.RetainedBuildCount = 2,
+		.TuneRationale = "",
+		.ArchiveAfterDays = 30,
+		.BackgroundDownloadLimit = 0,
+		.BackgroundWriteLimit = 0
 	};
 }
 
@@ -204,14 +331,14 @@ std::chrono::milliseconds SettingsGetUpdateInterval(SETTINGS* Settings)
 }
 
 uint32_t SettingsGetStorageFlags(SETTINGS* Settings) {
-    uint32_t StorageFlags = StorageVerifyHashes;
+    uint32_t StorageFlags = StorageVerifyHashes | StorageAdaptive;
     switch (Settings->CompressionMethod)
     {
 	case SettingsCompressionMethod::Decompressed:
 		StorageFlags |= StorageDecompressed;
 		break;
 	case SettingsCompressionMethod::Zstandard:
-		StorageFlags |= StorageZstd;
+		StorageFlags |= StorageZstd | StorageZstdDictionary;
 		break;
 	case SettingsCompressionMethod::LZ4:
         StorageFlags |= StorageLZ4;
@@ -238,5 +365,31 @@ uint32_t SettingsGetStorageFlags(SETTINGS* Settings) {
         StorageFlags |= StorageCompressSlowest;
         break;
     }
+	if (Settings->StorageLayout == SettingsStorageLayout::PackFiles) {
+		StorageFlags |= StoragePackFiles;
+	}
 	return StorageFlags;
+}
+
+size_t SettingsGetPoolCapacity(SETTINGS* Settings) {
+	// each buffer is a 1 MB chunk window
+	return (size_t)Settings->BufferCount * 1024 * 1024;
+}
+
+size_t SettingsGetCompressedCacheCapacity(SETTINGS* Settings) {
+	return (size_t)Settings->CompressedBufferCount * 1024 * 1024;
+}
+
+uint32_t SettingsGetArchiveAfterDays(SETTINGS* Settings) {
+	// if nothing's compressed, cold chunks shouldn't be either
+	return Settings->CompressionMethod == SettingsCompressionMethod::Decompressed ? 0 : Settings->ArchiveAfterDays;
+}
+
+uint64_t SettingsGetBackgroundDownloadRate(SETTINGS* Settings) {
+	// set in megabits, like connection speeds are
+	return (uint64_t)Settings->BackgroundDownloadLimit * 1000 * 1000 / 8;
+}
+
+uint64_t SettingsGetBackgroundWriteRate(SETTINGS* Settings) {
+	return (uint64_t)Settings->BackgroundWriteLimit * 1024 * 1024;
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #pragma once
 
 #define FILE_CONFIG_MAGIC 0xE6219B27
-#define FILE_CONFIG_VERSION (uint16_t)SettingsVersion::Version13
+#define FILE_CONFIG_VERSION (uint16_t)SettingsVersion::Latest
 
 #include "../storage/storage.h"
 
@@ -19,6 +19,24 @@ enum class SettingsVersion : uint16_t {
 
 	Oodle,
 
+	// Adds StorageLayout
+	PackFiles,
+
+	// Adds CompressedBufferCount
+	CompressedCache,
+
+	// Adds RetainedBuildCount
+	RetainedBuilds,
+
+	// Adds TuneRationale
+	AutoTune,
+
+	// Adds ArchiveAfterDays
+	ColdArchive,
+
+	// Adds BackgroundDownloadLimit and BackgroundWriteLimit
+	RateLimits,
+
 	LatestPlusOne,
 	Latest = LatestPlusOne - 1
 };
@@ -38,6 +56,11 @@ enum class SettingsCompressionLevel : uint8_t {
 	Slowest
 };
 
+enum class SettingsStorageLayout : uint8_t {
+	LooseFiles,
+	PackFiles
+};
+
 enum class SettingsUpdateInterval : uint8_t {
 	Second1,
 	Second5,
@@ -60,6 +83,13 @@ struct SETTINGS {
 	uint16_t BufferCount;
 	uint16_t ThreadCount;
 	char CommandArgs[1024 + 1];
+	SettingsStorageLayout StorageLayout;
+	uint16_t CompressedBufferCount;
+	uint16_t RetainedBuildCount;
+	char TuneRationale[256 + 1]; // why SettingsAutoTune picked the method, level and buffer count, empty if it hasn't run
+	uint16_t ArchiveAfterDays; // chunks that haven't been read in this many days are archived with LZMA, 0 never does
+	uint16_t BackgroundDownloadLimit; // in Mbps, caps preloading downloads, 0 is unlimited
+	uint16_t BackgroundWriteLimit; // in MB/s, caps preloading and recompressing writes, 0 is unlimited
 };
 
 bool SettingsRead(SETTINGS* Settings, FILE* File);
@@ -68,4 +98,9 @@ void SettingsWrite(SETTINGS* Settings, FILE* File);
 SETTINGS SettingsDefault();
 bool SettingsValidate(SETTINGS* Settings);
 std::chrono::milliseconds SettingsGetUpdateInterval(SETTINGS* Settings);
-uint32_t SettingsGetStorageFlags(SETTINGS* Settings);
\ No newline at end of file
+uint32_t SettingsGetStorageFlags(SETTINGS* Settings);
+size_t SettingsGetPoolCapacity(SETTINGS* Settings);
+size_t SettingsGetCompressedCacheCapacity(SETTINGS* Settings);
+uint32_t SettingsGetArchiveAfterDays(SETTINGS* Settings);
+uint64_t SettingsGetBackgroundDownloadRate(SETTINGS* Settings); // in bytes per second
+uint64_t SettingsGetBackgroundWriteRate(SETTINGS* Settings); // in bytes per second
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include "access.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "ChunkAccessLog"
+#endif
+
+#include "../Logger.h"
+
+#include <ctime>
+
+ChunkAccessLog::ChunkAccessLog(fs::path LogPath, const std::vector<std::shared_ptr<Chunk>>& ChunkList) :
+    LogPath(LogPath),
+    LastRead(std::make_unique<std::atomic_uint32_t[]>(ChunkList.size())),
+    Dirty(false)
+{
+    auto fp = fopen(LogPath.string().c_str(), "rb");
+    if (fp) {
+        CHUNK_ACCESS_HEADER header;
+        if (fread(&header, sizeof(CHUNK_ACCESS_HEADER), 1, fp) == 1 && header.Magic == CHUNK_ACCESS_MAGIC && header.Version == CHUNK_ACCESS_VERSION) {
+            CHUNK_ACCESS_RECORD record;
+            for (uint32_t i = 0; i < header.RecordCount && fread(&record, sizeof(CHUNK_ACCESS_RECORD), 1, fp) == 1; ++i) {
+                OtherChunks[record.Guid] = record.LastRead;
+            }
+        }
+        else {
+            LOG_WARN("Bad access log, starting over");
+        }
+        fclose(fp);
+    }
+
+    // chunks of this build are moved out of OtherChunks so reads don't have to lock anything
+    auto today = GetToday();
+    Guids.reserve(ChunkList.size());
+    for (size_t i = 0; i < ChunkList.size(); ++i) {
+        Guids.emplace_back(ChunkList[i]->Guid);
+        auto record = OtherChunks.find(Guids.back());
+        if (record != OtherChunks.end()) {
+            LastRead[i] = record->second;
+            OtherChunks.erase(record);
+        }
+        else {
+            LastRead[i] = today;
+            Dirty = true; // has to be saved, otherwise it would count as read today every time it's mounted
+        }
+    }
+    LOG_DEBUG("loaded %zu chunks, %zu from other builds", Guids.size(), OtherChunks.size());
+}
+
+ChunkAccessLog::~ChunkAccessLog()
+{
+    Save();
+}
+
+void ChunkAccessLog::Touch(uint32_t Index)
+{
+    auto today = GetToday();
+    // only the first read of the day writes anything
+    if (LastRead[Index].load(std::memory_order_relaxed) != today) {
+        LastRead[Index].store(today, std::memory_order_relaxed);
+        Dirty = true;
+    }
+}
+
+void ChunkAccessLog::Touch(const char Guid[16])
+{
+    auto today = GetToday();
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto& lastRead = OtherChunks[Guid];
+    if (lastRead != today) {
+        lastRead = today;
+        Dirty = true;
+    }
+}
+
+uint32_t ChunkAccessLog::GetIdleDays(uint32_t Index)
+{
+    auto today = GetToday();
+    auto lastRead = LastRead[Index].load(std::memory_order_relaxed);
+    return today > lastRead ? today - lastRead : 0; // the clock could have gone back
+}
+
+void ChunkAccessLog::Remove(const char Guid[16])
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (OtherChunks.erase(Guid)) {
+        Dirty = true;
+    }
+}
+
+void ChunkAccessLog::Save()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (!Dirty.exchange(false)) {
+        return;
+    }
+
+    auto tempPath = fs::path(LogPath).replace_extension(".tmp");
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        LOG_ERROR("Could not open %s", tempPath.string().c_str());
+        Dirty = true;
+        return;
+    }
+
+    CHUNK_ACCESS_HEADER header;
+    header.Magic = CHUNK_ACCESS_MAGIC;
+    header.Version = CHUNK_ACCESS_VERSION;
+    header.RecordCount = Guids.size() + OtherChunks.size();
+    auto written = fwrite(&header, sizeof(CHUNK_ACCESS_HEADER), 1, fp) == 1;
+
+    CHUNK_ACCESS_RECORD record;
+    for (size_t i = 0; i < Guids.size() && written; ++i) {
+        memcpy(record.Guid, &Guids[i], 16);
+        record.LastRead = LastRead[i].load(std::memory_order_relaxed);
+        written = fwrite(&record, sizeof(CHUNK_ACCESS_RECORD), 1, fp) == 1;
+    }
+    for (auto i = OtherChunks.begin(); i != OtherChunks.end() && written; ++i) {
+        memcpy(record.Guid, &i->first, 16);
+        record.LastRead = i->second;
+        written = fwrite(&record, sizeof(CHUNK_ACCESS_RECORD), 1, fp) == 1;
+    }
+    fclose(fp);
+
+    std::error_code ec;
+    if (written) {
+        // the rename is atomic, a crash leaves either the old log or the new one
+        fs::rename(tempPath, LogPath, ec);
+    }
+    if (!written || ec) {
+        LOG_ERROR("Could not write the access log");
+        Dirty = true;
+    }
+}
+
+uint32_t ChunkAccessLog::GetToday()
+{
+    return std::time(nullptr) / (24 * 60 * 60);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../containers/guid.h"
+#include "../web/manifest/chunk.h"
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define CHUNK_ACCESS_MAGIC 0x41434C45 // ELCA
+#define CHUNK_ACCESS_VERSION 0
+
+#pragma pack(push, 1)
+struct CHUNK_ACCESS_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t RecordCount; // Followed by this many records
+};
+
+struct CHUNK_ACCESS_RECORD {
+    char Guid[16];
+    uint32_t LastRead; // Days since the Unix epoch
+};
+#pragma pack(pop)
+
+// Remembers the day each chunk was last read, so chunks nobody reads anymore can be archived
+// Reads only update the day in memory (by the chunk's index in the mounted build), the log is written by Save
+// Storage saves it every few minutes and when it's destroyed
+class ChunkAccessLog {
+public:
+    // Chunks that aren't in the log yet count as read today, so they aren't cold until they've gone unread for a while
+    ChunkAccessLog(fs::path LogPath, const std::vector<std::shared_ptr<Chunk>>& ChunkList);
+    ~ChunkAccessLog();
+
+    // Index is the chunk's index in ChunkList
+    void Touch(uint32_t Index);
+    // For chunks that aren't in ChunkList, like the ones of other builds that deduplicated chunks are stored under
+    void Touch(const char Guid[16]);
+    // Days since the chunk was last read
+    uint32_t GetIdleDays(uint32_t Index);
+    // Forgets a chunk that was removed from the cache
+    void Remove(const char Guid[16]);
+
+    void Save();
+
+private:
+    static uint32_t GetToday();
+
+    fs::path LogPath;
+
+    std::vector<guid_key> Guids; // by index
+    std::unique_ptr<std::atomic_uint32_t[]> LastRead; // by index
+
+    std::mutex Mutex; // guards OtherChunks and the log file
+    std::unordered_map<guid_key, uint32_t, guid_hash> OtherChunks; // chunks of other retained builds, kept as they were read
+    std::atomic_bool Dirty;
+};
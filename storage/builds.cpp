@@ -0,0 +1,168 @@
+#include "builds.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "BuildRefs"
+#endif
+
+#include "../Logger.h"
+
+#include <algorithm>
+#include <ctime>
+#include <unordered_set>
+
+BuildRefs::BuildRefs(fs::path BuildsDir, uint32_t RetainedCount) :
+    BuildsDir(BuildsDir),
+    RetainedCount(std::max(RetainedCount, 1u))
+{
+    std::error_code ec;
+    if (!fs::is_directory(BuildsDir) && !fs::create_directories(BuildsDir, ec)) {
+        LOG_ERROR("Can't create builds dir %s", BuildsDir.string().c_str());
+        return;
+    }
+
+    for (auto& p : fs::directory_iterator(BuildsDir, ec)) {
+        if (p.path().extension() != ".refs") {
+            continue;
+        }
+        BUILD_ENTRY entry;
+        if (!ReadBuild(p.path(), entry)) {
+            LOG_WARN("Bad build refs %s, removing", p.path().filename().string().c_str());
+            fs::remove(p.path(), ec);
+            continue;
+        }
+        AddRefs(entry);
+        Builds.emplace_back(std::move(entry));
+    }
+    std::sort(Builds.begin(), Builds.end(), [](const BUILD_ENTRY& a, const BUILD_ENTRY& b) { return a.LastUsed > b.LastUsed; });
+    LOG_DEBUG("loaded %zu builds referencing %zu chunks", Builds.size(), RefCounts.size());
+}
+
+void BuildRefs::Retain(const std::string& BuildId, const std::vector<std::shared_ptr<Chunk>>& ChunkList)
+{
+    BUILD_ENTRY entry;
+    entry.Id = BuildId;
+    entry.LastUsed = std::time(nullptr);
+    {
+        std::unordered_set<guid_key, guid_hash> guids;
+        guids.reserve(ChunkList.size());
+        for (auto& chunk : ChunkList) {
+            if (guids.emplace(chunk->Guid).second) {
+                entry.Guids.emplace_back(chunk->Guid);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto existing = std::find_if(Builds.begin(), Builds.end(), [&](const BUILD_ENTRY& build) { return build.Id == BuildId; });
+    if (existing != Builds.end()) {
+        RemoveRefs(*existing);
+        Builds.erase(existing);
+    }
+    if (!WriteBuild(entry)) {
+        LOG_ERROR("Can't write build refs for %s", BuildId.c_str());
+    }
+    AddRefs(entry);
+    Builds.emplace(Builds.begin(), std::move(entry));
+
+    std::error_code ec;
+    while (Builds.size() > RetainedCount) {
+        LOG_DEBUG("no longer retaining %s", Builds.back().Id.c_str());
+        RemoveRefs(Builds.back());
+        fs::remove(GetBuildPath(Builds.back().Id), ec);
+        Builds.pop_back();
+    }
+}
+
+uint32_t BuildRefs::GetRefCount(const char Guid[16])
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto it = RefCounts.find(Guid);
+    return it == RefCounts.end() ? 0 : it->second;
+}
+
+size_t BuildRefs::GetBuildCount()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    return Builds.size();
+}
+
+fs::path BuildRefs::GetBuildPath(const std::string& BuildId)
+{
+    // build versions look like ++Fortnite+Release-12.41-CL-12905909-Windows, keep it a valid file name
+    auto fileName = BuildId;
+    for (auto& c : fileName) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '+' && c != '_') {
+            c = '_';
+        }
+    }
+    return BuildsDir / (fileName + ".refs");
+}
+
+bool BuildRefs::ReadBuild(const fs::path& Path, BUILD_ENTRY& Entry)
+{
+    auto fp = fopen(Path.string().c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    BUILD_REFS_HEADER header;
+    uint16_t idSize;
+    if (fread(&header, sizeof(BUILD_REFS_HEADER), 1, fp) != 1 || header.Magic != BUILD_REFS_MAGIC || header.Version != BUILD_REFS_VERSION ||
+        fread(&idSize, sizeof(uint16_t), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+    Entry.Id.resize(idSize);
+    Entry.LastUsed = header.LastUsed;
+    Entry.Guids.resize(header.ChunkCount);
+    auto valid = fread(Entry.Id.data(), 1, idSize, fp) == idSize &&
+        fread(Entry.Guids.data(), sizeof(guid_key), header.ChunkCount, fp) == header.ChunkCount;
+    fclose(fp);
+    return valid;
+}
+
+bool BuildRefs::WriteBuild(const BUILD_ENTRY& Entry)
+{
+    auto buildPath = GetBuildPath(Entry.Id);
+    auto tempPath = fs::path(buildPath).replace_extension(".tmp");
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    BUILD_REFS_HEADER header;
+    header.Magic = BUILD_REFS_MAGIC;
+    header.Version = BUILD_REFS_VERSION;
+    header.LastUsed = Entry.LastUsed;
+    header.ChunkCount = Entry.Guids.size();
+    uint16_t idSize = Entry.Id.size();
+    auto written = fwrite(&header, sizeof(BUILD_REFS_HEADER), 1, fp) == 1 &&
+        fwrite(&idSize, sizeof(uint16_t), 1, fp) == 1 &&
+        fwrite(Entry.Id.data(), 1, idSize, fp) == idSize &&
+        fwrite(Entry.Guids.data(), sizeof(guid_key), Entry.Guids.size(), fp) == Entry.Guids.size();
+    fclose(fp);
+    if (!written) {
+        return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tempPath, buildPath, ec);
+    return !ec;
+}
+
+void BuildRefs::AddRefs(const BUILD_ENTRY& Entry)
+{
+    for (auto& guid : Entry.Guids) {
+        RefCounts[guid]++;
+    }
+}
+
+void BuildRefs::RemoveRefs(const BUILD_ENTRY& Entry)
+{
+    for (auto& guid : Entry.Guids) {
+        auto it = RefCounts.find(guid);
+        if (it != RefCounts.end() && !--it->second) {
+            RefCounts.erase(it);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../containers/guid.h"
+#include "../web/manifest/chunk.h"
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define BUILD_REFS_MAGIC 0x52424C45 // ELBR
+#define BUILD_REFS_VERSION 0
+
+#pragma pack(push, 1)
+struct BUILD_REFS_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    int64_t LastUsed;    // Unix time the build was last mounted
+    uint32_t ChunkCount; // Followed by this many chunk guids
+};
+#pragma pack(pop)
+
+// Tracks which builds are kept in the cache and how many of them reference each chunk
+// Each retained build is a file in the builds dir with the guids of its chunks, so switching between them
+// (or keeping the old build during an update) doesn't throw away chunks that are still needed
+class BuildRefs {
+public:
+    // RetainedCount is how many builds are kept, the least recently used ones are dropped past that
+    BuildRefs(fs::path BuildsDir, uint32_t RetainedCount);
+
+    // Records the build's chunks and marks it as the most recently used, then drops builds past RetainedCount
+    void Retain(const std::string& BuildId, const std::vector<std::shared_ptr<Chunk>>& ChunkList);
+
+    // Number of retained builds that reference the chunk, 0 means it can be deleted
+    uint32_t GetRefCount(const char Guid[16]);
+    size_t GetBuildCount();
+
+private:
+    struct BUILD_ENTRY {
+        std::string Id;
+        int64_t LastUsed;
+        std::vector<guid_key> Guids;
+    };
+
+    fs::path GetBuildPath(const std::string& BuildId);
+    bool ReadBuild(const fs::path& Path, BUILD_ENTRY& Entry);
+    bool WriteBuild(const BUILD_ENTRY& Entry);
+    void AddRefs(const BUILD_ENTRY& Entry);
+    void RemoveRefs(const BUILD_ENTRY& Entry);
+
+    fs::path BuildsDir;
+    uint32_t RetainedCount;
+
+    std::mutex Mutex; // guards Builds and RefCounts
+    std::vector<BUILD_ENTRY> Builds; // most recently used first
+    std::unordered_map<guid_key, uint32_t, guid_hash> RefCounts;
+};
\ No newline at end of file
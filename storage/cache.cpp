@@ -0,0 +1,64 @@
+#include "cache.h"
+
+CompressedCache::CompressedCache(size_t Capacity) :
+    Capacity(Capacity),
+    Size(0)
+{ }
+
+void CompressedCache::Insert(const char Guid[16], const std::shared_ptr<char[]>& Data, uint32_t Size)
+{
+    if (Size > Capacity) {
+        return;
+    }
+
+    guid_key key(Guid);
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto lookupIt = Lookup.find(key);
+    if (lookupIt != Lookup.end()) {
+        this->Size -= lookupIt->second->second.Size;
+        Entries.erase(lookupIt->second);
+        Lookup.erase(lookupIt);
+    }
+
+    while (this->Size + Size > Capacity && !Entries.empty()) {
+        this->Size -= Entries.front().second.Size;
+        Lookup.erase(Entries.front().first);
+        Entries.pop_front();
+    }
+
+    auto entryIt = Entries.emplace(Entries.end(), key, CACHE_ENTRY{ Data, Size });
+    Lookup.emplace(key, entryIt);
+    this->Size += Size;
+}
+
+bool CompressedCache::Get(const char Guid[16], std::shared_ptr<char[]>& Data, uint32_t& Size)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto lookupIt = Lookup.find(Guid);
+    if (lookupIt == Lookup.end()) {
+        return false;
+    }
+    // move to the back, it's the most recently used now
+    Entries.splice(Entries.end(), Entries, lookupIt->second);
+    Data = lookupIt->second->second.Data;
+    Size = lookupIt->second->second.Size;
+    return true;
+}
+
+void CompressedCache::Remove(const char Guid[16])
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto lookupIt = Lookup.find(Guid);
+    if (lookupIt == Lookup.end()) {
+        return;
+    }
+    Size -= lookupIt->second->second.Size;
+    Entries.erase(lookupIt->second);
+    Lookup.erase(lookupIt);
+}
+
+size_t CompressedCache::GetSize()
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    return Size;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../containers/guid.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Second memory tier below the chunk pool, holds chunks as they're stored on disk (header included, usually compressed)
+// A pool miss that hits here only has to decompress instead of going to the disk
+// Chunks are only added when they're read from the disk, not when they're written
+class CompressedCache {
+public:
+    // Capacity is in bytes, 0 disables the cache
+    CompressedCache(size_t Capacity);
+
+    void Insert(const char Guid[16], const std::shared_ptr<char[]>& Data, uint32_t Size);
+    bool Get(const char Guid[16], std::shared_ptr<char[]>& Data, uint32_t& Size);
+    void Remove(const char Guid[16]);
+
+    size_t GetSize();
+
+private:
+    struct CACHE_ENTRY {
+        std::shared_ptr<char[]> Data;
+        uint32_t Size;
+    };
+
+    typedef std::list<std::pair<guid_key, CACHE_ENTRY>> CACHE_LRU; // least recently used is at the front
+
+    // only touched on pool misses, so a single lock is plenty
+    std::mutex Mutex;
+    CACHE_LRU Entries;
+    std::unordered_map<guid_key, CACHE_LRU::iterator, guid_hash> Lookup;
+    size_t Capacity;
+    size_t Size;
+};
\ No newline at end of file
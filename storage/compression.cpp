@@ -5,17 +5,49 @@
 #endif
 
 #include "../Logger.h"
-#include "storage.h"
+#include "flags.h"
 
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <lzma.h>
+
+// cold chunks are archived as a single block, so the window only has to cover a chunk
+#define LZMA_ARCHIVE_PRESET    9
+#define LZMA_ARCHIVE_DICT_SIZE (1024 * 1024)
+
+// the Oodle lib in libraries/oodle is Windows only, Selkie isn't available anywhere else (like the codec benchmark on Linux)
+#ifdef _WIN32
 #include <oodle2.h>
 
+// Oodle allocates scratch memory itself on every call it isn't given enough for
+// The API we have doesn't say how much the compressor wants, these are enough for Selkie's match finders at each level
+#define OODLE_SCRATCH_FAST    (1 * 1024 * 1024) // HyperFast and SuperFast
+#define OODLE_SCRATCH_NORMAL  (2 * 1024 * 1024)
+#define OODLE_SCRATCH_OPTIMAL (8 * 1024 * 1024)
+#endif
+
+// for the LZ4 state and Oodle scratch memory, _aligned_malloc isn't portable
+inline void* AlignedAlloc(size_t size) {
+	return ::operator new(size, std::align_val_t(16));
+}
+
+inline void AlignedFree(void* ptr) {
+	::operator delete(ptr, std::align_val_t(16));
+}
+
 Compressor::Compressor(uint32_t storageFlags) :
 	StorageFlags(storageFlags) {
 	switch (StorageFlags & StorageCompMethodMask)
 	{
 	case StorageDecompressed:
 	{
-		CompressFunc = std::make_pair<std::shared_ptr<char[]>, size_t>;
+		CompressFunc = [](const char* buffer, size_t buffer_size) {
+			auto outBuf = std::shared_ptr<char[]>(new char[buffer_size]);
+			memcpy(outBuf.get(), buffer, buffer_size);
+			return std::make_pair(outBuf, buffer_size);
+		};
 		break;
 	}
 	case StorageZstd:
@@ -41,13 +73,12 @@ Compressor::Compressor(uint32_t storageFlags) :
 
 		CCtx = std::make_unique<CtxManager<void*>>([]() { return ZSTD_createCCtx(); }, [](void* cctx) { ZSTD_freeCCtx((ZSTD_CCtx*)cctx); });
 
-		CompressFunc = [this](std::shared_ptr<char[]>& buffer, size_t buffer_size) {
+		CompressFunc = [this](const char* buffer, size_t buffer_size) {
 			auto outBuf = std::shared_ptr<char[]>(new char[ZSTD_COMPRESSBOUND(buffer_size)]);
 			size_t outSize;
 			{
-				std::unique_lock<std::mutex> lock;
-				auto& cctx = CCtx->GetCtx(lock);
-				outSize = ZSTD_compressCCtx((ZSTD_CCtx*)cctx, outBuf.get(), ZSTD_COMPRESSBOUND(buffer_size), buffer.get(), buffer_size, CLevel);
+				auto cctx = CCtx->GetCtx();
+				outSize = ZSTD_compressCCtx((ZSTD_CCtx*)cctx.get(), outBuf.get(), ZSTD_COMPRESSBOUND(buffer_size), buffer, buffer_size, CLevel);
 			}
 			return std::make_pair(outBuf, outSize);
 		};
@@ -74,160 +105,313 @@ Compressor::Compressor(uint32_t storageFlags) :
 			break;
 		}
 		
-		CCtx = std::make_unique<CtxManager<void*>>([]() { return _aligned_malloc(LZ4_sizeofStateHC(), 8); }, &_aligned_free);
+		CCtx = std::make_unique<CtxManager<void*>>([]() { return AlignedAlloc(LZ4_sizeofStateHC()); }, &AlignedFree);
 
-		CompressFunc = [this](std::shared_ptr<char[]>& buffer, size_t buffer_size) {
-			LOG_DEBUG("CREATING COMPRESSED BUF");
+		CompressFunc = [this](const char* buffer, size_t buffer_size) {
 			auto outBuf = std::shared_ptr<char[]>(new char[LZ4_COMPRESSBOUND(buffer_size)]);
 			size_t outSize;
 			{
-				std::unique_lock<std::mutex> lock;
-				LOG_DEBUG("GETTING LZ4 CCTX");
-				auto& cctx = CCtx->GetCtx(lock);
-				LOG_DEBUG("COMPRESSING LZ4 DATA");
-				outSize = LZ4_compress_HC_extStateHC(cctx, buffer.get(), outBuf.get(), buffer_size, LZ4_COMPRESSBOUND(buffer_size), CLevel);
+				auto cctx = CCtx->GetCtx();
+				outSize = LZ4_compress_HC_extStateHC(cctx, buffer, outBuf.get(), buffer_size, LZ4_COMPRESSBOUND(buffer_size), CLevel);
 			}
-			LOG_DEBUG("RETURNING OUT DATA");
 			return std::make_pair(outBuf, outSize);
 		};
 		break;
 	}
+#ifdef _WIN32
 	case StorageSelkie:
 	{
 		switch (StorageFlags & StorageCompLevelMask)
 		{
 		case StorageCompressFastest:
 			CLevel = OodleLZ_CompressionLevel_HyperFast4;
+			OodleScratchSize = OODLE_SCRATCH_FAST;
 			break;
 		case StorageCompressFast:
 			CLevel = OodleLZ_CompressionLevel_SuperFast;
+			OodleScratchSize = OODLE_SCRATCH_FAST;
 			break;
 		case StorageCompressNormal:
 			CLevel = OodleLZ_CompressionLevel_Normal;
+			OodleScratchSize = OODLE_SCRATCH_NORMAL;
 			break;
 		case StorageCompressSlow:
 			CLevel = OodleLZ_CompressionLevel_Optimal3;
+			OodleScratchSize = OODLE_SCRATCH_OPTIMAL;
 			break;
 		case StorageCompressSlowest:
 			CLevel = OodleLZ_CompressionLevel_Optimal5;
+			OodleScratchSize = OODLE_SCRATCH_OPTIMAL;
 			break;
 		}
 
-		CompressFunc = [this](std::shared_ptr<char[]>& buffer, size_t buffer_size) {
-			LOG_DEBUG("CREATING COMPRESSED BUF");
+		// the CCtx is the scratch memory, see https://github.com/jamesbloom/ozip/blob/ac77c16f294786a93351d0f47855c496b3226896/ozip.cpp#L2146
+		CCtx = std::make_unique<CtxManager<void*>>([this]() { return AlignedAlloc(OodleScratchSize); }, &AlignedFree);
+
+		CompressFunc = [this](const char* buffer, size_t buffer_size) {
 			auto outBuf = std::shared_ptr<char[]>(new char[OodleLZ_GetCompressedBufferSizeNeeded(OodleLZ_Compressor_Selkie, buffer_size)]);
 			size_t outSize;
 			{
-				LOG_DEBUG("COMPRESSING SELKIE DATA");
-				// TODO: make my own scratch buffer as the CCtx: https://github.com/jamesbloom/ozip/blob/ac77c16f294786a93351d0f47855c496b3226896/ozip.cpp#L2146
-				// seems like 1 MB is a safe minimum value for the compressor
-				outSize = OodleLZ_Compress(OodleLZ_Compressor_Selkie, buffer.get(), buffer_size, outBuf.get(), (OodleLZ_CompressionLevel)CLevel, NULL, NULL, NULL, NULL, 0);
+				auto cctx = CCtx->GetCtx();
+				outSize = OodleLZ_Compress(OodleLZ_Compressor_Selkie, buffer, buffer_size, outBuf.get(), (OodleLZ_CompressionLevel)CLevel, NULL, NULL, NULL, cctx.get(), OodleScratchSize);
 			}
-			LOG_DEBUG("RETURNING OUT DATA");
 			return std::make_pair(outBuf, outSize);
 		};
 		break;
 	}
+#endif
 	}
 
 	// decompression contexts
-	ZlibDCtx = std::make_unique<CtxManager<libdeflate_decompressor*>>(&libdeflate_alloc_decompressor, &libdeflate_free_decompressor);
 	ZstdDCtx = std::make_unique<CtxManager<ZSTD_DCtx*>>([]() {return ZSTD_createDCtx(); }, [](ZSTD_DCtx* ctx) { ZSTD_freeDCtx(ctx); });
+#ifdef _WIN32
+	// enough for any compressor and size, so it's never allocated per chunk
+	OodleDScratchSize = OodleLZDecoder_MemorySizeNeeded(OodleLZ_Compressor_Invalid, -1);
+	OodleDCtx = std::make_unique<CtxManager<void*>>([this]() { return AlignedAlloc(OodleDScratchSize); }, &AlignedFree);
+#endif
 }
 
 Compressor::~Compressor() {
-
+	for (auto& dict : Dicts) {
+		if (dict.second.CDict) {
+			ZSTD_freeCDict(dict.second.CDict);
+		}
+		ZSTD_freeDDict(dict.second.DDict);
+	}
 }
 
-Compressor::buffer_value Compressor::StorageCompress(std::shared_ptr<char[]> buffer, size_t buffer_size)
+Compressor::buffer_value Compressor::StorageCompress(const char* buffer, size_t buffer_size)
 {
 	return CompressFunc(buffer, buffer_size);
 }
 
-Compressor::buffer_value Compressor::ZlibDecompress(FILE* File, size_t& inBufSize)
+Compressor::buffer_value Compressor::FastCompress(const char* buffer, size_t buffer_size)
 {
-	uint32_t uncompressedSize;
-	fread(&uncompressedSize, sizeof(uint32_t), 1, File);
+	auto outBuf = std::shared_ptr<char[]>(new char[LZ4_COMPRESSBOUND(buffer_size)]);
+	size_t outSize = LZ4_compress_default(buffer, outBuf.get(), buffer_size, LZ4_COMPRESSBOUND(buffer_size));
+	return std::make_pair(outBuf, outSize);
+}
 
-	auto pos = ftell(File);
-	fseek(File, 0, SEEK_END);
-	inBufSize = ftell(File) - pos;
-	fseek(File, pos, SEEK_SET);
+// Raw LZMA2 doesn't store its options, the decoder has to be given the ones the encoder used
+inline bool GetArchiveFilters(lzma_options_lzma& Options, lzma_filter(&Filters)[2]) {
+	if (lzma_lzma_preset(&Options, LZMA_ARCHIVE_PRESET)) {
+		return false;
+	}
+	Options.dict_size = LZMA_ARCHIVE_DICT_SIZE;
+	Filters[0] = { LZMA_FILTER_LZMA2, &Options };
+	Filters[1] = { LZMA_VLI_UNKNOWN, NULL };
+	return true;
+}
 
-	auto inBuffer = std::make_unique<char[]>(inBufSize);
-	fread(inBuffer.get(), 1, inBufSize, File);
+Compressor::buffer_value Compressor::ArchiveCompress(const char* buffer, size_t buffer_size)
+{
+	lzma_options_lzma options;
+	lzma_filter filters[2];
+	if (!GetArchiveFilters(options, filters)) {
+		return std::make_pair(nullptr, 0);
+	}
 
-	auto outBuffer = std::shared_ptr<char[]>(new char[uncompressedSize]);
+	auto outCapacity = lzma_stream_buffer_bound(buffer_size);
+	auto outBuf = std::shared_ptr<char[]>(new char[outCapacity]);
+	size_t outSize = 0;
+	if (lzma_raw_buffer_encode(filters, NULL, (const uint8_t*)buffer, buffer_size, (uint8_t*)outBuf.get(), &outSize, outCapacity) != LZMA_OK) {
+		return std::make_pair(nullptr, 0);
+	}
+	return std::make_pair(outBuf, outSize);
+}
 
+Compressor::buffer_value Compressor::DictCompress(uint32_t DictId, const char* buffer, size_t buffer_size)
+{
+	ZSTD_CDict* cdict = nullptr;
 	{
-		std::unique_lock<std::mutex> lock;
-		auto& dctx = ZlibDCtx->GetCtx(lock);
-		libdeflate_zlib_decompress(dctx, inBuffer.get(), inBufSize, outBuffer.get(), uncompressedSize, NULL);
+		std::shared_lock<std::shared_mutex> lock(DictMutex);
+		auto dict = Dicts.find(DictId);
+		if (dict != Dicts.end()) {
+			cdict = dict->second.CDict;
+		}
+	}
+	if (!cdict) {
+		return std::make_pair(nullptr, 0);
 	}
 
-	return std::make_pair(outBuffer, uncompressedSize);
+	auto outBuf = std::shared_ptr<char[]>(new char[ZSTD_COMPRESSBOUND(buffer_size)]);
+	size_t outSize;
+	{
+		auto cctx = CCtx->GetCtx();
+		outSize = ZSTD_compress_usingCDict((ZSTD_CCtx*)cctx.get(), outBuf.get(), ZSTD_COMPRESSBOUND(buffer_size), buffer, buffer_size, cdict);
+	}
+	if (ZSTD_isError(outSize)) {
+		return std::make_pair(nullptr, 0);
+	}
+	return std::make_pair(outBuf, outSize);
 }
 
-Compressor::buffer_value Compressor::ZstdDecompress(FILE* File, size_t& inBufSize)
+bool Compressor::AddDictionary(const char* Data, size_t Size)
 {
-	uint32_t uncompressedSize;
-	fread(&uncompressedSize, sizeof(uint32_t), 1, File);
-
-	auto pos = ftell(File);
-	fseek(File, 0, SEEK_END);
-	inBufSize = ftell(File) - pos;
-	fseek(File, pos, SEEK_SET);
-
-	auto inBuffer = std::make_unique<char[]>(inBufSize);
-	fread(inBuffer.get(), 1, inBufSize, File);
+	auto id = ZSTD_getDictID_fromDict(Data, Size);
+	if (!id) { // raw content dictionaries have no id, so they couldn't be told apart in the chunks
+		return false;
+	}
 
-	auto outBuffer = std::shared_ptr<char[]>(new char[uncompressedSize]);
+	ZSTD_DICT dict;
+	dict.DDict = ZSTD_createDDict(Data, Size);
+	dict.CDict = (StorageFlags & StorageCompMethodMask) == StorageZstd ? ZSTD_createCDict(Data, Size, CLevel) : nullptr;
+	if (!dict.DDict || ((StorageFlags & StorageCompMethodMask) == StorageZstd && !dict.CDict)) {
+		if (dict.CDict) {
+			ZSTD_freeCDict(dict.CDict);
+		}
+		if (dict.DDict) {
+			ZSTD_freeDDict(dict.DDict);
+		}
+		return false;
+	}
 
 	{
-		std::unique_lock<std::mutex> lock;
-		auto& dctx = ZstdDCtx->GetCtx(lock);
-		ZSTD_decompressDCtx(dctx, outBuffer.get(), uncompressedSize, inBuffer.get(), inBufSize);
+		std::unique_lock<std::shared_mutex> lock(DictMutex);
+		if (!Dicts.emplace(id, dict).second) {
+			ZSTD_freeDDict(dict.DDict);
+			if (dict.CDict) {
+				ZSTD_freeCDict(dict.CDict);
+			}
+		}
+	}
+	if ((StorageFlags & StorageCompMethodMask) == StorageZstd) {
+		DictId = id;
 	}
+	return true;
+}
 
-	return std::make_pair(outBuffer, uncompressedSize);
+CtxManager<libdeflate_decompressor*>::Handle Compressor::GetZlibDecompressor()
+{
+	static CtxManager<libdeflate_decompressor*> zlibDCtx(&libdeflate_alloc_decompressor, &libdeflate_free_decompressor);
+	return zlibDCtx.GetCtx();
 }
 
-Compressor::buffer_value Compressor::LZ4Decompress(FILE* File, size_t& inBufSize)
+uint32_t Compressor::GetDictionaryId() const
 {
-	uint32_t uncompressedSize;
-	fread(&uncompressedSize, sizeof(uint32_t), 1, File);
+	return DictId;
+}
 
-	auto pos = ftell(File);
-	fseek(File, 0, SEEK_END);
-	inBufSize = ftell(File) - pos;
-	fseek(File, pos, SEEK_SET);
+float Compressor::GetEntropy(const char* buffer, size_t buffer_size)
+{
+	if (!buffer_size) {
+		return 0;
+	}
 
-	auto inBuffer = std::make_unique<char[]>(inBufSize);
-	fread(inBuffer.get(), 1, inBufSize, File);
+	uint32_t counts[256]{};
+	for (size_t i = 0; i < buffer_size; ++i) {
+		counts[(uint8_t)buffer[i]]++;
+	}
 
-	auto outBuffer = std::shared_ptr<char[]>(new char[uncompressedSize]);
-	LZ4_decompress_safe(inBuffer.get(), outBuffer.get(), inBufSize, uncompressedSize);
+	float entropy = 0;
+	for (auto count : counts) {
+		if (count) {
+			float p = (float)count / buffer_size;
+			entropy -= p * log2f(p);
+		}
+	}
+	return entropy;
+}
 
-	return std::make_pair(outBuffer, uncompressedSize);
+// Version 0 chunks start with the decompressed size, the payload is right after it
+inline uint32_t GetDecompressedSize(const char* Buffer, size_t BufferSize)
+{
+	return BufferSize < sizeof(uint32_t) ? 0 : *(const uint32_t*)Buffer;
+}
+
+Compressor::buffer_value Compressor::ZlibDecompress(const char* Buffer, size_t BufferSize)
+{
+	return DecompressSized(ChunkFlagZlib, Buffer, BufferSize);
 }
 
-Compressor::buffer_value Compressor::OodleDecompress(FILE* File, size_t& inBufSize)
+Compressor::buffer_value Compressor::ZstdDecompress(const char* Buffer, size_t BufferSize)
 {
-	uint32_t uncompressedSize;
-	fread(&uncompressedSize, sizeof(uint32_t), 1, File);
+	return DecompressSized(ChunkFlagZstd, Buffer, BufferSize);
+}
 
-	auto pos = ftell(File);
-	fseek(File, 0, SEEK_END);
-	inBufSize = ftell(File) - pos;
-	fseek(File, pos, SEEK_SET);
+Compressor::buffer_value Compressor::LZ4Decompress(const char* Buffer, size_t BufferSize)
+{
+	return DecompressSized(ChunkFlagLZ4, Buffer, BufferSize);
+}
 
-	auto inBuffer = std::make_unique<char[]>(inBufSize);
-	fread(inBuffer.get(), 1, inBufSize, File);
+Compressor::buffer_value Compressor::OodleDecompress(const char* Buffer, size_t BufferSize)
+{
+	return DecompressSized(ChunkFlagOodle, Buffer, BufferSize);
+}
 
+Compressor::buffer_value Compressor::DecompressSized(uint16_t ChunkFlags, const char* Buffer, size_t BufferSize)
+{
+	auto uncompressedSize = GetDecompressedSize(Buffer, BufferSize);
+	if (!uncompressedSize) {
+		return std::make_pair(nullptr, 0);
+	}
 	auto outBuffer = std::shared_ptr<char[]>(new char[uncompressedSize]);
+	if (!DecompressInto(ChunkFlags, Buffer + sizeof(uint32_t), BufferSize - sizeof(uint32_t), outBuffer.get(), uncompressedSize)) {
+		return std::make_pair(nullptr, 0);
+	}
+	return std::make_pair(outBuffer, uncompressedSize);
+}
 
-	// TODO: make my own scratch buffer as the DCtx: https://github.com/jamesbloom/ozip/blob/ac77c16f294786a93351d0f47855c496b3226896/ozip.cpp#L2146
-	OodleLZ_Decompress(inBuffer.get(), inBufSize, outBuffer.get(), uncompressedSize, OodleLZ_FuzzSafe_No, OodleLZ_CheckCRC_No, OodleLZ_Verbosity_None, NULL, 0, NULL, NULL, NULL, 0);
+bool Compressor::DecompressInto(uint16_t ChunkFlags, const char* Buffer, size_t BufferSize, char* Out, size_t OutSize, uint32_t DictId)
+{
+	if (DictId) {
+		if ((ChunkFlags & ChunkFlagCompMask) != ChunkFlagZstd) {
+			return false;
+		}
+		ZSTD_DDict* ddict = nullptr;
+		{
+			std::shared_lock<std::shared_mutex> lock(DictMutex);
+			auto dict = Dicts.find(DictId);
+			if (dict != Dicts.end()) {
+				ddict = dict->second.DDict;
+			}
+		}
+		if (!ddict) { // the dictionary file is gone, it has to be redownloaded
+			return false;
+		}
+		auto dctx = ZstdDCtx->GetCtx();
+		return ZSTD_decompress_usingDDict(dctx, Out, OutSize, Buffer, BufferSize, ddict) == OutSize;
+	}
 
-	return std::make_pair(outBuffer, uncompressedSize);
+	switch (ChunkFlags & ChunkFlagCompMask)
+	{
+	case ChunkFlagDecompressed:
+		if (BufferSize != OutSize) {
+			return false;
+		}
+		memcpy(Out, Buffer, OutSize);
+		return true;
+	case ChunkFlagZstd:
+	{
+		auto dctx = ZstdDCtx->GetCtx();
+		return ZSTD_decompressDCtx(dctx, Out, OutSize, Buffer, BufferSize) == OutSize;
+	}
+	case ChunkFlagZlib:
+	{
+		auto dctx = GetZlibDecompressor();
+		return libdeflate_zlib_decompress(dctx, Buffer, BufferSize, Out, OutSize, NULL) == LIBDEFLATE_SUCCESS;
+	}
+	case ChunkFlagLZ4:
+		// LZ4 takes int sizes, anything bigger can't have come from it
+		return BufferSize <= INT_MAX && OutSize <= INT_MAX && LZ4_decompress_safe(Buffer, Out, (int)BufferSize, (int)OutSize) == (int)OutSize;
+	case ChunkFlagLZMA:
+	{
+		lzma_options_lzma options;
+		lzma_filter filters[2];
+		size_t inPos = 0;
+		size_t outPos = 0;
+		return GetArchiveFilters(options, filters) &&
+			lzma_raw_buffer_decode(filters, NULL, (const uint8_t*)Buffer, &inPos, BufferSize, (uint8_t*)Out, &outPos, OutSize) == LZMA_OK &&
+			outPos == OutSize;
+	}
+#ifdef _WIN32
+	case ChunkFlagOodle:
+	{
+		auto dctx = OodleDCtx->GetCtx();
+		return OodleLZ_Decompress(Buffer, BufferSize, Out, OutSize, OodleLZ_FuzzSafe_No, OodleLZ_CheckCRC_No, OodleLZ_Verbosity_None, NULL, 0, NULL, NULL, dctx.get(), OodleDScratchSize) == OutSize;
+	}
+#endif
+	default:
+		return false;
+	}
 }
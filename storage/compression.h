@@ -1,52 +1,105 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 #include <libdeflate.h>
 #include <lz4hc.h>
 #include <zstd.h>
 
+// Hands out contexts without taking any locks, each one is only used by a single caller at a time
+// Up to Capacity idle contexts are kept around, any past that are freed when they're given back, so bursts don't grow it for good
+// T has to be a pointer, an empty slot is nullptr
 template<typename T>
 class CtxManager {
 public:
 	typedef std::function<T()> create_ctx;
 	typedef std::function<void(T&)> delete_ctx;
 
-	CtxManager(create_ctx create, delete_ctx delete_) :
+	// Gives the context back to the manager when it goes out of scope
+	class Handle {
+	public:
+		Handle(CtxManager& Manager, T Ctx) :
+			Manager(Manager),
+			Ctx(Ctx) { }
+
+		~Handle() {
+			Manager.PutCtx(Ctx);
+		}
+
+		Handle(const Handle&) = delete;
+		Handle& operator=(const Handle&) = delete;
+
+		T get() const {
+			return Ctx;
+		}
+
+		operator T() const {
+			return Ctx;
+		}
+
+	private:
+		CtxManager& Manager;
+		T Ctx;
+	};
+
+	CtxManager(create_ctx create, delete_ctx delete_, size_t capacity = std::thread::hardware_concurrency()) :
 		CreateCtx(create),
-		DeleteCtx(delete_) { }
+		DeleteCtx(delete_),
+		Capacity((std::max)(capacity, (size_t)1)),
+		Slots(std::make_unique<std::atomic<T>[]>(Capacity)) { }
 
 	~CtxManager() {
-		for (auto& ctx : Ctx) {
-			DeleteCtx(ctx);
+		for (size_t i = 0; i < Capacity; ++i) {
+			auto ctx = Slots[i].exchange(nullptr);
+			if (ctx) {
+				DeleteCtx(ctx);
+			}
 		}
 	}
 
-	T& GetCtx(std::unique_lock<std::mutex>& lock) {
-		std::unique_lock<std::mutex> lck(Mutex);
+	Handle GetCtx() {
+		auto start = GetSlotHint();
+		for (size_t i = 0; i < Capacity; ++i) {
+			auto& slot = Slots[(start + i) % Capacity];
+			if (slot.load(std::memory_order_relaxed)) {
+				auto ctx = slot.exchange(nullptr, std::memory_order_acquire);
+				if (ctx) {
+					return Handle(*this, ctx);
+				}
+			}
+		}
+		return Handle(*this, CreateCtx());
+	}
 
-		auto mtxIt = Mutexes.begin();
-		for (auto ctxIt = Ctx.begin(); ctxIt != Ctx.end(); ctxIt++, mtxIt++) {
-			lock = std::unique_lock<std::mutex>(*mtxIt, std::try_to_lock);
-			if (lock.owns_lock()) {
-				return *ctxIt;
+private:
+	void PutCtx(T ctx) {
+		auto start = GetSlotHint();
+		for (size_t i = 0; i < Capacity; ++i) {
+			T expected = nullptr;
+			if (Slots[(start + i) % Capacity].compare_exchange_strong(expected, ctx, std::memory_order_release, std::memory_order_relaxed)) {
+				return;
 			}
 		}
+		DeleteCtx(ctx);
+	}
 
-		lock = std::unique_lock<std::mutex>(Mutexes.emplace_back());
-		return Ctx.emplace_back(CreateCtx());
+	// threads start looking from different slots, so they mostly get back the context they used last
+	size_t GetSlotHint() const {
+		static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+		return hint % Capacity;
 	}
 
-private:
 	create_ctx CreateCtx;
 	delete_ctx DeleteCtx;
 
-	std::mutex Mutex;
-	std::deque<T> Ctx;
-	std::deque<std::mutex> Mutexes;
+	size_t Capacity;
+	std::unique_ptr<std::atomic<T>[]> Slots;
 };
 
 class Compressor {
@@ -56,23 +109,62 @@ public:
 	Compressor(uint32_t storageFlags);
 	~Compressor();
 
-	buffer_value StorageCompress(std::shared_ptr<char[]> buffer, size_t buffer_size);
+	buffer_value StorageCompress(const char* buffer, size_t buffer_size);
+	// LZ4 at its default acceleration regardless of the storage flags, decompresses as ChunkFlagLZ4
+	buffer_value FastCompress(const char* buffer, size_t buffer_size);
+
+	// LZMA2 at a high preset regardless of the storage flags, decompresses as ChunkFlagLZMA
+	// Much slower both ways, only for chunks that are rarely read
+	buffer_value ArchiveCompress(const char* buffer, size_t buffer_size);
+
+	// Zstd with the dictionary DictId (from AddDictionary) at the storage level, decompresses as ChunkFlagZstd with that dictionary
+	buffer_value DictCompress(uint32_t DictId, const char* buffer, size_t buffer_size);
 
-	buffer_value ZlibDecompress(FILE* File, size_t& inBufSize);
-	buffer_value ZstdDecompress(FILE* File, size_t& inBufSize);
-	buffer_value LZ4Decompress(FILE* File, size_t& inBufSize);
-	buffer_value OodleDecompress(FILE* File, size_t& inBufSize);
+	// Loads a zstd dictionary so chunks compressed with it can be decompressed
+	// If the storage method is Zstd it also becomes the one GetDictionaryId returns
+	bool AddDictionary(const char* Data, size_t Size);
+	// Dictionary new chunks should be compressed with, 0 if there isn't one
+	uint32_t GetDictionaryId() const;
+
+	// Zlib decompressors shared by everything that inflates (stored chunks, CDN chunks, manifests)
+	static CtxManager<libdeflate_decompressor*>::Handle GetZlibDecompressor();
+
+	// Shannon entropy of the bytes in bits per byte, 8 means it's random (or already compressed)
+	static float GetEntropy(const char* buffer, size_t buffer_size);
+
+	// Buffer is a version 0 chunk's payload, which starts with the decompressed size
+	// The input is only read in place, and a nullptr buffer is returned if it doesn't decompress to that size
+	buffer_value ZlibDecompress(const char* Buffer, size_t BufferSize);
+	buffer_value ZstdDecompress(const char* Buffer, size_t BufferSize);
+	buffer_value LZ4Decompress(const char* Buffer, size_t BufferSize);
+	buffer_value OodleDecompress(const char* Buffer, size_t BufferSize);
+
+	// Decompresses a raw payload with the codec in ChunkFlags (ChunkFlag*) into Out, which has to be exactly OutSize bytes
+	// DictId is the zstd dictionary it was compressed with, if any
+	bool DecompressInto(uint16_t ChunkFlags, const char* Buffer, size_t BufferSize, char* Out, size_t OutSize, uint32_t DictId = 0);
 
 private:
-	std::function<buffer_value(std::shared_ptr<char[]>, size_t)> CompressFunc;
+	buffer_value DecompressSized(uint16_t ChunkFlags, const char* Buffer, size_t BufferSize);
+
+	std::function<buffer_value(const char*, size_t)> CompressFunc;
 
 	int CLevel;
 
 	std::unique_ptr<CtxManager<void*>> CCtx;
+	size_t OodleScratchSize; // size of each Selkie CCtx, which is just scratch memory
 
-	std::unique_ptr<CtxManager<libdeflate_decompressor*>> ZlibDCtx;
 	std::unique_ptr<CtxManager<ZSTD_DCtx*>> ZstdDCtx;
-	// lz4 nor oodle decompression use a DCtx
+	std::unique_ptr<CtxManager<void*>> OodleDCtx; // scratch memory too
+	size_t OodleDScratchSize;
+	// lz4 decompression doesn't use a DCtx
+
+	struct ZSTD_DICT {
+		ZSTD_CDict* CDict; // only created if the storage method is Zstd
+		ZSTD_DDict* DDict;
+	};
+	mutable std::shared_mutex DictMutex; // guards Dicts
+	std::unordered_map<uint32_t, ZSTD_DICT> Dicts;
+	std::atomic_uint32_t DictId = 0;
 
 	uint32_t StorageFlags;
 };
\ No newline at end of file
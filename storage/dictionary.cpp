@@ -0,0 +1,131 @@
+#include "dictionary.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "Dictionary"
+#endif
+
+#include "../Logger.h"
+
+#include <algorithm>
+#include <zdict.h>
+
+#define DICT_SAMPLE_COUNT 256         // chunks sampled before training, one sample each
+#define DICT_SAMPLE_SIZE  (64 * 1024) // a chunk block, that's what gets compressed with the dictionary
+#define DICT_SIZE         (112 * 1024) // zstd's recommended size
+
+DictionaryStore::DictionaryStore(fs::path DictsDir, ::Compressor& Compressor, bool Train) :
+    DictsDir(DictsDir),
+    Compressor(Compressor),
+    Sampling(false)
+{
+    std::error_code ec;
+    std::vector<fs::directory_entry> dicts;
+    for (auto& p : fs::directory_iterator(DictsDir, ec)) {
+        if (p.path().extension() == ".dict") {
+            dicts.emplace_back(p);
+        }
+    }
+    // the newest one is loaded last so it's the one used for compression
+    std::sort(dicts.begin(), dicts.end(), [](const fs::directory_entry& a, const fs::directory_entry& b) { return a.last_write_time() < b.last_write_time(); });
+    for (auto& dict : dicts) {
+        if (!LoadDictionary(dict.path())) {
+            LOG_WARN("Bad dictionary %s", dict.path().filename().string().c_str());
+        }
+    }
+
+    if (Train && !Compressor.GetDictionaryId()) {
+        Samples.reserve(DICT_SAMPLE_COUNT * DICT_SAMPLE_SIZE);
+        SampleSizes.reserve(DICT_SAMPLE_COUNT);
+        Sampling = true;
+    }
+    LOG_DEBUG("loaded %zu dictionaries, %s", dicts.size(), Sampling ? "sampling chunks" : "not sampling");
+}
+
+void DictionaryStore::AddSample(const char* Data, size_t Size)
+{
+    if (!Sampling.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::vector<char> samples;
+    std::vector<size_t> sampleSizes;
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (!Sampling) {
+            return;
+        }
+        Size = std::min<size_t>(Size, DICT_SAMPLE_SIZE);
+        Samples.insert(Samples.end(), Data, Data + Size);
+        SampleSizes.emplace_back(Size);
+        if (SampleSizes.size() < DICT_SAMPLE_COUNT) {
+            return;
+        }
+        Sampling = false;
+        samples.swap(Samples);
+        sampleSizes.swap(SampleSizes);
+    }
+    // trained on whichever writer thread took the last sample, the other writers keep going
+    TrainDictionary(std::move(samples), std::move(sampleSizes));
+}
+
+bool DictionaryStore::LoadDictionary(const fs::path& Path)
+{
+    auto fp = fopen(Path.string().c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    auto fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (fileSize <= 0) {
+        fclose(fp);
+        return false;
+    }
+    auto data = std::make_unique<char[]>(fileSize);
+    auto readSize = fread(data.get(), 1, fileSize, fp);
+    fclose(fp);
+    return readSize == fileSize && Compressor.AddDictionary(data.get(), fileSize);
+}
+
+void DictionaryStore::TrainDictionary(std::vector<char> Samples, std::vector<size_t> SampleSizes)
+{
+    LOG_DEBUG("training dictionary from %zu samples (%zu bytes)", SampleSizes.size(), Samples.size());
+    auto dict = std::make_unique<char[]>(DICT_SIZE);
+    auto dictSize = ZDICT_trainFromBuffer(dict.get(), DICT_SIZE, Samples.data(), SampleSizes.data(), SampleSizes.size());
+    if (ZDICT_isError(dictSize)) {
+        // usually means the chunks have too little in common, they're compressed without one then
+        LOG_WARN("Could not train dictionary: %s", ZDICT_getErrorName(dictSize));
+        return;
+    }
+
+    std::error_code ec;
+    if (!fs::is_directory(DictsDir) && !fs::create_directories(DictsDir, ec)) {
+        LOG_ERROR("Can't create dicts dir %s", DictsDir.string().c_str());
+        return;
+    }
+    char fileName[16];
+    sprintf(fileName, "%08X.dict", ZDICT_getDictID(dict.get(), dictSize));
+    auto dictPath = DictsDir / fileName;
+    auto tempPath = fs::path(dictPath).replace_extension(".tmp");
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        LOG_ERROR("Can't write dictionary %s", fileName);
+        return;
+    }
+    auto written = fwrite(dict.get(), 1, dictSize, fp) == dictSize;
+    fclose(fp);
+    if (written) {
+        fs::rename(tempPath, dictPath, ec);
+    }
+    // it's only used once it's saved, chunks compressed with it can't be read without it
+    if (!written || ec) {
+        LOG_ERROR("Can't write dictionary %s", fileName);
+        fs::remove(tempPath, ec);
+        return;
+    }
+    if (!Compressor.AddDictionary(dict.get(), dictSize)) {
+        LOG_ERROR("Trained a bad dictionary %s", fileName);
+        return;
+    }
+    LOG_INFO("Trained dictionary %s (%zu bytes)", fileName, dictSize);
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "compression.h"
+
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Trains a zstd dictionary from the first chunks written to the cache and keeps it in the dicts dir
+// Every dictionary that was ever trained is loaded into the Compressor so older chunks stay readable,
+// the newest one is used to compress new chunks
+class DictionaryStore {
+public:
+    // Samples are only collected if Train is set and there isn't a dictionary yet
+    DictionaryStore(fs::path DictsDir, Compressor& Compressor, bool Train);
+
+    // Takes a sample from a chunk that was just written, once there are enough it trains and saves the dictionary
+    void AddSample(const char* Data, size_t Size);
+
+private:
+    bool LoadDictionary(const fs::path& Path);
+    void TrainDictionary(std::vector<char> Samples, std::vector<size_t> SampleSizes);
+
+    fs::path DictsDir;
+    Compressor& Compressor;
+
+    std::atomic_bool Sampling;
+    std::mutex Mutex; // guards Samples and SampleSizes
+    std::vector<char> Samples;
+    std::vector<size_t> SampleSizes;
+};
\ No newline at end of file
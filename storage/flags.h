@@ -0,0 +1,39 @@
+#pragma once
+
+// Storage* flags configure a Storage (and its Compressor), ChunkFlag* flags are saved with each stored chunk
+
+enum
+{
+    StorageDecompressed         = 0x00000001, // Chunks saved as raw blocks
+    StorageZstd                 = 0x00000002, // Chunks are recompressed with Zlib
+    StorageLZ4                  = 0x00000003, // Chunks are recompressed with LZ4
+    StorageSelkie               = 0x00000004, // Chunks are recompressed with Oodle Selkie
+    StorageCompMethodMask       = 0x0000000F, // Compresssion method mask
+
+    StorageCompressFastest      = 0x00000010,
+    StorageCompressFast         = 0x00000020,
+    StorageCompressNormal       = 0x00000030,
+    StorageCompressSlow         = 0x00000040,
+    StorageCompressSlowest      = 0x00000050,
+    StorageCompLevelMask        = 0x000000F0, // Compression level mask
+
+    StorageVerifyHashes         = 0x00001000, // Verify SHA hashes of downloaded chunks when reading and redownload if invalid
+    StoragePackFiles            = 0x00002000, // New chunks are appended to pack files instead of getting a file each
+    StorageAdaptive             = 0x00004000, // Incompressible chunks are stored raw, and LZ4 is used instead if it's about as good
+    StorageZstdDictionary       = 0x00008000, // Zstd chunks are compressed with a dictionary trained from the first chunks in the cache
+};
+
+enum {
+    ChunkFlagDecompressed = 0x01,
+    ChunkFlagZstd         = 0x02,
+    ChunkFlagZlib         = 0x04,
+    ChunkFlagLZ4          = 0x08,
+    ChunkFlagOodle        = 0x09,
+    ChunkFlagLZMA         = 0x0A, // Cold chunks, archived as a single block until they're read again
+
+    ChunkFlagCompCount    =    6,
+    ChunkFlagCompMask     = 0x0F,
+    ChunkFlagLevelMask    = 0xF0, // StorageCompress* level it was compressed with, 0 if it's not known
+    ChunkFlagAdaptive     = 0x100, // The method was picked for this chunk by StorageAdaptive
+    ChunkFlagDictionary   = 0x200, // Zstd blocks use the dictionary whose ID follows the block header
+};
\ No newline at end of file
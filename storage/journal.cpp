@@ -0,0 +1,256 @@
+#include "journal.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "ChunkJournal"
+#endif
+
+#include "../Logger.h"
+
+#include <libdeflate.h>
+#include <mutex>
+
+inline uint32_t GetRecordChecksum(const CHUNK_JOURNAL_RECORD& Record)
+{
+    return libdeflate_crc32(0, &Record, offsetof(CHUNK_JOURNAL_RECORD, Checksum));
+}
+
+ChunkJournal::ChunkJournal(fs::path JournalPath) :
+    JournalPath(JournalPath),
+    Loaded(false),
+    RecordCount(0),
+    JournalFile(nullptr)
+{
+    bool torn = false;
+    Loaded = ReadJournal(torn);
+
+    // also cuts off a torn tail, and writes the header of a new journal
+    if (!Loaded || torn || RecordCount > Records.size() * 2 + 1024) {
+        Compact();
+    }
+    else {
+        JournalFile = fopen(JournalPath.string().c_str(), "ab");
+    }
+    if (!JournalFile) {
+        LOG_ERROR("Can't open chunk journal");
+    }
+    LOG_DEBUG("loaded %zu chunks from %zu records", Records.size(), RecordCount);
+}
+
+ChunkJournal::~ChunkJournal()
+{
+    AppendVerified();
+    if (JournalFile) {
+        fclose(JournalFile);
+    }
+}
+
+bool ChunkJournal::IsLoaded() const
+{
+    return Loaded;
+}
+
+bool ChunkJournal::Get(const char Guid[16], CHUNK_JOURNAL_RECORD& Record)
+{
+    std::shared_lock<std::shared_mutex> lock(Mutex);
+    auto it = Records.find(Guid);
+    if (it == Records.end()) {
+        return false;
+    }
+    Record = it->second;
+    return true;
+}
+
+std::vector<CHUNK_JOURNAL_RECORD> ChunkJournal::GetRecords()
+{
+    std::shared_lock<std::shared_mutex> lock(Mutex);
+    std::vector<CHUNK_JOURNAL_RECORD> ret;
+    ret.reserve(Records.size());
+    for (auto& record : Records) {
+        ret.emplace_back(record.second);
+    }
+    return ret;
+}
+
+void ChunkJournal::Set(const char Guid[16], uint16_t Flags, uint32_t StoredSize, const char ShaHash[20])
+{
+    CHUNK_JOURNAL_RECORD record{};
+    memcpy(record.Guid, Guid, 16);
+    record.Flags = Flags;
+    record.StoredSize = StoredSize;
+    if (ShaHash) {
+        memcpy(record.ShaHash, ShaHash, 20);
+    }
+    record.VerifiedAt = 0; // newly stored, nothing has checked it yet
+
+    std::unique_lock<std::shared_mutex> lock(Mutex);
+    Records[Guid] = record;
+    Unflushed.erase(Guid);
+    Append(record);
+}
+
+bool ChunkJournal::Link(const char Guid[16], const char Target[16])
+{
+    std::unique_lock<std::shared_mutex> lock(Mutex);
+    auto target = Records.find(Target);
+    if (target == Records.end() || IsLink(target->second)) {
+        return false;
+    }
+    // same stored bytes as the target, so the same flags and size
+    auto record = target->second;
+    memcpy(record.Guid, Guid, 16);
+    memcpy(record.LinkGuid, Target, 16);
+    record.VerifiedAt = 0;
+    Records[Guid] = record;
+    Unflushed.erase(Guid);
+    Append(record);
+    return true;
+}
+
+void ChunkJournal::SetVerified(const char Guid[16], int64_t VerifiedAt)
+{
+    std::unique_lock<std::shared_mutex> lock(Mutex);
+    auto it = Records.find(Guid);
+    if (it == Records.end()) {
+        return;
+    }
+    it->second.VerifiedAt = VerifiedAt;
+    Unflushed.emplace(Guid);
+}
+
+void ChunkJournal::FlushVerified()
+{
+    std::unique_lock<std::shared_mutex> lock(Mutex);
+    AppendVerified();
+}
+
+void ChunkJournal::AppendVerified()
+{
+    // taken out first, Append can compact the journal and that writes them all anyway
+    auto unflushed = std::move(Unflushed);
+    Unflushed.clear();
+    for (auto& guid : unflushed) {
+        auto it = Records.find(guid);
+        if (it != Records.end()) {
+            Append(it->second);
+        }
+    }
+}
+
+void ChunkJournal::Remove(const char Guid[16])
+{
+    std::unique_lock<std::shared_mutex> lock(Mutex);
+    Unflushed.erase(Guid);
+    if (!Records.erase(Guid)) {
+        return;
+    }
+    CHUNK_JOURNAL_RECORD record{};
+    memcpy(record.Guid, Guid, 16);
+    Append(record);
+}
+
+bool ChunkJournal::IsLink(const CHUNK_JOURNAL_RECORD& Record)
+{
+    static const char emptyGuid[16]{};
+    return memcmp(Record.LinkGuid, emptyGuid, 16);
+}
+
+bool ChunkJournal::HasShaHash(const CHUNK_JOURNAL_RECORD& Record)
+{
+    static const char emptyHash[20]{};
+    return memcmp(Record.ShaHash, emptyHash, 20);
+}
+
+bool ChunkJournal::ReadJournal(bool& Torn)
+{
+    auto fp = fopen(JournalPath.string().c_str(), "rb");
+    if (!fp) {
+        return false; // new cache or one from before the journal
+    }
+
+    CHUNK_JOURNAL_HEADER header;
+    if (fread(&header, sizeof(CHUNK_JOURNAL_HEADER), 1, fp) != 1 || header.Magic != CHUNK_JOURNAL_MAGIC || header.Version != CHUNK_JOURNAL_VERSION) {
+        LOG_ERROR("Bad chunk journal header, rescanning");
+        fclose(fp);
+        return false;
+    }
+
+    CHUNK_JOURNAL_RECORD record;
+    while (fread(&record, sizeof(CHUNK_JOURNAL_RECORD), 1, fp) == 1) {
+        if (record.Checksum != GetRecordChecksum(record)) {
+            // everything before it was flushed in order, so only the tail was lost
+            LOG_WARN("Chunk journal is corrupt after %zu records", RecordCount);
+            Torn = true;
+            break;
+        }
+        RecordCount++;
+        if (record.StoredSize) {
+            Records[record.Guid] = record;
+        }
+        else {
+            Records.erase(record.Guid);
+        }
+    }
+    fclose(fp);
+
+    std::error_code ec;
+    auto journalSize = fs::file_size(JournalPath, ec);
+    if (!Torn && (ec || (journalSize - sizeof(CHUNK_JOURNAL_HEADER)) % sizeof(CHUNK_JOURNAL_RECORD))) {
+        LOG_WARN("Chunk journal has a partial record");
+        Torn = true;
+    }
+    return true;
+}
+
+void ChunkJournal::Compact()
+{
+    if (JournalFile) {
+        fclose(JournalFile);
+        JournalFile = nullptr;
+    }
+
+    auto tempPath = fs::path(JournalPath).replace_extension(".tmp");
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        LOG_ERROR("Can't rewrite chunk journal");
+        JournalFile = fopen(JournalPath.string().c_str(), "ab");
+        return;
+    }
+
+    CHUNK_JOURNAL_HEADER header;
+    header.Magic = CHUNK_JOURNAL_MAGIC;
+    header.Version = CHUNK_JOURNAL_VERSION;
+    fwrite(&header, sizeof(CHUNK_JOURNAL_HEADER), 1, fp);
+    Unflushed.clear(); // they're all written here
+    for (auto& record : Records) {
+        record.second.Checksum = GetRecordChecksum(record.second);
+        fwrite(&record.second, sizeof(CHUNK_JOURNAL_RECORD), 1, fp);
+    }
+    fclose(fp);
+
+    // the rename is atomic, a crash leaves either the old journal or the new one
+    std::error_code ec;
+    fs::rename(tempPath, JournalPath, ec);
+    if (ec) {
+        LOG_ERROR("Can't replace chunk journal: %s", ec.message().c_str());
+    }
+    else {
+        RecordCount = Records.size();
+    }
+    JournalFile = fopen(JournalPath.string().c_str(), "ab");
+}
+
+void ChunkJournal::Append(CHUNK_JOURNAL_RECORD& Record)
+{
+    if (!JournalFile) {
+        return;
+    }
+    Record.Checksum = GetRecordChecksum(Record);
+    if (fwrite(&Record, sizeof(CHUNK_JOURNAL_RECORD), 1, JournalFile) != 1 || fflush(JournalFile)) {
+        LOG_ERROR("Can't write to chunk journal");
+        return;
+    }
+    // compact it once it's mostly removed/overwritten records
+    if (++RecordCount > Records.size() * 2 + 1024) {
+        Compact();
+    }
+}
\ No newline at end of file
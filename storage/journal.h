@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../containers/guid.h"
+
+#include <filesystem>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define CHUNK_JOURNAL_MAGIC 0x4A434C45 // ELCJ
+#define CHUNK_JOURNAL_VERSION 1
+
+#pragma pack(push, 1)
+struct CHUNK_JOURNAL_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+};
+
+struct CHUNK_JOURNAL_RECORD {
+    char Guid[16];
+    uint16_t Flags;      // ChunkFlag* of the stored chunk
+    uint32_t StoredSize; // Size of the stored chunk (header included), 0 if the chunk was removed
+    int64_t VerifiedAt;  // Unix time of the last successful hash check, 0 if it never was
+    char ShaHash[20];    // SHA-1 of the chunk's data, zeroed if it isn't known
+    char LinkGuid[16];   // Stored chunk with the same data this one is read from, zeroed if it's stored itself
+    uint32_t Checksum;   // crc32 of everything above
+};
+#pragma pack(pop)
+
+// Persistent index of every chunk in the cache, so mounting doesn't have to look at the chunk files themselves
+// Changes are appended as checksummed records, a torn or corrupt tail is dropped when it's read back
+class ChunkJournal {
+public:
+    ChunkJournal(fs::path JournalPath);
+    ~ChunkJournal();
+
+    // False if there was no usable journal, the cache has to be scanned and added to it once
+    bool IsLoaded() const;
+
+    bool Get(const char Guid[16], CHUNK_JOURNAL_RECORD& Record);
+    std::vector<CHUNK_JOURNAL_RECORD> GetRecords();
+
+    void Set(const char Guid[16], uint16_t Flags, uint32_t StoredSize, const char ShaHash[20]);
+    // Makes the chunk an alias of Target, which has to be stored itself
+    bool Link(const char Guid[16], const char Target[16]);
+    // Only changes the record in memory, it's written by the next FlushVerified (or when it's destroyed)
+    // It's called on the read path, so it doesn't touch the file
+    void SetVerified(const char Guid[16], int64_t VerifiedAt);
+    // Appends the records SetVerified changed since the last flush
+    void FlushVerified();
+    void Remove(const char Guid[16]);
+
+    static bool IsLink(const CHUNK_JOURNAL_RECORD& Record);
+    static bool HasShaHash(const CHUNK_JOURNAL_RECORD& Record);
+
+private:
+    // Torn is set if the journal has to be compacted to drop a bad tail
+    bool ReadJournal(bool& Torn);
+    // Rewrites the journal with only the live records, Mutex has to be held
+    void Compact();
+    // Mutex has to be held
+    void AppendVerified();
+    void Append(CHUNK_JOURNAL_RECORD& Record);
+
+    fs::path JournalPath;
+    bool Loaded;
+
+    std::shared_mutex Mutex; // guards Records and the journal file
+    std::unordered_map<guid_key, CHUNK_JOURNAL_RECORD, guid_hash> Records;
+    std::unordered_set<guid_key, guid_hash> Unflushed; // verified since the last FlushVerified, their records are only in memory
+    size_t RecordCount; // records in the file, live or not
+    FILE* JournalFile;
+};
\ No newline at end of file
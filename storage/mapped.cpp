@@ -0,0 +1,67 @@
+#include "mapped.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+MappedFile::MappedFile() :
+    Data(nullptr),
+    Size(0)
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+bool MappedFile::Open(const fs::path& Path)
+{
+    Close();
+
+    // sharing everything, so a writer that has the file open doesn't make this fail (and this doesn't make the writer fail)
+    auto file = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // mapping an empty file fails anyway, and chunks are never bigger than 4 GB
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || !fileSize.QuadPart || fileSize.QuadPart > UINT32_MAX) {
+        CloseHandle(file);
+        return false;
+    }
+
+    auto mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return false;
+    }
+    // the view keeps the mapping (and the file) open by itself
+    Data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!Data) {
+        return false;
+    }
+    Size = fileSize.QuadPart;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (Data) {
+        UnmapViewOfFile(Data);
+        Data = nullptr;
+        Size = 0;
+    }
+}
+
+const char* MappedFile::GetData() const
+{
+    return Data;
+}
+
+uint32_t MappedFile::GetSize() const
+{
+    return Size;
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// Read-only view of a whole file, so it can be decoded without reading it into a buffer first
+// The file can't be deleted or replaced while it's mapped, so don't keep it around
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file doesn't exist or is empty
+    bool Open(const fs::path& Path);
+    void Close();
+
+    const char* GetData() const;
+    uint32_t GetSize() const;
+
+private:
+    const char* Data;
+    uint32_t Size;
+};
\ No newline at end of file
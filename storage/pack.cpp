@@ -0,0 +1,442 @@
+#include "pack.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "PackStore"
+#endif
+
+#include "../Logger.h"
+
+#include <algorithm>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+// Packs are opened with FILE_FLAG_OVERLAPPED so reads from different threads don't get serialized on the handle
+struct PACK_IO_EVENT {
+    HANDLE Event = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    ~PACK_IO_EVENT() {
+        CloseHandle(Event);
+    }
+};
+
+inline bool PositionedIo(HANDLE File, bool Write, void* Buffer, DWORD Size, uint64_t Offset) {
+    static thread_local PACK_IO_EVENT ioEvent;
+
+    OVERLAPPED overlapped{};
+    overlapped.Offset = (DWORD)Offset;
+    overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    overlapped.hEvent = ioEvent.Event;
+
+    DWORD transferred;
+    BOOL result = Write ?
+        WriteFile(File, Buffer, Size, &transferred, &overlapped) :
+        ReadFile(File, Buffer, Size, &transferred, &overlapped);
+    if (!result) {
+        if (GetLastError() != ERROR_IO_PENDING) {
+            return false;
+        }
+        if (!GetOverlappedResult(File, &overlapped, &transferred, TRUE)) {
+            return false;
+        }
+    }
+    return transferred == Size;
+}
+
+PackStore::PackStore(fs::path PackDir) :
+    PackDir(PackDir),
+    IndexFile(nullptr),
+    CurrentPack(0),
+    CurrentSize(0),
+    ActiveReads(0)
+{
+    std::error_code ec;
+    if (!fs::is_directory(PackDir) && !fs::create_directories(PackDir, ec)) {
+        LOG_ERROR("Can't create pack dir %s", PackDir.string().c_str());
+        return;
+    }
+
+    bool rewriteIndex = !ReadIndex();
+
+    for (uint16_t i = 0; fs::is_regular_file(GetPackPath(i), ec); ++i) {
+        auto pack = OpenPack(i);
+        if (pack == INVALID_HANDLE_VALUE) {
+            break;
+        }
+        Packs.emplace_back(pack);
+    }
+    if (Packs.empty()) {
+        auto pack = OpenPack(0);
+        if (pack == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        Packs.emplace_back(pack);
+    }
+
+    CurrentPack = Packs.size() - 1;
+    LARGE_INTEGER packSize;
+    if (GetFileSizeEx(Packs.back(), &packSize)) {
+        CurrentSize = packSize.QuadPart;
+    }
+
+    for (auto it = Index.begin(); it != Index.end();) {
+        if (it->second.Pack >= Packs.size()) {
+            LOG_WARN("Chunk is in missing pack %hu", it->second.Pack);
+            it = Index.erase(it);
+            rewriteIndex = true;
+        }
+        else {
+            ++it;
+        }
+    }
+
+    if (rewriteIndex) {
+        RewriteIndex();
+    }
+    ScanFreeSpace();
+
+    IndexFile = fopen((PackDir / "index").string().c_str(), "ab");
+    if (!IndexFile) {
+        LOG_ERROR("Can't open pack index");
+    }
+    LOG_DEBUG("opened %zu packs, %zu chunks", Packs.size(), Index.size());
+}
+
+PackStore::~PackStore()
+{
+    if (IndexFile) {
+        fclose(IndexFile);
+    }
+    for (auto pack : Packs) {
+        CloseHandle(pack);
+    }
+}
+
+bool PackStore::Contains(const char Guid[16])
+{
+    std::shared_lock<std::shared_mutex> lock(IndexMutex);
+    return Index.find(Guid) != Index.end();
+}
+
+bool PackStore::GetEntry(const char Guid[16], PACK_INDEX_ENTRY& Entry)
+{
+    std::shared_lock<std::shared_mutex> lock(IndexMutex);
+    auto it = Index.find(Guid);
+    if (it == Index.end()) {
+        return false;
+    }
+    Entry = it->second;
+    return true;
+}
+
+std::vector<guid_key> PackStore::GetGuids()
+{
+    std::shared_lock<std::shared_mutex> lock(IndexMutex);
+    std::vector<guid_key> ret;
+    ret.reserve(Index.size());
+    for (auto& entry : Index) {
+        ret.emplace_back(entry.first);
+    }
+    return ret;
+}
+
+bool PackStore::GetLocation(const char Guid[16], PACK_INDEX_ENTRY& Entry, void*& Pack)
+{
+    std::shared_lock<std::shared_mutex> lock(IndexMutex);
+    auto it = Index.find(Guid);
+    if (it == Index.end()) {
+        return false;
+    }
+    Entry = it->second;
+    Pack = Packs[Entry.Pack];
+    // taken under the lock, so the record can't be retired and freed without the writer seeing it's being read
+    ActiveReads.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool PackStore::Read(const char Guid[16], std::shared_ptr<char[]>& Data, uint32_t& Size)
+{
+    PACK_INDEX_ENTRY entry;
+    HANDLE pack;
+    if (!GetLocation(Guid, entry, pack)) {
+        return false;
+    }
+
+    Data = std::shared_ptr<char[]>(new char[entry.Size]);
+    auto read = PositionedIo(pack, false, Data.get(), entry.Size, entry.Offset);
+    ActiveReads.fetch_sub(1, std::memory_order_release);
+    if (!read) {
+        LOG_ERROR("Can't read %u bytes at %llu from pack %hu (%u)", entry.Size, entry.Offset, entry.Pack, GetLastError());
+        return false;
+    }
+    Size = entry.Size;
+    return true;
+}
+
+bool PackStore::Read(const char Guid[16], std::vector<char>& Buffer, uint32_t& Size)
+{
+    PACK_INDEX_ENTRY entry;
+    HANDLE pack;
+    if (!GetLocation(Guid, entry, pack)) {
+        return false;
+    }
+
+    if (Buffer.size() < entry.Size) {
+        Buffer.resize(entry.Size);
+    }
+    auto read = PositionedIo(pack, false, Buffer.data(), entry.Size, entry.Offset);
+    ActiveReads.fetch_sub(1, std::memory_order_release);
+    if (!read) {
+        LOG_ERROR("Can't read %u bytes at %llu from pack %hu (%u)", entry.Size, entry.Offset, entry.Pack, GetLastError());
+        return false;
+    }
+    Size = entry.Size;
+    return true;
+}
+
+bool PackStore::Write(const char Guid[16], uint16_t Flags, const char* Data, uint32_t Size)
+{
+    std::lock_guard<std::mutex> writeLock(WriteMutex);
+    if (!IndexFile) {
+        return false;
+    }
+
+    PACK_INDEX_ENTRY entry;
+    memcpy(entry.Guid, Guid, 16);
+    entry.Flags = Flags;
+    entry.Size = Size;
+
+    auto reused = TakeFreeSpace(Size, entry.Pack, entry.Offset);
+    if (!reused) {
+        if (CurrentSize && CurrentSize + Size > PackSizeLimit) {
+            auto pack = OpenPack(CurrentPack + 1);
+            if (pack == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            {
+                std::unique_lock<std::shared_mutex> lock(IndexMutex);
+                Packs.emplace_back(pack);
+            }
+            CurrentPack++;
+            CurrentSize = 0;
+        }
+        entry.Pack = CurrentPack;
+        entry.Offset = CurrentSize;
+        CurrentSize += Size;
+    }
+
+    // Packs only grows while WriteMutex is held, no need for the index lock here
+    // the data is written before its index entry, a crash in between only leaves unreferenced bytes in the pack
+    if (!PositionedIo(Packs[entry.Pack], true, (void*)Data, Size, entry.Offset) || !AppendIndex(entry)) {
+        LOG_ERROR("Can't write %u bytes to pack %hu (%u)", Size, entry.Pack, GetLastError());
+        AddFreeSpace(entry.Pack, entry.Offset, Size); // nothing points to it
+        return false;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(IndexMutex);
+    auto& indexed = Index[Guid];
+    if (indexed.Size) {
+        Retired.push_back({ { indexed.Pack, indexed.Offset }, indexed.Size });
+    }
+    indexed = entry;
+    ReleaseRetired();
+    return true;
+}
+
+void PackStore::Remove(const char Guid[16])
+{
+    std::lock_guard<std::mutex> writeLock(WriteMutex);
+    {
+        std::unique_lock<std::shared_mutex> lock(IndexMutex);
+        auto it = Index.find(Guid);
+        if (it == Index.end()) {
+            return;
+        }
+        Retired.push_back({ { it->second.Pack, it->second.Offset }, it->second.Size });
+        Index.erase(it);
+        ReleaseRetired();
+    }
+
+    PACK_INDEX_ENTRY entry{};
+    memcpy(entry.Guid, Guid, 16);
+    AppendIndex(entry);
+}
+
+void PackStore::ScanFreeSpace()
+{
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> records(Packs.size());
+    for (auto& entry : Index) {
+        records[entry.second.Pack].emplace_back(entry.second.Offset, entry.second.Size);
+    }
+
+    std::lock_guard<std::mutex> writeLock(WriteMutex);
+    for (uint16_t i = 0; i < Packs.size(); ++i) {
+        std::sort(records[i].begin(), records[i].end());
+        uint64_t end = 0;
+        for (auto& record : records[i]) {
+            if (record.first > end) {
+                AddFreeSpace(i, end, record.first - end);
+            }
+            end = std::max(end, record.first + record.second);
+        }
+        LARGE_INTEGER packSize;
+        if (GetFileSizeEx(Packs[i], &packSize) && (uint64_t)packSize.QuadPart > end) {
+            AddFreeSpace(i, end, packSize.QuadPart - end);
+        }
+    }
+
+    uint64_t freeBytes = 0;
+    for (auto& space : FreeSpace) {
+        freeBytes += space.second;
+    }
+    LOG_DEBUG("%llu bytes free in packs", freeBytes);
+}
+
+void PackStore::AddFreeSpace(uint16_t Pack, uint64_t Offset, uint64_t Size)
+{
+    // merged with the free space on either side, so neighboring records that were freed can hold a bigger one
+    auto next = FreeSpace.lower_bound({ Pack, Offset });
+    if (next != FreeSpace.end() && next->first.first == Pack && next->first.second == Offset + Size) {
+        Size += next->second;
+        next = EraseFreeSpace(next);
+    }
+    if (next != FreeSpace.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first.first == Pack && prev->first.second + prev->second == Offset) {
+            Offset = prev->first.second;
+            Size += prev->second;
+            EraseFreeSpace(prev);
+        }
+    }
+    FreeSpace.emplace(std::make_pair(Pack, Offset), Size);
+    FreeSpaceBySize.emplace(Size, std::make_pair(Pack, Offset));
+}
+
+bool PackStore::TakeFreeSpace(uint32_t Size, uint16_t& Pack, uint64_t& Offset)
+{
+    auto fit = FreeSpaceBySize.lower_bound(Size);
+    if (fit == FreeSpaceBySize.end()) {
+        return false;
+    }
+    Pack = fit->second.first;
+    Offset = fit->second.second;
+    auto spaceSize = fit->first;
+    FreeSpaceBySize.erase(fit);
+    FreeSpace.erase({ Pack, Offset });
+    if (spaceSize > Size) {
+        AddFreeSpace(Pack, Offset + Size, spaceSize - Size);
+    }
+    return true;
+}
+
+std::map<std::pair<uint16_t, uint64_t>, uint64_t>::iterator PackStore::EraseFreeSpace(std::map<std::pair<uint16_t, uint64_t>, uint64_t>::iterator It)
+{
+    auto sized = FreeSpaceBySize.equal_range(It->second);
+    for (auto it = sized.first; it != sized.second; ++it) {
+        if (it->second == It->first) {
+            FreeSpaceBySize.erase(it);
+            break;
+        }
+    }
+    return FreeSpace.erase(It);
+}
+
+void PackStore::ReleaseRetired()
+{
+    if (ActiveReads.load(std::memory_order_acquire)) {
+        return; // freed by a later write instead
+    }
+    for (auto& record : Retired) {
+        AddFreeSpace(record.first.first, record.first.second, record.second);
+    }
+    Retired.clear();
+}
+
+fs::path PackStore::GetPackPath(uint16_t Pack)
+{
+    char packName[10];
+    sprintf(packName, "%04hX.pack", Pack);
+    return PackDir / packName;
+}
+
+void* PackStore::OpenPack(uint16_t Pack)
+{
+    auto pack = CreateFileW(GetPackPath(Pack).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (pack == INVALID_HANDLE_VALUE) {
+        LOG_ERROR("Can't open pack %hu (%u)", Pack, GetLastError());
+    }
+    return pack;
+}
+
+bool PackStore::ReadIndex()
+{
+    auto indexPath = PackDir / "index";
+    auto fp = fopen(indexPath.string().c_str(), "rb");
+    if (!fp) {
+        return false; // new store, write the header
+    }
+
+    PACK_INDEX_HEADER header;
+    if (fread(&header, sizeof(PACK_INDEX_HEADER), 1, fp) != 1 || header.Magic != PACK_INDEX_MAGIC || header.Version != PACK_INDEX_VERSION) {
+        LOG_ERROR("Bad pack index header, starting over");
+        fclose(fp);
+        return false;
+    }
+
+    size_t recordCount = 0;
+    PACK_INDEX_ENTRY entry;
+    while (fread(&entry, sizeof(PACK_INDEX_ENTRY), 1, fp) == 1) {
+        recordCount++;
+        if (entry.Size) {
+            Index[entry.Guid] = entry;
+        }
+        else {
+            Index.erase(entry.Guid);
+        }
+    }
+    fclose(fp);
+
+    std::error_code ec;
+    auto indexSize = fs::file_size(indexPath, ec);
+    if (ec || (indexSize - sizeof(PACK_INDEX_HEADER)) % sizeof(PACK_INDEX_ENTRY)) {
+        LOG_WARN("Pack index has a partial record");
+        return false;
+    }
+
+    // compact it once it's mostly removed/overwritten records
+    return recordCount <= Index.size() * 2 + 1024;
+}
+
+void PackStore::RewriteIndex()
+{
+    auto tempPath = PackDir / "index.tmp";
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        LOG_ERROR("Can't rewrite pack index");
+        return;
+    }
+
+    PACK_INDEX_HEADER header;
+    header.Magic = PACK_INDEX_MAGIC;
+    header.Version = PACK_INDEX_VERSION;
+    fwrite(&header, sizeof(PACK_INDEX_HEADER), 1, fp);
+    for (auto& entry : Index) {
+        fwrite(&entry.second, sizeof(PACK_INDEX_ENTRY), 1, fp);
+    }
+    fclose(fp);
+
+    std::error_code ec;
+    fs::rename(tempPath, PackDir / "index", ec);
+    if (ec) {
+        LOG_ERROR("Can't replace pack index: %s", ec.message().c_str());
+    }
+}
+
+bool PackStore::AppendIndex(const PACK_INDEX_ENTRY& Entry)
+{
+    if (fwrite(&Entry, sizeof(PACK_INDEX_ENTRY), 1, IndexFile) != 1 || fflush(IndexFile)) {
+        LOG_ERROR("Can't write to pack index");
+        return false;
+    }
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "../containers/guid.h"
+
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+#define PACK_INDEX_MAGIC 0x4B504C45 // ELPK
+#define PACK_INDEX_VERSION 0
+
+#pragma pack(push, 1)
+struct PACK_INDEX_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+};
+
+struct PACK_INDEX_ENTRY {
+    char Guid[16];
+    uint16_t Pack;   // Pack file number
+    uint16_t Flags;  // ChunkFlag* of the stored chunk
+    uint32_t Size;   // Size of the stored chunk (header included), 0 if the chunk was removed
+    uint64_t Offset; // Offset of the stored chunk in the pack file
+};
+#pragma pack(pop)
+
+// Appends chunks back to back into large pack files instead of a file per chunk
+// An append-only index file maps each guid to its location, and the packs are kept open and read with positioned io
+// The space of overwritten and removed chunks is reused by later writes, so rewriting chunks doesn't grow the packs
+class PackStore {
+public:
+    PackStore(fs::path PackDir);
+    ~PackStore();
+
+    bool Contains(const char Guid[16]);
+    bool GetEntry(const char Guid[16], PACK_INDEX_ENTRY& Entry);
+    std::vector<guid_key> GetGuids();
+
+    // Reads the stored chunk (header included), the same bytes that would be in its loose chunk file
+    bool Read(const char Guid[16], std::shared_ptr<char[]>& Data, uint32_t& Size);
+    // Same as above, but into Buffer, which is only grown if the chunk doesn't fit
+    bool Read(const char Guid[16], std::vector<char>& Buffer, uint32_t& Size);
+    bool Write(const char Guid[16], uint16_t Flags, const char* Data, uint32_t Size);
+    void Remove(const char Guid[16]);
+
+private:
+    static constexpr uint64_t PackSizeLimit = 1024ull * 1024 * 1024; // 1 GB
+
+    fs::path GetPackPath(uint16_t Pack);
+    bool GetLocation(const char Guid[16], PACK_INDEX_ENTRY& Entry, void*& Pack);
+    void* OpenPack(uint16_t Pack);
+    bool ReadIndex();
+    void RewriteIndex();
+    bool AppendIndex(const PACK_INDEX_ENTRY& Entry);
+
+    // Finds the gaps between the indexed chunks
+    void ScanFreeSpace();
+    // The free space functions need WriteMutex
+    void AddFreeSpace(uint16_t Pack, uint64_t Offset, uint64_t Size);
+    bool TakeFreeSpace(uint32_t Size, uint16_t& Pack, uint64_t& Offset);
+    std::map<std::pair<uint16_t, uint64_t>, uint64_t>::iterator EraseFreeSpace(std::map<std::pair<uint16_t, uint64_t>, uint64_t>::iterator It);
+    // Needs both locks, frees the retired records if nobody's reading
+    void ReleaseRetired();
+
+    fs::path PackDir;
+
+    std::shared_mutex IndexMutex; // guards Index and Packs
+    std::unordered_map<guid_key, PACK_INDEX_ENTRY, guid_hash> Index;
+    std::vector<void*> Packs; // HANDLEs, kept open until destruction
+
+    std::mutex WriteMutex; // appends are serialized
+    FILE* IndexFile;
+    uint16_t CurrentPack;
+    uint64_t CurrentSize;
+
+    // Free space by location (pack, offset) -> size, and by size to find the smallest that fits
+    std::map<std::pair<uint16_t, uint64_t>, uint64_t> FreeSpace;
+    std::multimap<uint64_t, std::pair<uint16_t, uint64_t>> FreeSpaceBySize;
+    // Records that were overwritten or removed, a read that found them before that could still be reading them
+    // They're only freed once no reads are running, a read can't find them anymore once they're retired
+    std::vector<std::pair<std::pair<uint16_t, uint64_t>, uint64_t>> Retired;
+    std::atomic_uint32_t ActiveReads; // incremented under IndexMutex when a read finds its record
+};
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include "pool.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "ChunkPool"
+#endif
+
+#include "../Logger.h"
+
+ChunkPool::ChunkPool(size_t Capacity) :
+    Shards(std::make_unique<Shard[]>(ShardCount)),
+    ShardCapacity(Capacity / ShardCount)
+{ }
+
+ChunkPool::~ChunkPool()
+{
+
+}
+
+ChunkPoolHandle ChunkPool::Get(const char Guid[16], const status_getter& GetStatus)
+{
+    guid_key key(Guid);
+    auto& shard = GetShard(key);
+
+    std::lock_guard<std::mutex> lock(shard.Mutex);
+    auto lookupIt = shard.Lookup.find(key);
+    if (lookupIt != shard.Lookup.end()) {
+        // move to the back, it's the most recently used now
+        shard.Entries.splice(shard.Entries.end(), shard.Entries, lookupIt->second);
+        // pinned while the shard is locked, so eviction can't race with this
+        lookupIt->second->second.Pins.fetch_add(1, std::memory_order_relaxed);
+        return ChunkPoolHandle(&lookupIt->second->second);
+    }
+
+    auto entryIt = shard.Entries.emplace(shard.Entries.end(), std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple());
+    entryIt->second.Status = GetStatus();
+    entryIt->second.Pins.fetch_add(1, std::memory_order_relaxed);
+    shard.Lookup.emplace(key, entryIt);
+    return ChunkPoolHandle(&entryIt->second);
+}
+
+void ChunkPool::SetBuffer(const char Guid[16], const ChunkPoolHandle& Data, const std::pair<std::shared_ptr<char[]>, size_t>& Buffer)
+{
+    guid_key key(Guid);
+    auto& shard = GetShard(key);
+
+    {
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        shard.Size -= Data->Buffer.second;
+        shard.Size += Buffer.second;
+        Data->Buffer = Buffer;
+
+        auto lookupIt = shard.Lookup.find(key);
+        if (lookupIt != shard.Lookup.end()) {
+            Evict(shard, lookupIt->second);
+        }
+    }
+
+    Data->SetStatus(CHUNK_STATUS::Readable);
+}
+
+size_t ChunkPool::GetSize()
+{
+    size_t size = 0;
+    for (int i = 0; i < ShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(Shards[i].Mutex);
+        size += Shards[i].Size;
+    }
+    return size;
+}
+
+ChunkPool::Shard& ChunkPool::GetShard(const guid_key& Key)
+{
+    // the unordered_map buckets use the low bits, so shard with the high ones
+    return Shards[(Key.hi >> 60) % ShardCount];
+}
+
+void ChunkPool::Evict(Shard& Shard, const SHARD_LRU::iterator& Keep)
+{
+    auto it = Shard.Entries.begin();
+    while (Shard.Size > ShardCapacity && it != Shard.Entries.end()) {
+        // pinned entries are being read or waited on by someone, they can't be freed from under them
+        // (pins only go up while the shard is locked, so a 0 here stays 0)
+        if (it == Keep || it->second.Pins.load(std::memory_order_acquire)) {
+            ++it;
+            continue;
+        }
+        Shard.Size -= it->second.Buffer.second;
+        Shard.Lookup.erase(it->first);
+        it = Shard.Entries.erase(it);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "../containers/guid.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+enum class CHUNK_STATUS {
+    Unavailable, // Readable from download
+    Grabbing,    // Downloading
+    Available,   // Readable from local copy
+    Reading,     // Reading from local copy
+    Readable     // Readable from memory
+};
+
+struct CHUNK_POOL_DATA {
+    std::pair<std::shared_ptr<char[]>, size_t> Buffer;
+    std::condition_variable CV;
+    std::mutex CV_Mutex;
+    std::atomic<CHUNK_STATUS> Status;
+    std::atomic_uint32_t Pins = 0; // number of handles to this entry, pinned entries are never evicted
+
+    // Sets the status and wakes up anyone waiting on the entry
+    void SetStatus(CHUNK_STATUS NewStatus) {
+        {
+            std::lock_guard<std::mutex> lock(CV_Mutex);
+            Status = NewStatus;
+        }
+        CV.notify_all();
+    }
+};
+
+// Keeps a pool entry pinned (and alive) for as long as the handle exists
+class ChunkPoolHandle {
+public:
+    ChunkPoolHandle() : Data(nullptr) { }
+
+    // Data must already be pinned for this handle
+    explicit ChunkPoolHandle(CHUNK_POOL_DATA* Data) : Data(Data) { }
+
+    ChunkPoolHandle(const ChunkPoolHandle& other) : Data(other.Data) {
+        if (Data) {
+            Data->Pins.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    ChunkPoolHandle(ChunkPoolHandle&& other) noexcept : Data(std::exchange(other.Data, nullptr)) { }
+
+    ChunkPoolHandle& operator=(ChunkPoolHandle other) noexcept {
+        std::swap(Data, other.Data);
+        return *this;
+    }
+
+    ~ChunkPoolHandle() {
+        if (Data) {
+            Data->Pins.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    CHUNK_POOL_DATA* operator->() const {
+        return Data;
+    }
+
+    CHUNK_POOL_DATA& operator*() const {
+        return *Data;
+    }
+
+    explicit operator bool() const {
+        return Data;
+    }
+
+private:
+    CHUNK_POOL_DATA* Data;
+};
+
+// Memory pool of decompressed chunks
+// Split into shards (by guid) that each have their own lock, lookup, and lru list, so dispatcher threads don't all fight over one mutex
+class ChunkPool {
+public:
+    typedef std::function<CHUNK_STATUS()> status_getter;
+
+    // Capacity is in bytes, split evenly between all shards
+    ChunkPool(size_t Capacity);
+    ~ChunkPool();
+
+    // Returns a pinned handle to the entry for the guid, creating it with the status from GetStatus if it isn't pooled
+    ChunkPoolHandle Get(const char Guid[16], const status_getter& GetStatus);
+
+    // Sets the buffer of the entry and makes it readable, evicting old unpinned entries if the shard is over its budget
+    void SetBuffer(const char Guid[16], const ChunkPoolHandle& Data, const std::pair<std::shared_ptr<char[]>, size_t>& Buffer);
+
+    size_t GetSize();
+
+private:
+    static constexpr int ShardCount = 16;
+
+    typedef std::list<std::pair<guid_key, CHUNK_POOL_DATA>> SHARD_LRU; // least recently used is at the front
+
+    struct Shard {
+        std::mutex Mutex;
+        SHARD_LRU Entries;
+        std::unordered_map<guid_key, SHARD_LRU::iterator, guid_hash> Lookup;
+        size_t Size = 0; // bytes of all buffers in the shard
+    };
+
+    Shard& GetShard(const guid_key& Key);
+    void Evict(Shard& Shard, const SHARD_LRU::iterator& Keep);
+
+    std::unique_ptr<Shard[]> Shards;
+    size_t ShardCapacity;
+};
\ No newline at end of file
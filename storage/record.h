@@ -0,0 +1,51 @@
+#pragma once
+
+#include "flags.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Layout of a stored chunk, the same bytes whether it's a loose file or in a pack
+
+#define CHUNK_VERSION_BLOCKS 1 // compressed in independent blocks, see CHUNK_BLOCK_HEADER
+#define CHUNK_BLOCK_SIZE (64 * 1024)
+
+#pragma pack(push, 1)
+struct CHUNK_HEADER {
+    uint16_t version;
+    uint16_t flags;
+};
+
+// Follows CHUNK_HEADER in version 1 chunks, then the uint32_t dictionary ID if ChunkFlagDictionary is set,
+// then BlockCount uint32_t end offsets (relative to the first block), then the blocks themselves
+struct CHUNK_BLOCK_HEADER {
+    uint32_t DecompressedSize;
+    uint32_t BlockSize;
+    uint32_t BlockCount;
+};
+#pragma pack(pop)
+
+// Where the block end offsets start in a version 1 chunk
+inline size_t GetBlockTableOffset(uint16_t ChunkFlags)
+{
+    return sizeof(CHUNK_HEADER) + sizeof(CHUNK_BLOCK_HEADER) + (ChunkFlags & ChunkFlagDictionary ? sizeof(uint32_t) : 0);
+}
+
+// Returns the block header of a version 1 chunk if the block table fits inside it
+inline const CHUNK_BLOCK_HEADER* GetBlockHeader(const char* Data, uint32_t Size)
+{
+    auto tableOffset = GetBlockTableOffset(((const CHUNK_HEADER*)Data)->flags);
+    if (Size < tableOffset) {
+        return nullptr;
+    }
+    auto blockHeader = (const CHUNK_BLOCK_HEADER*)(Data + sizeof(CHUNK_HEADER));
+    if (!blockHeader->BlockSize || blockHeader->BlockCount != (blockHeader->DecompressedSize + blockHeader->BlockSize - 1) / blockHeader->BlockSize ||
+        (Size - tableOffset) / sizeof(uint32_t) < blockHeader->BlockCount) {
+        return nullptr;
+    }
+    auto blockEnds = (const uint32_t*)(Data + tableOffset);
+    if (blockHeader->BlockCount && blockEnds[blockHeader->BlockCount - 1] > Size - tableOffset - blockHeader->BlockCount * sizeof(uint32_t)) {
+        return nullptr;
+    }
+    return blockHeader;
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "scheduler.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "FetchScheduler"
+#endif
+
+#include "../Logger.h"
+#include "../Stats.h"
+
+#include <algorithm>
+
+#define SCHEDULER_SHARE_PERIOD 8 // while they're queued, prefetches and background downloads each get at least 1 of this many starts
+
+FetchScheduler::FetchScheduler(uint32_t Slots) :
+    QueuedCounts(),
+    Slots(std::max(Slots, 1u)),
+    Running(0),
+    StartCount(0)
+{
+
+}
+
+std::shared_ptr<FetchScheduler::Job> FetchScheduler::Submit(FetchPriority Priority, job_func Run)
+{
+    auto job = std::make_shared<Job>(Job{ std::move(Run), Priority, false });
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Queues[(int)Priority].emplace_back(job);
+        QueuedCounts[(int)Priority]++;
+        UpdateStats();
+    }
+    StartJobs();
+    return job;
+}
+
+void FetchScheduler::Raise(const std::shared_ptr<Job>& Job, FetchPriority Priority)
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (Job->Started || Job->Priority <= Priority) {
+        return;
+    }
+    QueuedCounts[(int)Job->Priority]--;
+    Job->Priority = Priority;
+    Queues[(int)Priority].emplace_back(Job);
+    QueuedCounts[(int)Priority]++;
+    UpdateStats();
+}
+
+void FetchScheduler::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Running--;
+    }
+    StartJobs();
+}
+
+void FetchScheduler::SetSlots(uint32_t Slots)
+{
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        this->Slots = std::max(Slots, 1u);
+    }
+    StartJobs();
+}
+
+void FetchScheduler::StartJobs()
+{
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            if (Running >= Slots) {
+                return;
+            }
+            job = PopNext();
+            if (!job) {
+                return;
+            }
+            Running++;
+            UpdateStats();
+        }
+        job->Run();
+    }
+}
+
+std::shared_ptr<FetchScheduler::Job> FetchScheduler::PopNext()
+{
+    auto priority = FetchPriority::Count;
+    auto turn = ++StartCount % SCHEDULER_SHARE_PERIOD;
+    if (turn == 0 && QueuedCounts[(int)FetchPriority::Background]) {
+        priority = FetchPriority::Background;
+    }
+    else if (turn == SCHEDULER_SHARE_PERIOD / 2 && QueuedCounts[(int)FetchPriority::Prefetch]) {
+        priority = FetchPriority::Prefetch;
+    }
+    else {
+        for (int i = 0; i < (int)FetchPriority::Count; ++i) {
+            if (QueuedCounts[i]) {
+                priority = (FetchPriority)i;
+                break;
+            }
+        }
+    }
+    if (priority == FetchPriority::Count) {
+        return nullptr;
+    }
+
+    auto& queue = Queues[(int)priority];
+    while (!queue.empty()) {
+        auto job = std::move(queue.front());
+        queue.pop_front();
+        // raised out of this queue
+        if (job->Started || job->Priority != priority) {
+            continue;
+        }
+        job->Started = true;
+        QueuedCounts[(int)priority]--;
+        return job;
+    }
+    LOG_ERROR("Queue %d is empty but %u were counted", (int)priority, QueuedCounts[(int)priority]);
+    QueuedCounts[(int)priority] = 0;
+    return nullptr;
+}
+
+void FetchScheduler::UpdateStats()
+{
+    Stats::FetchQueueInteractive.store(QueuedCounts[(int)FetchPriority::Interactive], std::memory_order_relaxed);
+    Stats::FetchQueuePrefetch.store(QueuedCounts[(int)FetchPriority::Prefetch], std::memory_order_relaxed);
+    Stats::FetchQueueBackground.store(QueuedCounts[(int)FetchPriority::Background], std::memory_order_relaxed);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+enum class FetchPriority : uint8_t {
+    Interactive, // something is blocked on it right now, like a file read
+    Prefetch,    // it's probably going to be read soon, like a file being preloaded
+    Background,  // preloading or verifying the whole build
+    Count
+};
+
+// Decides which download runs next when more are asked for than there are slots (connections) for
+// Higher priorities go first, but queued lower ones still get a minimum share of the starts so they can't starve
+class FetchScheduler {
+public:
+    typedef std::function<void()> job_func;
+
+    struct Job {
+        job_func Run;
+        FetchPriority Priority;
+        bool Started;
+    };
+
+    FetchScheduler(uint32_t Slots);
+
+    // Runs Run right away if there's a free slot, otherwise once one frees up
+    // Run is called without any locks held, and whatever it starts has to call Finish once it's done
+    std::shared_ptr<Job> Submit(FetchPriority Priority, job_func Run);
+    // Moves a job that hasn't started yet up to Priority, nothing happens if it's started or already there
+    void Raise(const std::shared_ptr<Job>& Job, FetchPriority Priority);
+    // Frees the slot of a finished job and starts the next one
+    void Finish();
+    void SetSlots(uint32_t Slots);
+
+private:
+    // Starts jobs until the slots are full or nothing's queued
+    void StartJobs();
+    // Mutex has to be held
+    std::shared_ptr<Job> PopNext();
+    // Mutex has to be held
+    void UpdateStats();
+
+    std::mutex Mutex;
+    // Raised jobs are left in their old queue too, they're skipped when they come up there
+    std::deque<std::shared_ptr<Job>> Queues[(int)FetchPriority::Count];
+    uint32_t QueuedCounts[(int)FetchPriority::Count]; // jobs actually waiting in each queue
+    uint32_t Slots;
+    uint32_t Running;
+    uint32_t StartCount; // the lower priorities' turns come up by this
+};
@@ -7,26 +7,128 @@
 #include "../Logger.h"
 #include "../Stats.h"
 #include "EGSProvider.h"
+#include "record.h"
 #include "sha.h"
 
+#include <algorithm>
+#include <ctime>
+#include <future>
 #include <libdeflate.h>
+#include <unordered_set>
 
-Storage::Storage(uint32_t Flags, uint32_t ChunkPoolCapacity, fs::path CacheLocation, std::string CloudDir) :
+#define WRITE_QUEUE_CAPACITY 64 // 64 MB of decompressed chunks
+#define DOWNLOAD_LOOP_COUNT 2   // event loop threads, each drives as many transfers as it's given
+#define DOWNLOAD_DEFAULT_CONNECTIONS 16 // when nothing's preloading, enough for the game's reads
+#define FETCH_CANCEL_POLL std::chrono::milliseconds(50) // how often a blocking download checks if it was cancelled
+#define SAVE_INTERVAL std::chrono::minutes(5) // how often the access log and verify times are saved, so a crash doesn't lose more than this
+#define RENAME_TRIES 10 // a reader that has the old chunk file open makes replacing it fail, they don't keep it open for long
+#define RENAME_RETRY_DELAY std::chrono::milliseconds(10)
+
+#define ADAPTIVE_ENTROPY_LIMIT 7.9f  // bits per byte, anything above that is treated as incompressible without trying
+#define ADAPTIVE_RAW_RATIO     .97f  // stored raw if the storage method can't get below this
+#define ADAPTIVE_FAST_RATIO    1.1f  // LZ4 is used if it's at most 10% bigger than the storage method
+
+#pragma pack(push, 1)
+#define CHUNK_HEADER_MAGIC 0xB1FE3AA2
+struct CDN_CHUNK_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t HeaderSize;
+    uint32_t DataSizeCompressed;
+    char Guid[16];
+    uint64_t RollingHash;
+    uint8_t StoredAs; // EChunkStorageFlags
+};
+
+struct CDN_CHUNK_HEADER_V2 {
+    char SHAHash[20];
+    uint8_t HashType; // EChunkHashFlags
+};
+
+struct CDN_CHUNK_HEADER_V3 {
+    uint32_t DataSizeUncompressed;
+};
+#pragma pack(pop)
+
+Storage::Storage(uint32_t Flags, size_t ChunkPoolCapacity, size_t CompressedCacheCapacity, uint32_t RetainedBuildCount, uint32_t ArchiveAfterDays, fs::path CacheLocation, std::string CloudDir, const std::string& BuildId, const std::vector<std::shared_ptr<Chunk>>& ChunkList) :
     Flags(Flags),
-    ChunkPoolCapacity(ChunkPoolCapacity),
+    ChunkPool(ChunkPoolCapacity),
+    CompressedChunks(CompressedCacheCapacity),
+    Journal(CacheLocation / "journal"),
+    Builds(CacheLocation / "builds", RetainedBuildCount),
+    Accesses(CacheLocation / "access", ChunkList),
+    ArchiveAfterDays(ArchiveAfterDays),
     CachePath(CacheLocation),
     CloudDir(CloudDir),
-    Compressor(Flags)
-{ }
+    Compressor(Flags),
+    Dictionaries(CacheLocation / "dicts", Compressor, (Flags & StorageCompMethodMask) == StorageZstd && (Flags & StorageZstdDictionary)),
+    ChunkPresence(ChunkList.size()),
+    ChunkVerified(ChunkList.size()),
+    LooseChunkCount(0),
+    SaveStopping(false),
+    Writer(std::max(std::thread::hardware_concurrency() / 2, 1u), WRITE_QUEUE_CAPACITY, [this](const std::shared_ptr<Chunk>& Chunk, const std::shared_ptr<char[]>& Buffer, bool Urgent) {
+        // only background writes are held to the write limit, a read is waiting on urgent ones
+        WriteChunk(Chunk, Buffer, false, !Urgent);
+    }),
+    Scheduler(DOWNLOAD_DEFAULT_CONNECTIONS),
+    Downloader(DOWNLOAD_LOOP_COUNT)
+{
+    Downloader.SetMaxConnections(DOWNLOAD_DEFAULT_CONNECTIONS);
+    if ((Flags & StoragePackFiles) || fs::is_regular_file(CachePath / "packs" / "index")) {
+        Packs = std::make_unique<PackStore>(CachePath / "packs");
+    }
+
+    Builds.Retain(BuildId, ChunkList);
+
+    ChunkIndices.reserve(ChunkList.size());
+    for (uint32_t i = 0; i < ChunkList.size(); ++i) {
+        ChunkIndices.emplace(ChunkList[i]->Guid, i);
+    }
+    ScanChunks(ChunkList);
+    LinkDuplicateChunks(ChunkList);
+
+    SaveThread = std::thread(&Storage::SaveJob, this);
+}
 
 Storage::~Storage()
 {
+    // the writer finishes its queue when it's destroyed, throttled writes would hold that up
+    WriteLimiter.set_rate(0);
+    {
+        std::lock_guard<std::mutex> lock(SaveMutex);
+        SaveStopping = true;
+    }
+    SaveCV.notify_all();
+    SaveThread.join();
+
+    // the downloader fails whatever's still running when it's destroyed, this makes those fetches finish instead of retrying
+    std::lock_guard<std::mutex> lock(FetchesMutex);
+    for (auto& fetch : Fetches) {
+        fetch.second->Flag.cancel();
+    }
+}
 
+void Storage::SaveJob()
+{
+    std::unique_lock<std::mutex> lock(SaveMutex);
+    while (!SaveCV.wait_for(lock, SAVE_INTERVAL, [this] { return SaveStopping; })) {
+        lock.unlock();
+        Accesses.Save(); // does nothing if nothing was read since the last save
+        Journal.FlushVerified();
+        lock.lock();
+    }
 }
 
 bool Storage::IsChunkDownloaded(std::shared_ptr<Chunk> Chunk)
 {
-    return fs::status(CachePath / Chunk->GetFilePath()).type() == fs::file_type::regular;
+    auto index = ChunkIndices.find(Chunk->Guid);
+    if (index == ChunkIndices.end()) { // not part of the manifest, shouldn't really happen
+        if (Packs && Packs->Contains(Chunk->Guid)) {
+            return true;
+        }
+        return fs::status(CachePath / Chunk->GetFilePath()).type() == fs::file_type::regular;
+    }
+    return ChunkPresence.test(index->second);
 }
 
 bool Storage::IsChunkDownloaded(ChunkPart& ChunkPart)
@@ -37,349 +139,1245 @@ bool Storage::IsChunkDownloaded(ChunkPart& ChunkPart)
 bool Storage::VerifyChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag)
 {
     Compressor::buffer_value chunkData;
-    if (!ReadChunk(CachePath / Chunk->GetFilePath(), chunkData, flag)) {
+    if (!ReadChunk(Chunk, chunkData, flag)) {
         return false;
     }
     Stats::ProvideCount.fetch_add(chunkData.second, std::memory_order_relaxed);
-    return VerifyHash(chunkData.first.get(), chunkData.second, Chunk->ShaHash);
+    if (!VerifyHash(chunkData.first.get(), chunkData.second, Chunk->ShaHash)) {
+        return false;
+    }
+    SetChunkVerified(Chunk, true);
+    return true;
 }
 
 void Storage::DeleteChunk(std::shared_ptr<Chunk> Chunk)
 {
+    SetChunkPresence(Chunk, false);
+    SetChunkVerified(Chunk, false);
+    Journal.Remove(Chunk->Guid);
+    CompressedChunks.Remove(Chunk->Guid);
+    if (Packs) {
+        Packs->Remove(Chunk->Guid);
+    }
     fs::remove(CachePath / Chunk->GetFilePath());
 }
 
-std::shared_ptr<char[]> Storage::GetChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag)
+std::shared_ptr<char[]> Storage::GetChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, FetchPriority Priority)
 {
-    auto& data = GetPoolData(Chunk);
-    SAFE_FLAG_RETURN(nullptr);
-    switch (data.Status)
-    {
-    case CHUNK_STATUS::Unavailable:
-    redownloadChunk:
-    {
-        SAFE_FLAG_RETURN(nullptr);
-        // download
-        data.Status = CHUNK_STATUS::Grabbing;
+    return GetChunkData(Chunk, 0, Chunk->WindowSize, flag, Priority);
+}
 
-        auto chunkData = DownloadChunk(Chunk, flag);
-        if (chunkData.first)
-        {
-            data.Buffer = chunkData;
-            data.Status = CHUNK_STATUS::Readable;
-            data.CV.notify_all();
-        }
-        else {
-            data.Status = CHUNK_STATUS::Unavailable;
-        }
-        break;
+std::shared_ptr<char[]> Storage::GetChunkPart(ChunkPart& ChunkPart, cancel_flag& flag, FetchPriority Priority)
+{
+    return GetChunkData(ChunkPart.Chunk, ChunkPart.Offset, ChunkPart.Size, flag, Priority);
+}
+
+// Views share ownership with the whole chunk buffer, no copy or allocation needed
+inline std::shared_ptr<char[]> GetDataView(const std::shared_ptr<char[]>& Data, uint32_t Offset)
+{
+    if (!Data || Offset == 0) {
+        return Data;
     }
-    case CHUNK_STATUS::Available:
-    {
-        // read from file
-        data.Status = CHUNK_STATUS::Reading;
+    return std::shared_ptr<char[]>(Data, Data.get() + Offset);
+}
 
-        Compressor::buffer_value chunkData;
-        if (!ReadChunk(CachePath / Chunk->GetFilePath(), chunkData, flag)) {
-            if (flag.cancelled()) {
-                data.Status = CHUNK_STATUS::Available;
-                break;
+std::shared_ptr<char[]> Storage::GetChunkData(std::shared_ptr<Chunk> Chunk, uint32_t Offset, uint32_t Size, cancel_flag& flag, FetchPriority Priority)
+{
+    TouchChunk(Chunk);
+
+    // the handle keeps the entry pinned until we return, so it can't be evicted while we're reading or waiting on it
+    auto data = GetPoolData(Chunk);
+    while (true) {
+        SAFE_FLAG_RETURN(nullptr);
+        auto status = data->Status.load();
+        switch (status)
+        {
+        case CHUNK_STATUS::Unavailable:
+        {
+            if (!data->Status.compare_exchange_strong(status, CHUNK_STATUS::Grabbing)) {
+                continue; // another thread got to it first
+            }
+            {
+                // evicted from the pool before it could be written
+                auto pending = Writer.GetPending(Chunk->Guid);
+                if (pending) {
+                    ChunkPool.SetBuffer(Chunk->Guid, data, std::make_pair(pending, Chunk->WindowSize));
+                    return GetDataView(pending, Offset);
+                }
             }
-            DeleteChunk(Chunk);
-            goto redownloadChunk;
+        redownloadChunk:
+            data->SetStatus(CHUNK_STATUS::Grabbing);
+
+            auto chunkData = FetchChunk(Chunk, flag, false, Priority);
+            if (!chunkData.first) {
+                data->SetStatus(CHUNK_STATUS::Unavailable);
+                return nullptr;
+            }
+            // readable right away, it gets compressed and written in the background
+            ChunkPool.SetBuffer(Chunk->Guid, data, chunkData);
+            StoreChunk(Chunk, chunkData.first, true);
+            return GetDataView(chunkData.first, Offset);
         }
-        if (Flags & StorageVerifyHashes) {
-            if (!VerifyHash(chunkData.first.get(), chunkData.second, Chunk->ShaHash)) {
+        case CHUNK_STATUS::Available:
+        {
+            if (!data->Status.compare_exchange_strong(status, CHUNK_STATUS::Reading)) {
+                continue; // another thread got to it first
+            }
+            // deduplicated chunks are archived and rehydrated as the chunk they're stored under, so that's the one being read
+            auto storedChunk = GetStoredChunk(Chunk);
+            if (storedChunk != Chunk) {
+                TouchChunk(storedChunk);
+            }
+            {
+                // an archived chunk that's still being rewritten, the stored one could be half written
+                auto pending = Writer.GetPending(storedChunk->Guid);
+                if (pending) {
+                    ChunkPool.SetBuffer(Chunk->Guid, data, std::make_pair(pending, Chunk->WindowSize));
+                    return GetDataView(pending, Offset);
+                }
+            }
+
+            // read from the compressed cache, or from the disk if it's not there
+            std::shared_ptr<char[]> stored;
+            uint32_t storedSize;
+            auto cached = CompressedChunks.Get(Chunk->Guid, stored, storedSize);
+            if (!cached && !ReadStoredChunk(Chunk, stored, storedSize)) {
                 if (flag.cancelled()) {
-                    data.Status = CHUNK_STATUS::Available;
-                    break;
+                    data->SetStatus(CHUNK_STATUS::Available);
+                    return nullptr;
                 }
                 DeleteChunk(Chunk);
                 goto redownloadChunk;
             }
+            // it's being read again, so it goes back to the storage method
+            auto archived = (((CHUNK_HEADER*)stored.get())->flags & ChunkFlagCompMask) == ChunkFlagLZMA;
+
+            // only the part's blocks need decoding, but the hash can only be checked against the whole chunk
+            // archived chunks are a single block anyway
+            if (!archived && (Offset != 0 || Size != Chunk->WindowSize) && (!(Flags & StorageVerifyHashes) || IsChunkVerified(Chunk))) {
+                std::shared_ptr<char[]> partData;
+                uint32_t partOffset;
+                if (DecodePart(Chunk, stored, storedSize, Offset, Size, partData, partOffset)) {
+                    if (!cached) {
+                        CompressedChunks.Insert(Chunk->Guid, stored, storedSize);
+                    }
+                    // the pool only holds whole chunks, so the next reader decodes its own part
+                    data->SetStatus(CHUNK_STATUS::Available);
+                    return GetDataView(partData, partOffset);
+                }
+                // not stored in blocks, decode all of it
+            }
+
+            Compressor::buffer_value chunkData;
+            if (flag.cancelled() || !DecodeChunk(Chunk, stored.get(), storedSize, chunkData, stored)) {
+                if (flag.cancelled()) {
+                    data->SetStatus(CHUNK_STATUS::Available);
+                    return nullptr;
+                }
+                DeleteChunk(Chunk);
+                goto redownloadChunk;
+            }
+            if (Flags & StorageVerifyHashes) {
+                if (!VerifyHash(chunkData.first.get(), chunkData.second, Chunk->ShaHash)) {
+                    if (flag.cancelled()) {
+                        data->SetStatus(CHUNK_STATUS::Available);
+                        return nullptr;
+                    }
+                    DeleteChunk(Chunk);
+                    goto redownloadChunk;
+                }
+                SetChunkVerified(Chunk, true);
+            }
+            if (!cached && !archived && (((CHUNK_HEADER*)stored.get())->flags & ChunkFlagCompMask) != ChunkFlagDecompressed) {
+                CompressedChunks.Insert(Chunk->Guid, stored, storedSize);
+            }
+
+            ChunkPool.SetBuffer(Chunk->Guid, data, chunkData);
+            if (archived && !Writer.GetPending(storedChunk->Guid)) {
+                // a chunk deduplicated onto it could've already queued or written the rehydrate since this one was read
+                CHUNK_JOURNAL_RECORD record;
+                if (!Journal.Get(storedChunk->Guid, record) || (record.Flags & ChunkFlagCompMask) == ChunkFlagLZMA) {
+                    Writer.Push(storedChunk, chunkData.first, true);
+                }
+            }
+            return GetDataView(chunkData.first, Offset);
         }
-        
+        case CHUNK_STATUS::Grabbing: // downloading from server, wait until it's done
+        case CHUNK_STATUS::Reading:  // reading from file, wait until it's done
         {
-            data.Buffer = chunkData;
-            data.Status = CHUNK_STATUS::Readable;
-            data.CV.notify_all();
+            std::unique_lock<std::mutex> lk(data->CV_Mutex);
+            data->CV.wait(lk, [&] {
+                auto waitStatus = data->Status.load();
+                return (waitStatus != CHUNK_STATUS::Grabbing && waitStatus != CHUNK_STATUS::Reading) || flag.cancelled();
+            });
+            // check again, if the other thread failed we have to grab it ourselves
+            continue;
+        }
+        case CHUNK_STATUS::Readable: // available in memory pool
+            return GetDataView(data->Buffer.first, Offset);
+        default:
+            // h o w
+            return nullptr;
         }
-        break;
-    }
-    case CHUNK_STATUS::Grabbing: // downloading from server, wait until mutex releases
-    case CHUNK_STATUS::Reading:  // reading from file, wait until mutex releases
-    {
-        std::unique_lock<std::mutex> lk(data.CV_Mutex);
-        data.CV.wait(lk, [&] { return data.Status == CHUNK_STATUS::Readable || flag.cancelled(); });
-        SAFE_FLAG_RETURN(nullptr);
-        break;
-    }
-    case CHUNK_STATUS::Readable: // available in memory pool
-    {
-        break;
-    }
-    default:
-        // h o w
-        break;
     }
-    return data.Buffer.first;
 }
 
-std::shared_ptr<char[]> Storage::GetChunkPart(ChunkPart& ChunkPart, cancel_flag& flag)
+ChunkPoolHandle Storage::GetPoolData(std::shared_ptr<Chunk> Chunk)
 {
-    auto chunk = GetChunk(ChunkPart.Chunk, flag);
-    if (ChunkPart.Offset == 0 && ChunkPart.Size == ChunkPart.Chunk->WindowSize) {
-        return chunk;
-    }
-    else {
-        auto partBuffer = std::shared_ptr<char[]>(new char[ChunkPart.Size]);
-        memcpy(partBuffer.get(), chunk.get() + ChunkPart.Offset, ChunkPart.Size);
-        return partBuffer;
+    return ChunkPool.Get(Chunk->Guid, [&, this]() { return GetUnpooledChunkStatus(Chunk); });
+}
+
+CHUNK_STATUS Storage::GetUnpooledChunkStatus(std::shared_ptr<Chunk> Chunk)
+{
+    return IsChunkDownloaded(Chunk) ? CHUNK_STATUS::Available : CHUNK_STATUS::Unavailable;
+}
+
+Compressor::buffer_value Storage::DownloadChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload)
+{
+    auto chunkData = FetchChunk(Chunk, flag, forceDownload, FetchPriority::Background);
+    if (chunkData.first) {
+        StoreChunk(Chunk, chunkData.first);
     }
+    return chunkData;
 }
 
-CHUNK_POOL_DATA& Storage::GetPoolData(std::shared_ptr<Chunk> Chunk)
+void Storage::DownloadChunkAsync(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, fetch_callback OnFetched)
 {
-    std::lock_guard<std::mutex> statusLock(ChunkPoolMutex);
-    for (auto& chunk : ChunkPool) {
-        if (!memcmp(Chunk->Guid, chunk.first, 16)) {
-            return chunk.second;
-        }
+    FetchChunkAsync(Chunk, flag, false, FetchPriority::Background, std::move(OnFetched));
+}
+
+void Storage::StoreChunk(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, bool Urgent)
+{
+    // everyone that shared the download stores it, only the first one gets to queue it
+    // pending is checked first, the chunk is marked as present before it stops being pending
+    if (Writer.GetPending(Chunk->Guid) == Data || IsChunkDownloaded(Chunk)) {
+        return;
     }
+    Writer.Push(Chunk, Data, Urgent);
+}
 
-    while (ChunkPool.size() >= ChunkPoolCapacity)
-    {
-        ChunkPool.pop_front();
+void Storage::SetDownloadConnections(long Count)
+{
+    if (Count == -1) {
+        Count = DOWNLOAD_DEFAULT_CONNECTIONS;
     }
+    Downloader.SetMaxConnections(Count);
+    Scheduler.SetSlots(Count);
+}
 
-    auto& data = ChunkPool.emplace_back();
-    data.first = Chunk->Guid;
-    data.second.Status = GetUnpooledChunkStatus(Chunk);
-    return data.second;
+void Storage::SetBackgroundLimits(uint64_t DownloadBytesPerSec, uint64_t WriteBytesPerSec)
+{
+    DownloadLimiter.set_rate(DownloadBytesPerSec);
+    WriteLimiter.set_rate(WriteBytesPerSec);
 }
 
-CHUNK_STATUS Storage::GetUnpooledChunkStatus(std::shared_ptr<Chunk> Chunk)
+void Storage::FlushWrites()
 {
-    return IsChunkDownloaded(Chunk) ? CHUNK_STATUS::Available : CHUNK_STATUS::Unavailable;
+    // something's waiting on them, so the background limit doesn't apply to what's left
+    auto writeRate = WriteLimiter.get_rate();
+    WriteLimiter.set_rate(0);
+    Writer.Flush();
+    WriteLimiter.set_rate(writeRate);
+    // after a verify, so all of it's saved right away
+    Journal.FlushVerified();
 }
 
-#pragma pack(push, 1)
-struct CHUNK_HEADER {
-    uint16_t version;
-    uint16_t flags;
-};
+size_t Storage::RecompressChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag)
+{
+    uint16_t storedFlags;
+    size_t storedSize;
+    bool linked;
+    if (!IsChunkDownloaded(Chunk) || !GetChunkMetadata(Chunk, storedFlags, storedSize, linked) || linked) {
+        return 0; // linked chunks get converted with the chunk they point to
+    }
+    auto archive = IsChunkCold(Chunk);
+    if (archive) {
+        // chunks that were stored raw because they're incompressible stay that way
+        if ((storedFlags & ChunkFlagCompMask) == ChunkFlagLZMA || ((storedFlags & ChunkFlagCompMask) == ChunkFlagDecompressed && (storedFlags & ChunkFlagAdaptive))) {
+            return 0;
+        }
+    }
+    else {
+        auto targetFlags = GetStorageChunkFlags();
+        // adaptive chunks can be stored with any method, only the level and whether it's adaptive matter for those
+        auto methodMatches = (Flags & StorageAdaptive) && (targetFlags & ChunkFlagCompMask) != ChunkFlagDecompressed ?
+            (storedFlags & ChunkFlagAdaptive) :
+            !(storedFlags & ChunkFlagAdaptive) && (storedFlags & ChunkFlagCompMask) == (targetFlags & ChunkFlagCompMask);
+        // zstd chunks written before the dictionary was trained are redone with it
+        auto dictMatches = (storedFlags & ChunkFlagCompMask) != ChunkFlagZstd || (storedFlags & ChunkFlagDictionary) || !Compressor.GetDictionaryId();
+        if (methodMatches && dictMatches && (!(storedFlags & ChunkFlagLevelMask) || (storedFlags & ChunkFlagLevelMask) == (targetFlags & ChunkFlagLevelMask))) {
+            return 0;
+        }
+    }
 
-#define CHUNK_HEADER_MAGIC 0xB1FE3AA2
-struct CDN_CHUNK_HEADER {
-    uint32_t Magic;
-    uint32_t Version;
-    uint32_t HeaderSize;
-    uint32_t DataSizeCompressed;
-    char Guid[16];
-    uint64_t RollingHash;
-    uint8_t StoredAs; // EChunkStorageFlags
-};
+    // while the handle is held, readers either use the pooled buffer or wait on Reading, so nobody reads the chunk while it's replaced
+    auto data = GetPoolData(Chunk);
+    auto status = data->Status.load();
+    std::shared_ptr<char[]> chunkData;
+    if (status == CHUNK_STATUS::Readable) {
+        chunkData = data->Buffer.first;
+        if (!WriteChunk(Chunk, chunkData, archive, true)) {
+            return 0;
+        }
+    }
+    else if (status == CHUNK_STATUS::Available && data->Status.compare_exchange_strong(status, CHUNK_STATUS::Reading)) {
+        Compressor::buffer_value readBuffer;
+        // bad chunks are left alone, the next read or verify redownloads them
+        if (ReadChunk(Chunk, readBuffer, flag) && VerifyHash(readBuffer.first.get(), readBuffer.second, Chunk->ShaHash)) {
+            SetChunkVerified(Chunk, true);
+            if (!WriteChunk(Chunk, readBuffer.first, archive, true)) {
+                storedSize = 0; // it's still stored the old way, the next pass tries it again
+            }
+        }
+        else {
+            storedSize = 0;
+        }
+        data->SetStatus(CHUNK_STATUS::Available);
+        if (!storedSize) {
+            return 0;
+        }
+    }
+    else {
+        return 0; // being downloaded or read, it's picked up on the next pass
+    }
+    return storedSize + Chunk->WindowSize;
+}
 
-struct CDN_CHUNK_HEADER_V2 {
-    char SHAHash[20];
-    uint8_t HashType; // EChunkHashFlags
-};
+uint16_t Storage::GetChunkFlags(const char* Data, uint32_t Size)
+{
+    auto storageFlags = GetStorageChunkFlags();
+    if (!(Flags & StorageAdaptive) || (storageFlags & ChunkFlagCompMask) == ChunkFlagDecompressed) {
+        return storageFlags;
+    }
+    auto levelFlags = (storageFlags & ChunkFlagLevelMask) | ChunkFlagAdaptive;
 
-struct CDN_CHUNK_HEADER_V3 {
-    uint32_t DataSizeUncompressed;
-};
-#pragma pack(pop)
+    // the first block says enough about the rest, chunks are mostly parts of a single file
+    auto sampleSize = std::min<uint32_t>(Size, CHUNK_BLOCK_SIZE);
+    if (!sampleSize || Compressor::GetEntropy(Data, sampleSize) > ADAPTIVE_ENTROPY_LIMIT) {
+        return ChunkFlagDecompressed | levelFlags;
+    }
 
-Compressor::buffer_value Storage::DownloadChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload)
+    auto dictId = (storageFlags & ChunkFlagCompMask) == ChunkFlagZstd ? Compressor.GetDictionaryId() : 0;
+    auto storageRatio = (float)(dictId ? Compressor.DictCompress(dictId, Data, sampleSize) : Compressor.StorageCompress(Data, sampleSize)).second / sampleSize;
+    if (storageRatio > ADAPTIVE_RAW_RATIO) {
+        return ChunkFlagDecompressed | levelFlags;
+    }
+    if ((storageFlags & ChunkFlagCompMask) != ChunkFlagLZ4) {
+        auto fastRatio = (float)Compressor.FastCompress(Data, sampleSize).second / sampleSize;
+        if (fastRatio <= storageRatio * ADAPTIVE_FAST_RATIO) {
+            return ChunkFlagLZ4 | levelFlags;
+        }
+    }
+    return storageFlags | ChunkFlagAdaptive;
+}
+
+Compressor::buffer_value Storage::FetchChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload, FetchPriority Priority)
 {
-    std::shared_ptr<char[]> data;
+    // the transfer runs on the download threads, this one just waits for it
+    auto promise = std::make_shared<std::promise<Compressor::buffer_value>>();
+    auto future = promise->get_future();
+    FetchChunkAsync(Chunk, flag, forceDownload, Priority, [promise](Compressor::buffer_value ChunkData) {
+        promise->set_value(ChunkData);
+    });
+    // the download could be shared with others, so the flag can't abort it, we can only stop waiting on it
+    while (future.wait_for(FETCH_CANCEL_POLL) == std::future_status::timeout) {
+        if (flag.cancelled()) {
+            CancelDownloads(flag);
+        }
+    }
+    return future.get();
+}
 
+void Storage::FetchChunkAsync(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload, FetchPriority Priority, fetch_callback OnFetched)
+{
     if (!forceDownload && EGSProvider::Available() && EGSProvider::IsChunkAvailable(Chunk)) {
         LOG_DEBUG("GETTING EGL DATA");
-        data = EGSProvider::GetChunk(Chunk);
+        auto data = EGSProvider::GetChunk(Chunk);
+        if (data) { // EGSProvider GetChunk could return nullptr
+            OnFetched(std::make_pair(data, Chunk->WindowSize));
+            return;
+        }
     }
-    if (!data) { // EGSProvider GetChunk could return nullptr
-        std::vector<char> chunkData;
-        {
-            auto chunkConn = Client::CreateConnection();
-            chunkConn->SetUrl(CloudDir + Chunk->GetUrl());
-            if (!Client::Execute(chunkConn, flag)) {
-                SAFE_FLAG_RETURN(std::make_pair(nullptr, 0));
-                LOG_WARN("Retrying...");
-                return DownloadChunk(Chunk, flag);
+
+    std::shared_ptr<ChunkFetch> fetch;
+    {
+        std::lock_guard<std::mutex> lock(FetchesMutex);
+        auto& entry = Fetches[Chunk->Guid];
+        // everyone that wanted a cancelled one gave up on it, so it can't be joined
+        if (entry && !entry->Flag.cancelled()) {
+            entry->Waiters.emplace_back(&flag, std::move(OnFetched));
+            // a read that joins a queued preload download shouldn't wait behind the rest of the preload
+            Scheduler.Raise(entry->Job, Priority);
+            std::lock_guard<std::mutex> fetchLock(entry->Mutex);
+            if (Priority < entry->Priority) {
+                // nor should it be held to the background limit if it's already running
+                if (entry->Priority == FetchPriority::Background && entry->Connection) {
+                    Downloader.SetLimiter(entry->Connection, nullptr);
+                }
+                entry->Priority = Priority;
             }
+            return;
+        }
+        entry = fetch = std::make_shared<ChunkFetch>();
+        fetch->Priority = Priority;
+        fetch->Waiters.emplace_back(&flag, std::move(OnFetched));
+        // started once the scheduler gives it a connection, set under the lock so nobody can try raising it before it's there
+        fetch->Job = Scheduler.Submit(Priority, [=, this] {
+            StartFetch(Chunk, fetch);
+        });
+    }
+}
 
-            chunkData.reserve(chunkConn->GetResponseBody().size());
-            Stats::DownloadCount.fetch_add(chunkConn->GetResponseBody().size(), std::memory_order_relaxed);
-            std::copy(chunkConn->GetResponseBody().begin(), chunkConn->GetResponseBody().end(), std::back_inserter(chunkData));
+void Storage::StartFetch(std::shared_ptr<Chunk> Chunk, std::shared_ptr<ChunkFetch> Fetch)
+{
+    auto chunkConn = Client::CreateConnection();
+    chunkConn->SetUrl(CloudDir + Chunk->GetUrl());
+    // started under the lock, so a read that joins it either raises it before it's throttled or unthrottles it once it's running
+    // it's the fetch's own lock, the scheduler can start this while FetchesMutex is held
+    std::lock_guard<std::mutex> lock(Fetch->Mutex);
+    Fetch->Connection = chunkConn;
+    auto onFinished = [=, this](const std::shared_ptr<curlion::HttpConnection>& connection, bool success, Client::HedgeOutcome outcome) {
+        std::shared_ptr<char[]> data;
+        if (!Fetch->Flag.cancelled()) {
+            Stats::FetchCount.fetch_add(1, std::memory_order_relaxed);
+            if (outcome != Client::HedgeOutcome::NotHedged) {
+                Stats::HedgeCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (outcome == Client::HedgeOutcome::HedgeWon) {
+                Stats::HedgeWinCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (success) {
+                Stats::DownloadCount.fetch_add(connection->GetResponseBody().size(), std::memory_order_relaxed);
+                data = ParseCdnChunk(Chunk, connection->GetResponseBody());
+            }
+            if (!data) {
+                LOG_WARN("Retrying...");
+                StartFetch(Chunk, Fetch);
+                return;
+            }
         }
 
-        size_t decompressedSize = 1024 * 1024;
+        Scheduler.Finish();
 
-        auto headerv1 = *(CDN_CHUNK_HEADER*)chunkData.data();
-        auto chunkPos = sizeof(CDN_CHUNK_HEADER);
-        if (headerv1.Magic != CHUNK_HEADER_MAGIC) {
-            LOG_ERROR("Downloaded chunk (%s) magic invalid: %08X", Chunk->GetGuid(), headerv1.Magic);
-            LOG_WARN("Retrying...");
-            return DownloadChunk(Chunk, flag);
+        decltype(Fetch->Waiters) waiters;
+        {
+            std::lock_guard<std::mutex> lock(FetchesMutex);
+            auto entry = Fetches.find(Chunk->Guid);
+            // a cancelled one could've been replaced already
+            if (entry != Fetches.end() && entry->second == Fetch) {
+                Fetches.erase(entry);
+            }
+            waiters = std::move(Fetch->Waiters);
+            Fetch->Job.reset(); // the job holds on to the fetch
+        }
+        for (auto& waiter : waiters) {
+            waiter.second(std::make_pair(data, data ? Chunk->WindowSize : 0));
         }
-        if (headerv1.Version >= 2) {
-            auto headerv2 = *(CDN_CHUNK_HEADER_V2*)(chunkData.data() + chunkPos);
-            chunkPos += sizeof(CDN_CHUNK_HEADER_V2);
-            if (headerv1.Version >= 3) {
-                auto headerv3 = *(CDN_CHUNK_HEADER_V3*)(chunkData.data() + chunkPos);
-                decompressedSize = headerv3.DataSizeUncompressed;
+    };
 
-                if (headerv1.Version > 3) { // version past 3
-                    chunkPos = headerv1.HeaderSize;
+    if (Fetch->Priority == FetchPriority::Background) {
+        // not hedged, a slow CDN would just get twice the requests while the preload's already using the whole connection
+        Downloader.ExecuteAsync(chunkConn, Fetch->Flag, [onFinished](const std::shared_ptr<curlion::HttpConnection>& connection, bool success) {
+            onFinished(connection, success, Client::HedgeOutcome::NotHedged);
+        }, false, &DownloadLimiter);
+        return;
+    }
+    // something's waiting on it, so if the CDN server is slow to answer, the same request goes out again over another connection
+    auto createHedge = [this, Chunk] {
+        auto hedgeConn = Client::CreateConnection();
+        hedgeConn->SetUrl(CloudDir + Chunk->GetUrl());
+        return hedgeConn;
+    };
+    Downloader.ExecuteHedgedAsync(chunkConn, createHedge, Fetch->Flag, onFinished);
+}
+
+void Storage::CancelDownloads(cancel_flag& flag)
+{
+    std::vector<fetch_callback> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(FetchesMutex);
+        for (auto& fetch : Fetches) {
+            auto& waiters = fetch.second->Waiters;
+            auto waiterEnd = std::remove_if(waiters.begin(), waiters.end(), [&](auto& waiter) {
+                if (waiter.first != &flag) {
+                    return false;
                 }
+                cancelled.emplace_back(std::move(waiter.second));
+                return true;
+            });
+            waiters.erase(waiterEnd, waiters.end());
+            if (waiters.empty()) {
+                fetch.second->Flag.cancel(); // nobody wants it anymore
             }
         }
+    }
+    for (auto& callback : cancelled) {
+        callback(std::make_pair(nullptr, 0));
+    }
+}
 
-        if (headerv1.StoredAs & 0x02) // encrypted
-        {
-            LOG_ERROR("Downloaded chunk (%s) is encrypted", Chunk->GetGuid());
-            //return; // no support yet, i have never seen this used in practice
+std::shared_ptr<char[]> Storage::ParseCdnChunk(std::shared_ptr<Chunk> Chunk, const std::string& Body)
+{
+    size_t decompressedSize = 1024 * 1024;
+
+    if (Body.size() < sizeof(CDN_CHUNK_HEADER)) {
+        LOG_ERROR("Downloaded chunk (%s) is too small: %zu bytes", Chunk->GetGuid().c_str(), Body.size());
+        return nullptr;
+    }
+    auto headerv1 = *(CDN_CHUNK_HEADER*)Body.data();
+    auto chunkPos = sizeof(CDN_CHUNK_HEADER);
+    if (headerv1.Magic != CHUNK_HEADER_MAGIC) {
+        LOG_ERROR("Downloaded chunk (%s) magic invalid: %08X", Chunk->GetGuid().c_str(), headerv1.Magic);
+        return nullptr;
+    }
+    if (headerv1.Version >= 2) {
+        if (Body.size() < chunkPos + sizeof(CDN_CHUNK_HEADER_V2) + (headerv1.Version >= 3 ? sizeof(CDN_CHUNK_HEADER_V3) : 0)) {
+            LOG_ERROR("Downloaded chunk (%s) is too small for a v%u header: %zu bytes", Chunk->GetGuid().c_str(), headerv1.Version, Body.size());
+            return nullptr;
         }
+        auto headerv2 = *(CDN_CHUNK_HEADER_V2*)(Body.data() + chunkPos);
+        chunkPos += sizeof(CDN_CHUNK_HEADER_V2);
+        if (headerv1.Version >= 3) {
+            auto headerv3 = *(CDN_CHUNK_HEADER_V3*)(Body.data() + chunkPos);
+            decompressedSize = headerv3.DataSizeUncompressed;
 
-        auto bufferPtr = chunkData.data() + chunkPos;
+            if (headerv1.Version > 3) { // version past 3
+                chunkPos = headerv1.HeaderSize;
+            }
+        }
+    }
 
-        data = std::shared_ptr<char[]>(new char[decompressedSize]);
+    if (headerv1.StoredAs & 0x02) // encrypted
+    {
+        LOG_ERROR("Downloaded chunk (%s) is encrypted", Chunk->GetGuid().c_str());
+        //return; // no support yet, i have never seen this used in practice
+    }
 
-        SAFE_FLAG_RETURN(std::make_pair(nullptr, 0));
-        if (headerv1.StoredAs & 0x01) // compressed
-        {
-            auto decompressor = libdeflate_alloc_decompressor(); // TODO: use ctxmanager for this
-            auto result = libdeflate_zlib_decompress(decompressor, bufferPtr, headerv1.DataSizeCompressed, data.get(), decompressedSize, NULL);
-            libdeflate_free_decompressor(decompressor);
-        }
-        else {
-            memcpy(data.get(), bufferPtr, decompressedSize);
+    // the sizes come from the server, a truncated or bad body shouldn't be read past
+    if (!(headerv1.StoredAs & 0x01) && headerv1.Version < 3 && chunkPos <= Body.size()) {
+        decompressedSize = (std::min)(decompressedSize, Body.size() - chunkPos); // no size in the header, it's the rest of the body
+    }
+    auto storedSize = headerv1.StoredAs & 0x01 ? (size_t)headerv1.DataSizeCompressed : decompressedSize;
+    if (chunkPos > Body.size() || storedSize > Body.size() - chunkPos) {
+        LOG_ERROR("Downloaded chunk (%s) is truncated: %zu bytes, the data needs %zu from %zu", Chunk->GetGuid().c_str(), Body.size(), storedSize, chunkPos);
+        return nullptr;
+    }
+
+    auto bufferPtr = Body.data() + chunkPos;
+
+    auto data = std::shared_ptr<char[]>(new char[decompressedSize]);
+
+    if (headerv1.StoredAs & 0x01) // compressed
+    {
+        auto decompressor = Compressor::GetZlibDecompressor();
+        auto result = libdeflate_zlib_decompress(decompressor, bufferPtr, headerv1.DataSizeCompressed, data.get(), decompressedSize, NULL);
+        if (result == LIBDEFLATE_BAD_DATA) { // a short output is fine, pre v3 headers don't have the size so it's just the biggest it can be
+            LOG_ERROR("Downloaded chunk (%s) couldn't be decompressed: %d", Chunk->GetGuid().c_str(), result);
+            return nullptr;
         }
     }
-    SAFE_FLAG_RETURN(std::make_pair(data, Chunk->WindowSize));
-    WriteChunk(CachePath / Chunk->GetFilePath(), Chunk->WindowSize, Compressor.StorageCompress(data, Chunk->WindowSize));
-    return std::make_pair(data, Chunk->WindowSize);
+    else {
+        memcpy(data.get(), bufferPtr, decompressedSize);
+    }
+    return data;
 }
 
-bool Storage::GetChunkMetadata(std::shared_ptr<Chunk> Chunk, uint16_t& flags, size_t& fileSize)
+bool Storage::GetChunkMetadata(std::shared_ptr<Chunk> Chunk, uint16_t& flags, size_t& fileSize, bool& linked)
 {
+    CHUNK_JOURNAL_RECORD record;
+    if (Journal.Get(Chunk->Guid, record)) {
+        flags = record.Flags;
+        fileSize = record.StoredSize;
+        linked = ChunkJournal::IsLink(record);
+        return true;
+    }
+
+    linked = false;
+    PACK_INDEX_ENTRY entry;
+    if (Packs && Packs->GetEntry(Chunk->Guid, entry)) {
+        flags = entry.Flags;
+        fileSize = entry.Size;
+        return true;
+    }
+
     auto fp = fopen((CachePath / Chunk->GetFilePath()).string().c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
     CHUNK_HEADER header;
-    fread(&header, sizeof(CHUNK_HEADER), 1, fp);
-    if (header.version != 0) {
+    auto headerRead = fread(&header, sizeof(CHUNK_HEADER), 1, fp) == 1;
+    fclose(fp);
+    if (!headerRead || header.version > CHUNK_VERSION_BLOCKS) {
         LOG_ERROR("Bad chunk version for %s: %hu", Chunk->GetGuid().c_str(), header.version);
         return false;
     }
-    fclose(fp);
     flags = header.flags;
     fileSize = fs::file_size(CachePath / Chunk->GetFilePath());
     return true;
 }
 
-bool Storage::ReadChunk(fs::path Path, Compressor::buffer_value& ReadBuffer, cancel_flag& flag)
+inline bool ReadFileData(const fs::path& Path, std::shared_ptr<char[]>& Data, uint32_t& Size)
 {
+    std::error_code ec;
+    auto fileSize = fs::file_size(Path, ec);
+    if (ec) {
+        return false;
+    }
     auto fp = fopen(Path.string().c_str(), "rb");
-    CHUNK_HEADER header;
-    fread(&header, sizeof(CHUNK_HEADER), 1, fp);
-    if (header.version != 0) {
-        LOG_ERROR("Bad chunk version for %s: %hu", Path.string().c_str(), header.version);
+    if (!fp) {
+        return false;
+    }
+    Data = std::shared_ptr<char[]>(new char[fileSize]);
+    auto readSize = fread(Data.get(), 1, fileSize, fp);
+    fclose(fp);
+    Size = fileSize;
+    return readSize == fileSize;
+}
+
+bool Storage::ReadChunk(std::shared_ptr<Chunk> Chunk, Compressor::buffer_value& ReadBuffer, cancel_flag& flag)
+{
+    // this goes through every chunk when verifying or recompressing, so the stored bytes aren't copied into a new buffer each time:
+    // loose files are mapped, and packed chunks are read into a buffer that the thread keeps reusing
+    static thread_local std::vector<char> packBuffer;
+
+    auto stored = GetStoredChunk(Chunk);
+    MappedFile file;
+    std::shared_ptr<char[]> fileData;
+    const char* data;
+    uint32_t dataSize;
+    if (Packs && Packs->Read(stored->Guid, packBuffer, dataSize)) {
+        data = packBuffer.data();
+    }
+    else if (file.Open(CachePath / stored->GetFilePath())) {
+        data = file.GetData();
+        dataSize = file.GetSize();
+    }
+    else if (ReadFileData(CachePath / stored->GetFilePath(), fileData, dataSize)) { // mapping can fail where a plain read doesn't, like while the file's being replaced
+        data = fileData.get();
+    }
+    else if (Packs && Packs->Read(stored->Guid, packBuffer, dataSize)) { // it could have been migrated into a pack while we were opening it
+        data = packBuffer.data();
+    }
+    else {
         return false;
     }
+    Stats::FileReadCount.fetch_add(dataSize, std::memory_order_relaxed);
+
     if (flag.cancelled()) {
-        fclose(fp);
         return false;
     }
-    switch (header.flags & ChunkFlagCompMask)
-    {
-    case ChunkFlagDecompressed:
-    {
-        auto pos = ftell(fp);
-        fseek(fp, 0, SEEK_END);
-        auto inBufSize = ftell(fp) - pos;
-        fseek(fp, pos, SEEK_SET);
+    return DecodeChunk(Chunk, data, dataSize, ReadBuffer);
+}
 
-        auto buffer = std::shared_ptr<char[]>(new char[inBufSize]);
-        fread(buffer.get(), 1, inBufSize, fp);
-        fclose(fp);
+std::shared_ptr<Chunk> Storage::GetStoredChunk(std::shared_ptr<Chunk> Chunk)
+{
+    // deduplicated chunks are read from the chunk they're linked to
+    CHUNK_JOURNAL_RECORD record;
+    if (Journal.Get(Chunk->Guid, record) && ChunkJournal::IsLink(record)) {
+        // it has the same data, so the size and hash carry over and it can be written with them (the url doesn't though)
+        Chunk = std::make_shared<struct Chunk>(*Chunk);
+        memcpy(Chunk->Guid, record.LinkGuid, 16);
+    }
+    return Chunk;
+}
 
-        ReadBuffer = std::make_pair(buffer, inBufSize);
-        Stats::FileReadCount.fetch_add(inBufSize, std::memory_order_relaxed);
-        return true;
+void Storage::TouchChunk(std::shared_ptr<Chunk> Chunk)
+{
+    auto index = ChunkIndices.find(Chunk->Guid);
+    if (index != ChunkIndices.end()) {
+        Accesses.Touch(index->second);
     }
-    case ChunkFlagZstd:
-    {
-        size_t inBufSize;
-        ReadBuffer = Compressor.ZstdDecompress(fp, inBufSize);
-        fclose(fp);
-        Stats::FileReadCount.fetch_add(inBufSize, std::memory_order_relaxed);
-        return true;
+    else {
+        Accesses.Touch(Chunk->Guid);
     }
-    case ChunkFlagZlib:
-    {
-        size_t inBufSize;
-        ReadBuffer = Compressor.ZlibDecompress(fp, inBufSize);
-        fclose(fp);
-        Stats::FileReadCount.fetch_add(inBufSize, std::memory_order_relaxed);
+}
+
+bool Storage::ReadStoredChunk(std::shared_ptr<Chunk> Chunk, std::shared_ptr<char[]>& Data, uint32_t& Size)
+{
+    Chunk = GetStoredChunk(Chunk);
+    if ((Packs && Packs->Read(Chunk->Guid, Data, Size)) ||
+        ReadFileData(CachePath / Chunk->GetFilePath(), Data, Size) ||
+        (Packs && Packs->Read(Chunk->Guid, Data, Size))) { // it could have been migrated into a pack while we were opening it
+        Stats::FileReadCount.fetch_add(Size, std::memory_order_relaxed);
         return true;
     }
-    case ChunkFlagLZ4:
-    {
-        size_t inBufSize;
-        ReadBuffer = Compressor.LZ4Decompress(fp, inBufSize);
-        fclose(fp);
-        Stats::FileReadCount.fetch_add(inBufSize, std::memory_order_relaxed);
+    return false;
+}
+
+bool Storage::DecodeChunk(std::shared_ptr<Chunk> Chunk, const char* Data, uint32_t Size, Compressor::buffer_value& ReadBuffer, const std::shared_ptr<char[]>& Owner)
+{
+    auto header = (const CHUNK_HEADER*)Data;
+    if (Size < sizeof(CHUNK_HEADER) || header->version > CHUNK_VERSION_BLOCKS) {
+        LOG_ERROR("Bad chunk version for %s", Chunk->GetGuid().c_str());
+        return false;
+    }
+
+    if (header->version == CHUNK_VERSION_BLOCKS) {
+        auto blockHeader = GetBlockHeader(Data, Size);
+        if (!blockHeader) {
+            LOG_ERROR("Bad block table for %s", Chunk->GetGuid().c_str());
+            return false;
+        }
+        auto buffer = std::shared_ptr<char[]>(new char[blockHeader->DecompressedSize]);
+        if (!DecodeBlocks(Data, Size, 0, blockHeader->BlockCount, buffer.get())) {
+            LOG_ERROR("Could not decompress %s", Chunk->GetGuid().c_str());
+            return false;
+        }
+        ReadBuffer = std::make_pair(buffer, blockHeader->DecompressedSize);
         return true;
     }
-    case ChunkFlagOodle:
+
+    auto payload = Data + sizeof(CHUNK_HEADER);
+    auto payloadSize = Size - sizeof(CHUNK_HEADER);
+    switch (header->flags & ChunkFlagCompMask)
     {
-        size_t inBufSize;
-        ReadBuffer = Compressor.OodleDecompress(fp, inBufSize);
-        fclose(fp);
-        Stats::FileReadCount.fetch_add(inBufSize, std::memory_order_relaxed);
+    case ChunkFlagDecompressed:
+        if (Owner) {
+            // no need to copy it anywhere, just point past the header
+            ReadBuffer = std::make_pair(std::shared_ptr<char[]>(Owner, (char*)payload), payloadSize);
+        }
+        else {
+            auto buffer = std::shared_ptr<char[]>(new char[payloadSize]);
+            memcpy(buffer.get(), payload, payloadSize);
+            ReadBuffer = std::make_pair(buffer, payloadSize);
+        }
         return true;
-    }
+    case ChunkFlagZstd:
+        ReadBuffer = Compressor.ZstdDecompress(payload, payloadSize);
+        break;
+    case ChunkFlagZlib:
+        ReadBuffer = Compressor.ZlibDecompress(payload, payloadSize);
+        break;
+    case ChunkFlagLZ4:
+        ReadBuffer = Compressor.LZ4Decompress(payload, payloadSize);
+        break;
+    case ChunkFlagOodle:
+        ReadBuffer = Compressor.OodleDecompress(payload, payloadSize);
+        break;
     default:
-    {
-        fclose(fp);
-        LOG_ERROR("Unknown read flag for %s: %hu", Path.string().c_str(), header.flags);
+        LOG_ERROR("Unknown read flag for %s: %hu", Chunk->GetGuid().c_str(), header->flags);
         return false;
     }
+    if (!ReadBuffer.first) {
+        LOG_ERROR("Could not decompress %s", Chunk->GetGuid().c_str());
+        return false;
     }
+    return true;
 }
 
-void Storage::WriteChunk(fs::path Path, uint32_t DecompressedSize, Compressor::buffer_value& Buffer)
+bool Storage::DecodeBlocks(const char* Data, uint32_t Size, uint32_t FirstBlock, uint32_t EndBlock, char* Out)
+{
+    auto flags = ((const CHUNK_HEADER*)Data)->flags;
+    auto blockHeader = (const CHUNK_BLOCK_HEADER*)(Data + sizeof(CHUNK_HEADER));
+    auto dictId = flags & ChunkFlagDictionary ? *(const uint32_t*)(blockHeader + 1) : 0;
+    auto blockEnds = (const uint32_t*)(Data + GetBlockTableOffset(flags));
+    auto blocks = (const char*)(blockEnds + blockHeader->BlockCount);
+
+    for (auto i = FirstBlock; i < EndBlock; ++i) {
+        auto blockStart = i ? blockEnds[i - 1] : 0;
+        if (blockEnds[i] < blockStart) {
+            return false;
+        }
+        auto blockSize = std::min(blockHeader->BlockSize, blockHeader->DecompressedSize - i * blockHeader->BlockSize);
+        if (!Compressor.DecompressInto(flags, blocks + blockStart, blockEnds[i] - blockStart, Out, blockSize, dictId)) {
+            return false;
+        }
+        Out += blockSize;
+    }
+    return true;
+}
+
+bool Storage::DecodePart(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, uint32_t Size, uint32_t Offset, uint32_t PartSize, std::shared_ptr<char[]>& PartData, uint32_t& PartOffset)
+{
+    if (Size < sizeof(CHUNK_HEADER) || ((CHUNK_HEADER*)Data.get())->version != CHUNK_VERSION_BLOCKS) {
+        return false;
+    }
+    auto blockHeader = GetBlockHeader(Data.get(), Size);
+    if (!blockHeader || !PartSize || Offset + PartSize > blockHeader->DecompressedSize) {
+        return false;
+    }
+
+    auto firstBlock = Offset / blockHeader->BlockSize;
+    auto endBlock = (Offset + PartSize - 1) / blockHeader->BlockSize + 1;
+    auto decodeStart = firstBlock * blockHeader->BlockSize;
+    auto decodeSize = std::min(endBlock * blockHeader->BlockSize, blockHeader->DecompressedSize) - decodeStart;
+
+    auto buffer = std::shared_ptr<char[]>(new char[decodeSize]);
+    if (!DecodeBlocks(Data.get(), Size, firstBlock, endBlock, buffer.get())) {
+        LOG_ERROR("Could not decompress part of %s", Chunk->GetGuid().c_str());
+        return false;
+    }
+    PartData = buffer;
+    PartOffset = Offset - decodeStart;
+    return true;
+}
+
+uint16_t Storage::GetStorageChunkFlags()
 {
-    LOG_DEBUG("OPENING CHUNK FILE");
-    auto fp = fopen(Path.string().c_str(), "wb");
-    LOG_DEBUG("CREATING CHUNK HEADER");
-    CHUNK_HEADER chunkHeader;
-    chunkHeader.version = 0;
     switch (Flags & StorageCompMethodMask)
     {
     case StorageDecompressed:
-        chunkHeader.flags = ChunkFlagDecompressed;
-        break;
+        return ChunkFlagDecompressed;
     case StorageZstd:
-        chunkHeader.flags = ChunkFlagZstd;
-        break;
+        return ChunkFlagZstd | (Flags & StorageCompLevelMask);
     case StorageLZ4:
-        chunkHeader.flags = ChunkFlagLZ4;
-        break;
+        return ChunkFlagLZ4 | (Flags & StorageCompLevelMask);
     case StorageSelkie:
-        chunkHeader.flags = ChunkFlagOodle;
-        break;
+        return ChunkFlagOodle | (Flags & StorageCompLevelMask);
+    default:
+        return 0;
     }
-    LOG_DEBUG("WRITING CHUNK HEADER");
-    fwrite(&chunkHeader, sizeof(CHUNK_HEADER), 1, fp);
-    if ((Flags & StorageCompMethodMask) != StorageDecompressed) { // Compressed chunks write the decompressed size
-        LOG_DEBUG("WRITING DECOMPRESSED SIZE");
-        fwrite(&DecompressedSize, sizeof(uint32_t), 1, fp);
+}
+
+bool Storage::IsChunkCold(std::shared_ptr<Chunk> Chunk)
+{
+    if (!ArchiveAfterDays) {
+        return false;
     }
-    LOG_DEBUG("WRITING CHUNK DATA");
-    fwrite(Buffer.first.get(), 1, Buffer.second, fp);
+    auto index = ChunkIndices.find(Chunk->Guid);
+    return index != ChunkIndices.end() && Accesses.GetIdleDays(index->second) >= ArchiveAfterDays;
+}
+
+bool Storage::WriteChunk(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, bool Archive, bool Throttle)
+{
+    LOG_DEBUG("CREATING CHUNK HEADER");
+    CHUNK_HEADER chunkHeader;
+    chunkHeader.version = 0;
+    // the level is kept so the chunk can be recompressed if it changes
+    chunkHeader.flags = Archive ? ChunkFlagLZMA : GetChunkFlags(Data.get(), Chunk->WindowSize);
+    auto isCompressed = (chunkHeader.flags & ChunkFlagCompMask) != ChunkFlagDecompressed;
+    // LZ4 might have been picked for this chunk instead of the storage method
+    auto useFastCompress = (chunkHeader.flags & ChunkFlagCompMask) == ChunkFlagLZ4 && (Flags & StorageCompMethodMask) != StorageLZ4;
+    // read once, the dictionary could be trained by another writer halfway through this chunk
+    auto dictId = (chunkHeader.flags & ChunkFlagCompMask) == ChunkFlagZstd ? Compressor.GetDictionaryId() : 0;
+    if (dictId) {
+        chunkHeader.flags |= ChunkFlagDictionary;
+    }
+    uint32_t decompressedSize = Chunk->WindowSize;
+
+    LOG_DEBUG("CREATING CHUNK RECORD");
+    std::shared_ptr<char[]> record;
+    uint32_t recordSize;
+    if (isCompressed) {
+        // compressed chunks are split into blocks so a part can be read without decompressing all of it
+        // archived ones aren't, LZMA does a lot better with the whole chunk and they're rarely read anyway
+        CHUNK_BLOCK_HEADER blockHeader;
+        blockHeader.DecompressedSize = decompressedSize;
+        blockHeader.BlockSize = Archive ? std::max(decompressedSize, 1u) : CHUNK_BLOCK_SIZE;
+        blockHeader.BlockCount = (decompressedSize + blockHeader.BlockSize - 1) / blockHeader.BlockSize;
+        chunkHeader.version = CHUNK_VERSION_BLOCKS;
+
+        std::vector<Compressor::buffer_value> blocks;
+        blocks.reserve(blockHeader.BlockCount);
+        std::vector<uint32_t> blockEnds;
+        blockEnds.reserve(blockHeader.BlockCount);
+        uint32_t blocksSize = 0;
+        for (uint32_t i = 0; i < blockHeader.BlockCount; ++i) {
+            auto blockStart = i * blockHeader.BlockSize;
+            auto blockSize = std::min<uint32_t>(blockHeader.BlockSize, decompressedSize - blockStart);
+            if (Archive) {
+                blocks.emplace_back(Compressor.ArchiveCompress(Data.get() + blockStart, blockSize));
+                if (!blocks.back().first) {
+                    LOG_ERROR("Could not archive %s", Chunk->GetGuid().c_str());
+                    return false;
+                }
+            }
+            else if (useFastCompress) {
+                blocks.emplace_back(Compressor.FastCompress(Data.get() + blockStart, blockSize));
+            }
+            else if (dictId) {
+                blocks.emplace_back(Compressor.DictCompress(dictId, Data.get() + blockStart, blockSize));
+                if (!blocks.back().first) {
+                    LOG_ERROR("Could not compress %s with dictionary %08X", Chunk->GetGuid().c_str(), dictId);
+                    return false;
+                }
+            }
+            else {
+                blocks.emplace_back(Compressor.StorageCompress(Data.get() + blockStart, blockSize));
+            }
+            blocksSize += blocks.back().second;
+            blockEnds.emplace_back(blocksSize);
+        }
+
+        recordSize = GetBlockTableOffset(chunkHeader.flags) + blockHeader.BlockCount * sizeof(uint32_t) + blocksSize;
+        record = std::shared_ptr<char[]>(new char[recordSize]);
+        auto recordPos = record.get();
+        memcpy(recordPos, &chunkHeader, sizeof(CHUNK_HEADER));
+        recordPos += sizeof(CHUNK_HEADER);
+        memcpy(recordPos, &blockHeader, sizeof(CHUNK_BLOCK_HEADER));
+        recordPos += sizeof(CHUNK_BLOCK_HEADER);
+        if (dictId) {
+            memcpy(recordPos, &dictId, sizeof(uint32_t));
+            recordPos += sizeof(uint32_t);
+        }
+        memcpy(recordPos, blockEnds.data(), blockEnds.size() * sizeof(uint32_t));
+        recordPos += blockEnds.size() * sizeof(uint32_t);
+        for (auto& block : blocks) {
+            memcpy(recordPos, block.first.get(), block.second);
+            recordPos += block.second;
+        }
+    }
+    else {
+        recordSize = sizeof(CHUNK_HEADER) + decompressedSize;
+        record = std::shared_ptr<char[]>(new char[recordSize]);
+        memcpy(record.get(), &chunkHeader, sizeof(CHUNK_HEADER));
+        memcpy(record.get() + sizeof(CHUNK_HEADER), Data.get(), decompressedSize);
+    }
+
+    if (Throttle) {
+        // charged after compressing, it's the disk that's being spared
+        WriteLimiter.consume(recordSize);
+    }
+
+    if (Packs && (Flags & StoragePackFiles)) {
+        LOG_DEBUG("WRITING PACKED CHUNK");
+        if (!Packs->Write(Chunk->Guid, chunkHeader.flags, record.get(), recordSize)) {
+            LOG_ERROR("Could not pack chunk %s", Chunk->GetGuid().c_str());
+            return false;
+        }
+    }
+    else {
+        if (!WriteChunkFile(Chunk, record.get(), recordSize)) {
+            return false;
+        }
+    }
+    // the journal only gets the chunk once it's fully written, a crash before then just loses it
+    Journal.Set(Chunk->Guid, chunkHeader.flags, recordSize, Chunk->ShaHash);
+    SetChunkPresence(Chunk, true);
+    // the old record can't stay cached, and the new one is only cached once it's read from disk
+    // caching every write would have preloading push out the chunks that actually get read
+    CompressedChunks.Remove(Chunk->Guid);
+    Dictionaries.AddSample(Data.get(), decompressedSize);
+
+    Stats::FileWriteCount.fetch_add(recordSize - sizeof(CHUNK_HEADER), std::memory_order_relaxed);
+    return true;
+}
+
+bool Storage::WriteChunkFile(std::shared_ptr<Chunk> Chunk, const char* Data, uint32_t Size)
+{
+    // written next to it and renamed over it, so a read or verify never sees a half written chunk
+    auto chunkPath = CachePath / Chunk->GetFilePath();
+    auto tempPath = fs::path(chunkPath).replace_extension(".tmp");
+    LOG_DEBUG("OPENING CHUNK FILE");
+    auto fp = fopen(tempPath.string().c_str(), "wb");
+    if (!fp) {
+        LOG_ERROR("Could not open chunk file for %s", Chunk->GetGuid().c_str());
+        return false;
+    }
+    LOG_DEBUG("WRITING CHUNK RECORD");
+    auto written = fwrite(Data, 1, Size, fp) == Size;
     LOG_DEBUG("CLOSING CHUNK FILE");
-    fclose(fp);
+    written &= !fclose(fp);
+
+    std::error_code ec;
+    if (written) {
+        for (int i = 0; i < RENAME_TRIES; ++i) {
+            fs::rename(tempPath, chunkPath, ec);
+            if (!ec) {
+                break;
+            }
+            std::this_thread::sleep_for(RENAME_RETRY_DELAY);
+        }
+    }
+    if (!written || ec) {
+        // the old file (if there is one) is untouched, so the journal still matches it
+        LOG_ERROR("Could not write chunk file for %s", Chunk->GetGuid().c_str());
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    // the layout was switched back to loose files, readers check the packs first so an old packed copy would shadow this one
+    if (Packs) {
+        Packs->Remove(Chunk->Guid);
+    }
+    return true;
+}
+
+uint32_t Storage::GetMissingChunkCount()
+{
+    return ChunkPresence.size() - ChunkPresence.count();
+}
+
+void Storage::MigrateLooseChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkOrder, cancel_flag& flag)
+{
+    if (Packs && !(Flags & StoragePackFiles)) {
+        MigratePackedChunks(ChunkOrder, flag);
+        return;
+    }
+    if (!Packs || !LooseChunkCount) {
+        return;
+    }
+
+    LOG_DEBUG("migrating %zu loose chunks", LooseChunkCount);
+    std::error_code ec;
+    for (auto& chunk : ChunkOrder) {
+        if (flag.cancelled()) {
+            return;
+        }
+
+        // while the handle is held and it's Reading, a read that finds the chunk bad can't delete it (and redownload it) underneath us
+        // anything else is being downloaded or read, it's picked up on the next migration
+        auto data = GetPoolData(chunk);
+        auto status = data->Status.load();
+        if (status != CHUNK_STATUS::Available || !data->Status.compare_exchange_strong(status, CHUNK_STATUS::Reading)) {
+            continue;
+        }
+
+        auto chunkPath = CachePath / chunk->GetFilePath();
+        if (!Packs->Contains(chunk->Guid)) {
+            // it could have been deleted since the scan, or have a newer copy waiting to be written (that goes to a pack already)
+            if (!IsChunkDownloaded(chunk) || Writer.GetPending(chunk->Guid)) {
+                data->SetStatus(CHUNK_STATUS::Available);
+                continue;
+            }
+            // the stored bytes are the same in a pack, so it doesn't need to be recompressed
+            // the file is unmapped at the end of this scope, it can't be removed before that
+            MappedFile file;
+            if (!file.Open(chunkPath) || file.GetSize() < sizeof(CHUNK_HEADER) || ((const CHUNK_HEADER*)file.GetData())->version > CHUNK_VERSION_BLOCKS) {
+                data->SetStatus(CHUNK_STATUS::Available);
+                continue;
+            }
+            if (!Packs->Write(chunk->Guid, ((const CHUNK_HEADER*)file.GetData())->flags, file.GetData(), file.GetSize())) {
+                LOG_ERROR("Could not migrate chunk %s", chunk->GetGuid().c_str());
+                data->SetStatus(CHUNK_STATUS::Available);
+                return;
+            }
+            Stats::FileReadCount.fetch_add(file.GetSize(), std::memory_order_relaxed);
+            Stats::FileWriteCount.fetch_add(file.GetSize(), std::memory_order_relaxed);
+        }
+        // readers check the pack first, so the loose copy can go now
+        if (fs::remove(chunkPath, ec)) {
+            LooseChunkCount--;
+        }
+        data->SetStatus(CHUNK_STATUS::Available);
+    }
+    LOG_DEBUG("migrated, %zu loose chunks left", LooseChunkCount);
+}
+
+void Storage::MigratePackedChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkOrder, cancel_flag& flag)
+{
+    auto packedCount = Packs->GetGuids().size();
+    if (!packedCount) {
+        return;
+    }
+
+    LOG_DEBUG("unpacking %zu chunks", packedCount);
+    std::vector<char> buffer;
+    uint32_t size;
+    for (auto& chunk : ChunkOrder) {
+        if (flag.cancelled()) {
+            return;
+        }
+        if (!Packs->Contains(chunk->Guid)) {
+            continue;
+        }
+
+        // held the same way as when migrating into the packs
+        auto data = GetPoolData(chunk);
+        auto status = data->Status.load();
+        if (status != CHUNK_STATUS::Available || !data->Status.compare_exchange_strong(status, CHUNK_STATUS::Reading)) {
+            continue;
+        }
+        // a newer copy waiting to be written goes to a loose file already
+        if (IsChunkDownloaded(chunk) && !Writer.GetPending(chunk->Guid) && Packs->Read(chunk->Guid, buffer, size)) {
+            // the stored bytes are the same as a loose file, and writing it drops the pack record
+            if (!WriteChunkFile(chunk, buffer.data(), size)) {
+                data->SetStatus(CHUNK_STATUS::Available);
+                return;
+            }
+            Stats::FileReadCount.fetch_add(size, std::memory_order_relaxed);
+            Stats::FileWriteCount.fetch_add(size, std::memory_order_relaxed);
+        }
+        data->SetStatus(CHUNK_STATUS::Available);
+    }
+    LOG_DEBUG("unpacked, %zu chunks left in packs", Packs->GetGuids().size());
+}
+
+void Storage::PurgeUnusedChunks(cancel_flag& flag)
+{
+    auto records = Journal.GetRecords();
+
+    // unused chunks still have to be kept if a used one is linked to them
+    std::unordered_set<guid_key, guid_hash> linkTargets;
+    for (auto& record : records) {
+        if (ChunkJournal::IsLink(record) && Builds.GetRefCount(record.Guid)) {
+            linkTargets.emplace(record.LinkGuid);
+        }
+    }
+
+    std::error_code ec;
+    Chunk unusedChunk;
+    for (auto& record : records) {
+        if (flag.cancelled()) {
+            return;
+        }
+        if (!Builds.GetRefCount(record.Guid) && !linkTargets.count(record.Guid)) {
+            if (ChunkJournal::IsLink(record)) {
+                Journal.Remove(record.Guid);
+                continue;
+            }
+            memcpy(unusedChunk.Guid, record.Guid, 16);
+            if (Packs) {
+                Packs->Remove(record.Guid);
+            }
+            Journal.Remove(record.Guid);
+            CompressedChunks.Remove(record.Guid);
+            Accesses.Remove(record.Guid);
+            fs::remove(CachePath / unusedChunk.GetFilePath(), ec);
+        }
+    }
+
+    if (!Packs) {
+        return;
+    }
+
+    // in case the journal was lost after they were packed
+    char guid[16];
+    for (auto& key : Packs->GetGuids()) {
+        if (flag.cancelled()) {
+            return;
+        }
+        memcpy(guid, &key.lo, 8);
+        memcpy(guid + 8, &key.hi, 8);
+        if (!Builds.GetRefCount(guid) && !linkTargets.count(key)) {
+            Packs->Remove(guid);
+        }
+    }
+}
+
+void Storage::ScanChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkList)
+{
+    if (!Journal.IsLoaded()) {
+        RebuildJournal(ChunkList);
+    }
+
+    for (auto& record : Journal.GetRecords()) {
+        auto index = ChunkIndices.find(record.Guid);
+        if (index != ChunkIndices.end()) {
+            ChunkPresence.set(index->second);
+        }
+        if (!ChunkJournal::IsLink(record) && (!Packs || !Packs->Contains(record.Guid))) {
+            LooseChunkCount++;
+        }
+    }
+    LOG_DEBUG("found %zu chunks (%zu loose)", ChunkPresence.count(), LooseChunkCount);
+}
 
-    Stats::FileWriteCount.fetch_add(Buffer.second, std::memory_order_relaxed);
+const char* Storage::GetShaHash(const std::vector<std::shared_ptr<Chunk>>& ChunkList, const guid_key& Guid)
+{
+    auto index = ChunkIndices.find(Guid);
+    return index == ChunkIndices.end() ? nullptr : ChunkList[index->second]->ShaHash;
 }
+
+void Storage::RebuildJournal(const std::vector<std::shared_ptr<Chunk>>& ChunkList)
+{
+    LOG_DEBUG("no chunk journal, scanning the cache");
+    std::error_code ec;
+    char cachePartFolder[3];
+    guid_key guid;
+    char guidBytes[16];
+    CHUNK_HEADER header;
+    for (int i = 0; i < 256; ++i) {
+        sprintf(cachePartFolder, "%02X", i);
+        for (auto& p : fs::directory_iterator(CachePath / cachePartFolder, ec)) {
+            auto filename = p.path().filename().string();
+            if (filename.size() != 32 || !guid_key::parse(filename.c_str(), guid) || !p.is_regular_file(ec)) {
+                continue;
+            }
+            // unused chunks get added too, so they can be purged without another scan
+            auto fp = fopen(p.path().string().c_str(), "rb");
+            if (!fp) {
+                continue;
+            }
+            auto headerRead = fread(&header, sizeof(CHUNK_HEADER), 1, fp) == 1;
+            fclose(fp);
+            auto fileSize = p.file_size(ec);
+            if (!headerRead || ec || header.version > CHUNK_VERSION_BLOCKS) {
+                continue;
+            }
+            memcpy(guidBytes, &guid.lo, 8);
+            memcpy(guidBytes + 8, &guid.hi, 8);
+            Journal.Set(guidBytes, header.flags, fileSize, GetShaHash(ChunkList, guid));
+        }
+    }
+    if (Packs) {
+        PACK_INDEX_ENTRY entry;
+        for (auto& key : Packs->GetGuids()) {
+            memcpy(guidBytes, &key.lo, 8);
+            memcpy(guidBytes + 8, &key.hi, 8);
+            if (Packs->GetEntry(guidBytes, entry)) {
+                Journal.Set(guidBytes, entry.Flags, entry.Size, GetShaHash(ChunkList, key));
+            }
+        }
+    }
+}
+
+void Storage::LinkDuplicateChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkList)
+{
+    // new builds reissue a lot of the same data under new guids, those can point at what's already stored
+    std::unordered_map<std::string, guid_key> storedHashes;
+    for (auto& record : Journal.GetRecords()) {
+        if (!ChunkJournal::IsLink(record) && ChunkJournal::HasShaHash(record)) {
+            storedHashes.emplace(std::string(record.ShaHash, 20), record.Guid);
+        }
+    }
+    if (storedHashes.empty()) {
+        return;
+    }
+
+    size_t linkCount = 0;
+    char targetGuid[16];
+    for (auto& chunk : ChunkList) {
+        auto index = ChunkIndices.find(chunk->Guid);
+        if (index == ChunkIndices.end() || ChunkPresence.test(index->second)) {
+            continue;
+        }
+        auto target = storedHashes.find(std::string(chunk->ShaHash, 20));
+        if (target == storedHashes.end()) {
+            continue;
+        }
+        memcpy(targetGuid, &target->second.lo, 8);
+        memcpy(targetGuid + 8, &target->second.hi, 8);
+        if (Journal.Link(chunk->Guid, targetGuid)) {
+            ChunkPresence.set(index->second);
+            linkCount++;
+        }
+    }
+    LOG_DEBUG("linked %zu chunks to stored duplicates", linkCount);
+}
+
+void Storage::SetChunkPresence(std::shared_ptr<Chunk> Chunk, bool Present)
+{
+    auto index = ChunkIndices.find(Chunk->Guid);
+    if (index == ChunkIndices.end()) {
+        return;
+    }
+    if (Present) {
+        ChunkPresence.set(index->second);
+    }
+    else {
+        ChunkPresence.reset(index->second);
+    }
+}
+
+bool Storage::IsChunkVerified(std::shared_ptr<Chunk> Chunk)
+{
+    auto index = ChunkIndices.find(Chunk->Guid);
+    return index != ChunkIndices.end() && ChunkVerified.test(index->second);
+}
+
+void Storage::SetChunkVerified(std::shared_ptr<Chunk> Chunk, bool Verified)
+{
+    auto index = ChunkIndices.find(Chunk->Guid);
+    if (index == ChunkIndices.end()) {
+        return;
+    }
+    if (Verified) {
+        if (!ChunkVerified.test(index->second)) {
+            Journal.SetVerified(Chunk->Guid, std::time(nullptr));
+        }
+        ChunkVerified.set(index->second);
+    }
+    else {
+        ChunkVerified.reset(index->second);
+    }
+}
\ No newline at end of file
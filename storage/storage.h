@@ -1,92 +1,184 @@
 #pragma once
 
+#include "../containers/atomic_bitset.h"
 #include "../containers/cancel_flag.h"
+#include "../containers/token_bucket.h"
 #include "../web/http.h"
 #include "../web/manifest/manifest.h"
+#include "access.h"
+#include "builds.h"
+#include "cache.h"
 #include "compression.h"
+#include "dictionary.h"
+#include "flags.h"
+#include "journal.h"
+#include "mapped.h"
+#include "pack.h"
+#include "pool.h"
+#include "scheduler.h"
+#include "writer.h"
 
 #include <atomic>
 #include <condition_variable>
-#include <deque>
 #include <mutex>
 #include <functional>
 #include <filesystem>
+#include <thread>
+#include <unordered_map>
 namespace fs = std::filesystem;
 
-enum
-{
-    StorageDecompressed         = 0x00000001, // Chunks saved as raw blocks
-    StorageZstd                 = 0x00000002, // Chunks are recompressed with Zlib
-    StorageLZ4                  = 0x00000003, // Chunks are recompressed with LZ4
-    StorageSelkie               = 0x00000004, // Chunks are recompressed with Oodle Selkie
-    StorageCompMethodMask       = 0x0000000F, // Compresssion method mask
-
-    StorageCompressFastest      = 0x00000010,
-    StorageCompressFast         = 0x00000020,
-    StorageCompressNormal       = 0x00000030,
-    StorageCompressSlow         = 0x00000040,
-    StorageCompressSlowest      = 0x00000050,
-    StorageCompLevelMask        = 0x000000F0, // Compression level mask
-
-    StorageVerifyHashes         = 0x00001000, // Verify SHA hashes of downloaded chunks when reading and redownload if invalid
-};
-
-enum {
-    ChunkFlagDecompressed = 0x01,
-    ChunkFlagZstd         = 0x02,
-    ChunkFlagZlib         = 0x04,
-    ChunkFlagLZ4          = 0x08,
-    ChunkFlagOodle        = 0x09,
-
-    ChunkFlagCompCount    =    5,
-    ChunkFlagCompMask     = 0x0F,
-};
-
-enum class CHUNK_STATUS {
-    Unavailable, // Readable from download
-    Grabbing,    // Downloading
-    Available,   // Readable from local copy
-    Reading,     // Reading from local copy
-    Readable     // Readable from memory
-};
-
-struct CHUNK_POOL_DATA {
-    std::pair<std::shared_ptr<char[]>, size_t> Buffer;
-    std::condition_variable CV;
-    std::mutex CV_Mutex;
-    std::atomic<CHUNK_STATUS> Status;
-};
-
-auto hash = [](const char* n) { return (*((uint64_t*)n)) ^ (*(((uint64_t*)n) + 1)); };
-auto equal = [](const char* a, const char* b) {return !memcmp(a, b, 16); };
-// this can be an ordered map, but i'm unsure about the memory usage of this, even if all 81k chunks are read
-typedef std::deque<std::pair<char*, CHUNK_POOL_DATA>> STORAGE_CHUNK_POOL_LOOKUP;
-
 class Storage {
 public:
-    Storage(uint32_t Flags, uint32_t ChunkPoolCapacity, fs::path CacheLocation, std::string CloudDir);
+    // ChunkData's buffer is nullptr if the download was cancelled
+    typedef std::function<void(Compressor::buffer_value ChunkData)> fetch_callback;
+
+    // ChunkPoolCapacity and CompressedCacheCapacity are in bytes
+    // The build is retained in the cache along with the RetainedBuildCount - 1 builds mounted before it
+    // Chunks that haven't been read in ArchiveAfterDays days are archived with LZMA by RecompressChunk, 0 never archives them
+    Storage(uint32_t Flags, size_t ChunkPoolCapacity, size_t CompressedCacheCapacity, uint32_t RetainedBuildCount, uint32_t ArchiveAfterDays, fs::path CacheLocation, std::string CloudDir, const std::string& BuildId, const std::vector<std::shared_ptr<Chunk>>& ChunkList);
     ~Storage();
 
     bool IsChunkDownloaded(std::shared_ptr<Chunk> Chunk);
     bool IsChunkDownloaded(ChunkPart& ChunkPart);
     bool VerifyChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag);
     void DeleteChunk(std::shared_ptr<Chunk> Chunk);
-    std::shared_ptr<char[]> GetChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag);
-    std::shared_ptr<char[]> GetChunkPart(ChunkPart& ChunkPart, cancel_flag& flag);
+    // Priority is what it's downloaded with if it isn't stored
+    std::shared_ptr<char[]> GetChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, FetchPriority Priority = FetchPriority::Interactive);
+    // Returns a view of the part's bytes (ChunkPart.Size of them) that keeps the whole chunk buffer alive
+    std::shared_ptr<char[]> GetChunkPart(ChunkPart& ChunkPart, cancel_flag& flag, FetchPriority Priority = FetchPriority::Interactive);
+    // Downloads the chunk and queues it to be written, returns without waiting for the write
+    // Downloads started by this and DownloadChunkAsync are background ones, reads go before them
     Compressor::buffer_value DownloadChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload = false);
-    bool GetChunkMetadata(std::shared_ptr<Chunk> Chunk, uint16_t& flags, size_t& fileSize);
+    // Returns right away, OnFetched is called on a download thread once it's downloaded, so it shouldn't block (use StoreChunk elsewhere)
+    // flag has to outlive the download
+    void DownloadChunkAsync(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, fetch_callback OnFetched);
+    // Queues a chunk from DownloadChunkAsync to be written, blocks while the write queue is full
+    // Does nothing if whoever it shared the download with queued it already
+    // Urgent ones go ahead of the queue and aren't held to the write limit, for when a read is waiting on it
+    void StoreChunk(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, bool Urgent = false);
+    // Calls back everything still downloading for flag right away with nullptr
+    // Downloads are shared between everyone that wants the chunk, they're only aborted once all of them cancel
+    void CancelDownloads(cancel_flag& flag);
+    // Caps the connections downloads are spread over, -1 sets it back to the default
+    // Downloads past that are queued by priority
+    void SetDownloadConnections(long Count);
+    // Caps background downloads and background writes (preloading, recompressing) in bytes per second, 0 is unlimited
+    // Reads aren't limited, and a background download that a read joins stops being limited
+    void SetBackgroundLimits(uint64_t DownloadBytesPerSec, uint64_t WriteBytesPerSec);
+    // linked is set if the chunk is deduplicated, its data is stored under another guid with the same hash
+    bool GetChunkMetadata(std::shared_ptr<Chunk> Chunk, uint16_t& flags, size_t& fileSize, bool& linked);
+    uint32_t GetMissingChunkCount();
+
+    // Moves loose chunk files into the packs in the given order if StoragePackFiles is set
+    // If it isn't but the cache has packs (the layout was switched back), their chunks are moved out into loose files instead
+    void MigrateLooseChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkOrder, cancel_flag& flag);
+    // Removes stored chunks that no retained build references
+    void PurgeUnusedChunks(cancel_flag& flag);
+    // Waits until all downloaded chunks are written, and saves when chunks were verified
+    void FlushWrites();
+    // Rewrites the chunk with the current compression method and level if it's stored with different ones,
+    // or with LZMA if it's cold (archived chunks are rewritten as soon as they're read again)
+    // Returns the number of bytes read and written, 0 if it was skipped
+    size_t RecompressChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag);
 
 private:
-    CHUNK_POOL_DATA& GetPoolData(std::shared_ptr<Chunk> Chunk);
+    // Returns a view starting at Offset with at least Size bytes, only decoding the blocks it covers if it can
+    std::shared_ptr<char[]> GetChunkData(std::shared_ptr<Chunk> Chunk, uint32_t Offset, uint32_t Size, cancel_flag& flag, FetchPriority Priority);
+    ChunkPoolHandle GetPoolData(std::shared_ptr<Chunk> Chunk);
     CHUNK_STATUS GetUnpooledChunkStatus(std::shared_ptr<Chunk> Chunk);
-    bool ReadChunk(fs::path Path, Compressor::buffer_value& ReadBuffer, cancel_flag& flag);
-    void WriteChunk(fs::path Path, uint32_t DecompressedSize, Compressor::buffer_value& Buffer);
+    Compressor::buffer_value FetchChunk(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload, FetchPriority Priority);
+    // One download of a chunk, shared by everyone that asks for it while it's running
+    struct ChunkFetch {
+        cancel_flag Flag; // cancelled once all of the waiters are
+        std::vector<std::pair<cancel_flag*, fetch_callback>> Waiters;
+        std::shared_ptr<FetchScheduler::Job> Job;
+        std::mutex Mutex; // guards Priority and Connection
+        FetchPriority Priority; // the highest one it was asked for with
+        std::shared_ptr<curlion::HttpConnection> Connection; // set once it's started
+    };
+    // Joins the chunk's download if there is one (raising it to Priority if it's still queued), otherwise queues it
+    void FetchChunkAsync(std::shared_ptr<Chunk> Chunk, cancel_flag& flag, bool forceDownload, FetchPriority Priority, fetch_callback OnFetched);
+    // Retries until it gets a good chunk or Fetch is cancelled
+    // Each try of a read or prefetch is hedged if the server is slow to answer, background ones aren't
+    void StartFetch(std::shared_ptr<Chunk> Chunk, std::shared_ptr<ChunkFetch> Fetch);
+    // Decodes a chunk as it's stored on the CDN, nullptr if it's bad
+    std::shared_ptr<char[]> ParseCdnChunk(std::shared_ptr<Chunk> Chunk, const std::string& Body);
+    bool ReadChunk(std::shared_ptr<Chunk> Chunk, Compressor::buffer_value& ReadBuffer, cancel_flag& flag);
+    // The chunk its data is stored under, which is another one if it's deduplicated
+    std::shared_ptr<Chunk> GetStoredChunk(std::shared_ptr<Chunk> Chunk);
+    // Records that the chunk was read today, so it isn't archived
+    void TouchChunk(std::shared_ptr<Chunk> Chunk);
+    // Reads the chunk as it's stored (header included) from its pack or file
+    bool ReadStoredChunk(std::shared_ptr<Chunk> Chunk, std::shared_ptr<char[]>& Data, uint32_t& Size);
+    // If Data is in an Owner buffer, uncompressed chunks are returned as a view of it instead of being copied
+    bool DecodeChunk(std::shared_ptr<Chunk> Chunk, const char* Data, uint32_t Size, Compressor::buffer_value& ReadBuffer, const std::shared_ptr<char[]>& Owner = nullptr);
+    // Decodes blocks [FirstBlock, EndBlock) of a version 1 chunk into Out, the block table has to be validated already
+    bool DecodeBlocks(const char* Data, uint32_t Size, uint32_t FirstBlock, uint32_t EndBlock, char* Out);
+    // Decodes the blocks covering [Offset, Offset + PartSize), PartOffset is where Offset lands in PartData
+    // Returns false if the chunk isn't stored in blocks
+    bool DecodePart(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, uint32_t Size, uint32_t Offset, uint32_t PartSize, std::shared_ptr<char[]>& PartData, uint32_t& PartOffset);
+    // Archive stores it with LZMA as a single block instead of with the storage method
+    // Throttle waits on the write limit before writing it, returns false if it couldn't be written (the old copy is kept)
+    bool WriteChunk(std::shared_ptr<Chunk> Chunk, const std::shared_ptr<char[]>& Data, bool Archive = false, bool Throttle = false);
+    // Writes the stored chunk (header included) as a loose file, and drops its pack record if it has one
+    bool WriteChunkFile(std::shared_ptr<Chunk> Chunk, const char* Data, uint32_t Size);
+    // MigrateLooseChunks the other way around, when the layout was switched back to loose files
+    void MigratePackedChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkOrder, cancel_flag& flag);
+    // Not read in ArchiveAfterDays days
+    bool IsChunkCold(std::shared_ptr<Chunk> Chunk);
+    // ChunkFlag* (method and level) that new chunks are written with
+    uint16_t GetStorageChunkFlags();
+    // Picks the method for this chunk if StorageAdaptive is set, otherwise it's GetStorageChunkFlags
+    uint16_t GetChunkFlags(const char* Data, uint32_t Size);
+    // Fills the presence bitset from the journal, building the journal from the chunk files first if there isn't one
+    void ScanChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkList);
+    void RebuildJournal(const std::vector<std::shared_ptr<Chunk>>& ChunkList);
+    // Links missing chunks to stored ones with the same SHA-1, so they don't have to be downloaded and stored again
+    void LinkDuplicateChunks(const std::vector<std::shared_ptr<Chunk>>& ChunkList);
+    const char* GetShaHash(const std::vector<std::shared_ptr<Chunk>>& ChunkList, const guid_key& Guid);
+    void SetChunkPresence(std::shared_ptr<Chunk> Chunk, bool Present);
+    bool IsChunkVerified(std::shared_ptr<Chunk> Chunk);
+    void SetChunkVerified(std::shared_ptr<Chunk> Chunk, bool Verified);
 
     fs::path CachePath;
     uint32_t Flags;
     std::string CloudDir; // CloudDir also includes the /ChunksV3/ part, though
     Compressor Compressor;
-    std::mutex ChunkPoolMutex;
-    STORAGE_CHUNK_POOL_LOOKUP ChunkPool;
-    uint32_t ChunkPoolCapacity;
+    DictionaryStore Dictionaries; // has to be declared after Compressor, it loads the dictionaries into it
+    ChunkPool ChunkPool;
+    CompressedCache CompressedChunks;
+    std::unique_ptr<PackStore> Packs; // only opened if StoragePackFiles is set or the cache already has packs
+    ChunkJournal Journal;
+    BuildRefs Builds;
+    ChunkAccessLog Accesses;
+    uint32_t ArchiveAfterDays;
+
+    // Index of each chunk in the manifest, and whether it's downloaded or not by that index
+    // Filled once from the journal, then kept in sync by WriteChunk and DeleteChunk
+    std::unordered_map<guid_key, uint32_t, guid_hash> ChunkIndices;
+    atomic_bitset ChunkPresence;
+    atomic_bitset ChunkVerified; // hash checked since mounting, so its parts can be decoded without checking the whole chunk
+    size_t LooseChunkCount; // loose chunk files found by the scan, nothing to migrate if there are none
+
+    // Downloads that are running, so a chunk that's asked for again joins its download instead of starting another
+    std::mutex FetchesMutex;
+    std::unordered_map<guid_key, std::shared_ptr<ChunkFetch>, guid_hash> Fetches;
+
+    // Background limits, see SetBackgroundLimits
+    token_bucket DownloadLimiter;
+    token_bucket WriteLimiter;
+
+    // Saves the access log and the journal's verify times every so often, they're saved when they're destroyed too but that doesn't happen if we crash
+    // Stopped by the destructor, before anything it uses is destroyed
+    void SaveJob();
+    std::thread SaveThread;
+    std::mutex SaveMutex;
+    std::condition_variable SaveCV;
+    bool SaveStopping;
+
+    // Declared after everything the queued writes need, so it's destroyed before them
+    ChunkWriter Writer;
+    // Declared last so they're destroyed first, finished downloads can still use everything above
+    FetchScheduler Scheduler;
+    Client Downloader;
 };
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "writer.h"
+
+#ifndef LOG_SECTION
+#define LOG_SECTION "ChunkWriter"
+#endif
+
+#include "../Logger.h"
+#include "../Stats.h"
+
+ChunkWriter::ChunkWriter(uint32_t WorkerCount, size_t Capacity, write_func Write) :
+    Write(Write),
+    Capacity(Capacity),
+    InProgress(0),
+    Stopping(false)
+{
+    Workers.reserve(WorkerCount);
+    for (uint32_t i = 0; i < WorkerCount; ++i) {
+        Workers.emplace_back(&ChunkWriter::WorkerJob, this);
+    }
+}
+
+ChunkWriter::~ChunkWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Stopping = true;
+    }
+    WorkCV.notify_all();
+    for (auto& worker : Workers) {
+        worker.join();
+    }
+}
+
+void ChunkWriter::Push(std::shared_ptr<Chunk> Chunk, std::shared_ptr<char[]> Buffer, bool Urgent)
+{
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        if (!Urgent) {
+            PushCV.wait(lock, [this] { return Queue.size() < Capacity; });
+        }
+        auto pending = Pending.find(Chunk->Guid);
+        if (pending != Pending.end() && pending->second == Buffer) {
+            return; // pushed already by someone it shared the download with
+        }
+        Pending[Chunk->Guid] = Buffer;
+        if (Urgent) {
+            Queue.emplace_front(std::move(Chunk), std::move(Buffer), true);
+        }
+        else {
+            Queue.emplace_back(std::move(Chunk), std::move(Buffer), false);
+        }
+        Stats::WriteQueueCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    WorkCV.notify_one();
+}
+
+std::shared_ptr<char[]> ChunkWriter::GetPending(const char Guid[16])
+{
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto it = Pending.find(Guid);
+    if (it == Pending.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void ChunkWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(Mutex);
+    FlushCV.wait(lock, [this] { return Queue.empty() && !InProgress; });
+}
+
+void ChunkWriter::WorkerJob()
+{
+    std::unique_lock<std::mutex> lock(Mutex);
+    while (true) {
+        WorkCV.wait(lock, [this] { return !Queue.empty() || Stopping; });
+        if (Queue.empty()) {
+            return; // stopping, and everything's written
+        }
+
+        auto [chunk, buffer, urgent] = std::move(Queue.front());
+        Queue.pop_front();
+        InProgress++;
+        lock.unlock();
+        PushCV.notify_one();
+
+        Write(chunk, buffer, urgent);
+
+        lock.lock();
+        InProgress--;
+        // it could've been pushed again with a new buffer while this one was being written
+        auto it = Pending.find(chunk->Guid);
+        if (it != Pending.end() && it->second == buffer) {
+            Pending.erase(it);
+        }
+        Stats::WriteQueueCount.fetch_sub(1, std::memory_order_relaxed);
+        FlushCV.notify_all();
+    }
+}
\ No newline at end of file
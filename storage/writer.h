@@ -0,0 +1,52 @@
+#pragma once
+
+#include "../containers/guid.h"
+#include "../web/manifest/chunk.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Compresses and writes downloaded chunks on its own threads, so whoever downloaded them doesn't wait on the disk
+// Push blocks while Capacity chunks are queued, so downloads can't get more than that ahead of the writes
+// Urgent chunks (ones something's reading right now) skip the line and never block
+class ChunkWriter {
+public:
+    typedef std::function<void(const std::shared_ptr<Chunk>& Chunk, const std::shared_ptr<char[]>& Buffer, bool Urgent)> write_func;
+
+    ChunkWriter(uint32_t WorkerCount, size_t Capacity, write_func Write);
+    // Writes everything that's still queued before returning
+    ~ChunkWriter();
+
+    // Pushing a buffer that's still queued or being written does nothing
+    void Push(std::shared_ptr<Chunk> Chunk, std::shared_ptr<char[]> Buffer, bool Urgent = false);
+
+    // Returns the buffer of a chunk that's queued or being written, nullptr if there isn't one
+    std::shared_ptr<char[]> GetPending(const char Guid[16]);
+
+    // Waits until everything pushed so far is written
+    void Flush();
+
+private:
+    void WorkerJob();
+
+    write_func Write;
+    size_t Capacity;
+
+    std::mutex Mutex;
+    std::condition_variable PushCV;  // notified when there's room in the queue
+    std::condition_variable WorkCV;  // notified when there's something queued or we're stopping
+    std::condition_variable FlushCV; // notified when a write finishes
+    std::deque<std::tuple<std::shared_ptr<Chunk>, std::shared_ptr<char[]>, bool>> Queue; // chunk, buffer, urgent
+    std::unordered_map<guid_key, std::shared_ptr<char[]>, guid_hash> Pending; // queued and in progress buffers
+    size_t InProgress;
+    bool Stopping;
+
+    std::vector<std::thread> Workers;
+};
\ No newline at end of file
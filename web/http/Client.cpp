@@ -6,9 +6,19 @@
 
 #include "../../Logger.h"
 
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <fcntl.h>
 #include <io.h>
+#include <thread>
+#include <unordered_set>
+
+#define HEDGE_SAMPLE_COUNT  256 // first byte times the hedge delay is picked from
+#define HEDGE_MIN_SAMPLES   32  // the default is used until there are this many
+#define HEDGE_DEFAULT_DELAY std::chrono::milliseconds(1000)
+#define HEDGE_MIN_DELAY     std::chrono::milliseconds(100)  // so a fast CDN doesn't get every request that's a bit slower than usual hedged
+#define HEDGE_MAX_DELAY     std::chrono::milliseconds(10000)
+#define HEDGE_CONNECTIONS   4 // extra connections each loop allows over its cap, so hedges don't queue behind the transfers they hedge
 
 class AsioTimer : public curlion::Timer {
 public:
@@ -198,30 +208,399 @@ private:
     boost::asio::io_service& io_service_;
 };
 
-Client::Client()
-{
-    io_service = new boost::asio::io_service;
-    // auto work = std::make_shared<boost::asio::io_service::work>(io_service);
+struct Client::EventLoop {
+    boost::asio::io_service IoService;
+    std::unique_ptr<boost::asio::io_service::work> Work;
+    // only touched on the loop's thread, ConnectionManager isn't thread safe
+    std::unique_ptr<curlion::ConnectionManager> ConnectionManager;
+    std::unordered_set<std::shared_ptr<Transfer>> Running; // retrying ones included
+    std::unordered_set<std::shared_ptr<HedgedRequest>> Hedged; // both of its transfers run on this loop too
+    bool Stopping = false; // the client's being destroyed, transfers fail instead of starting
+    std::thread Thread;
+};
 
-    auto timer = std::make_shared<AsioTimer>(*(boost::asio::io_service*)io_service);
-    auto socket_manager = std::make_shared<AsioSocketManager>(*(boost::asio::io_service*)io_service);
+struct Client::Transfer {
+    std::shared_ptr<curlion::HttpConnection> Connection;
+    cancel_flag& Flag;
+    finished_callback Callback;
+    bool AllowNon200;
+    int RetryCount;
+    token_bucket* Limiter;
+    curl_off_t Received; // by this attempt, what the limiter has been charged for
+    std::unique_ptr<boost::asio::steady_timer> ResumeTimer; // set while it's paused by the limiter
+    curlion::HttpConnection* Request; // what SetLimiter finds it by, a hedge has its original's
+    std::function<void()> OnSent; // called once it has a connection and the request is going out, on every try
+    std::function<void()> OnFirstBytes; // called once, when it starts receiving
+    bool Aborted;
+    char ErrorBuffer[CURL_ERROR_SIZE];
+};
 
-    connection_manager = std::make_unique<curlion::ConnectionManager>(socket_manager, socket_manager, timer);
+// Only touched on its loop's thread
+struct Client::HedgedRequest {
+    hedged_callback Callback;
+    connection_factory CreateHedge;
+    cancel_flag& Flag;
+    token_bucket* Limiter;
+    std::chrono::steady_clock::time_point Started; // when the original was sent, waiting for a connection doesn't count
+    std::unique_ptr<boost::asio::steady_timer> HedgeTimer; // set from when the original is sent until the hedge is started or it's done
+    // the transfers' callbacks hold the request, these are reset once it's done so neither leaks
+    std::shared_ptr<Transfer> Original;
+    std::shared_ptr<Transfer> Hedge; // set once it's started
+    int Running; // transfers that haven't called back
+    bool Sent; // the original was sent, and the hedge timer started
+    bool Responded; // the original started receiving
+};
+
+Client::Client(uint32_t loopCount) :
+    NextLoop(0),
+    FirstByteNext(0)
+{
+    for (uint32_t i = 0; i < std::max(loopCount, 1u); ++i) {
+        auto& loop = *Loops.emplace_back(std::make_unique<EventLoop>());
+        loop.Work = std::make_unique<boost::asio::io_service::work>(loop.IoService);
+
+        auto timer = std::make_shared<AsioTimer>(loop.IoService);
+        auto socket_manager = std::make_shared<AsioSocketManager>(loop.IoService);
+        loop.ConnectionManager = std::make_unique<curlion::ConnectionManager>(socket_manager, socket_manager, timer);
+        // over HTTP/2 transfers share connections instead of each opening one
+        curl_multi_setopt(loop.ConnectionManager->GetHandle(), CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(loop.ConnectionManager->GetHandle(), CURLMOPT_MAX_HOST_CONNECTIONS, DefaultPoolSize);
+
+        loop.Thread = std::thread([&loop] {
+            loop.IoService.run();
+        });
+    }
 }
 
 Client::~Client()
 {
-    delete io_service;
+    for (auto& loop : Loops) {
+        loop->IoService.post([this, &loop = *loop] {
+            loop.Stopping = true;
+            // everything's called back as failed, so nobody's left waiting on it
+            // hedged requests are called back once both of their transfers are
+            auto running = std::move(loop.Running);
+            for (auto& transfer : running) {
+                loop.ConnectionManager->AbortConnection(transfer->Connection);
+                transfer->ResumeTimer.reset();
+                transfer->Aborted = true; // it could be waiting to be retried
+                Complete(loop, transfer, false);
+            }
+            // transfers that were posted but haven't started yet are ahead of this, they fail as they start
+            loop.IoService.post([&loop] {
+                loop.IoService.stop();
+            });
+        });
+        loop->Thread.join();
+    }
+}
+
+void Client::ExecuteAsync(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, finished_callback callback, bool allowNon200, token_bucket* limiter)
+{
+    auto transfer = CreateTransfer(connection, flag, std::move(callback), allowNon200, limiter);
+    auto& loop = GetNextLoop();
+    loop.IoService.post([this, &loop, transfer] {
+        Start(loop, transfer);
+    });
+}
+
+std::future<bool> Client::ExecuteAsync(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, bool allowNon200)
+{
+    auto promise = std::make_shared<std::promise<bool>>();
+    ExecuteAsync(connection, flag, [promise](const std::shared_ptr<curlion::HttpConnection>& connection, bool success) {
+        promise->set_value(success);
+    }, allowNon200);
+    return promise->get_future();
+}
+
+void Client::ExecuteHedgedAsync(const std::shared_ptr<curlion::HttpConnection>& connection, connection_factory createHedge, cancel_flag& flag, hedged_callback callback, token_bucket* limiter)
+{
+    auto& loop = GetNextLoop();
+    auto request = std::shared_ptr<HedgedRequest>(new HedgedRequest{ std::move(callback), std::move(createHedge), flag, limiter });
+    request->Original = CreateTransfer(connection, flag, [this, &loop, request](const std::shared_ptr<curlion::HttpConnection>&, bool success) {
+        HedgeFinished(loop, request, false, success);
+    }, false, limiter);
+    // timed from when it's sent, a transfer waiting for a connection would get hedged onto another one that also has to wait
+    request->Original->OnSent = [this, &loop, request] {
+        if (request->Sent) {
+            return; // retried, it's still timed from the first try
+        }
+        request->Sent = true;
+        request->Started = std::chrono::steady_clock::now();
+        request->HedgeTimer = std::make_unique<boost::asio::steady_timer>(loop.IoService, GetHedgeDelay());
+        request->HedgeTimer->async_wait([this, &loop, request](const boost::system::error_code& error) {
+            if (error != boost::asio::error::operation_aborted) {
+                StartHedge(loop, request);
+            }
+        });
+    };
+    request->Original->OnFirstBytes = [this, request] {
+        request->Responded = true;
+        AddFirstByteTime(std::chrono::steady_clock::now() - request->Started);
+    };
+    request->Running = 1;
+
+    loop.IoService.post([this, &loop, request] {
+        loop.Hedged.emplace(request);
+        Start(loop, request->Original);
+    });
+}
+
+void Client::SetLimiter(const std::shared_ptr<curlion::HttpConnection>& connection, token_bucket* limiter)
+{
+    // it's only running on one of them, but we don't know which
+    for (auto& loop : Loops) {
+        loop->IoService.post([this, &loop = *loop, connection, limiter] {
+            // its hedge has the same request, if it has one
+            for (auto& transfer : loop.Running) {
+                if (transfer->Request == connection.get()) {
+                    transfer->Limiter = limiter;
+                    if (transfer->ResumeTimer) {
+                        Resume(loop, transfer.get());
+                    }
+                }
+            }
+        });
+    }
+}
+
+void Client::SetMaxConnections(long maxConnections)
+{
+    if (maxConnections == -1) {
+        maxConnections = DefaultPoolSize;
+    }
+    for (auto& loop : Loops) {
+        loop->IoService.post([&loop = *loop, maxConnections] {
+            curl_multi_setopt(loop.ConnectionManager->GetHandle(), CURLMOPT_MAX_HOST_CONNECTIONS, maxConnections + HEDGE_CONNECTIONS);
+            curl_multi_setopt(loop.ConnectionManager->GetHandle(), CURLMOPT_MAXCONNECTS, maxConnections + HEDGE_CONNECTIONS);
+        });
+    }
+}
+
+std::shared_ptr<Client::Transfer> Client::CreateTransfer(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, finished_callback callback, bool allowNon200, token_bucket* limiter)
+{
+    auto transfer = std::shared_ptr<Transfer>(new Transfer{ connection, flag, std::move(callback), allowNon200, 5, limiter, 0, nullptr, connection.get(), nullptr, nullptr, false });
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_ERRORBUFFER, transfer->ErrorBuffer);
+    connection->SetTimeoutInMilliseconds(120000); // tcp connect timeout
+    connection->SetEnableProgress(true);
+    return transfer;
+}
+
+Client::EventLoop& Client::GetNextLoop()
+{
+    return *Loops[NextLoop.fetch_add(1, std::memory_order_relaxed) % Loops.size()];
+}
+
+void Client::Start(EventLoop& loop, const std::shared_ptr<Transfer>& transfer)
+{
+    if (transfer->Aborted) {
+        return; // aborted while it was waiting to be retried
+    }
+    if (transfer->Flag.cancelled() || loop.Stopping) {
+        Complete(loop, transfer, false);
+        return;
+    }
+
+    transfer->ErrorBuffer[0] = '\0';
+    transfer->Received = 0;
+    transfer->Connection->SetFinishedCallback([this, &loop, transfer](const std::shared_ptr<curlion::Connection>&) {
+        Finished(loop, transfer);
+    });
+    // the transfer outlives its progress callbacks, they stop once it's finished
+    transfer->Connection->SetProgressCallback([this, &loop, transfer = transfer.get()](const std::shared_ptr<curlion::Connection>&, curl_off_t, curl_off_t downloaded, curl_off_t, curl_off_t) {
+        return Progress(loop, transfer, downloaded);
+    });
+    if (transfer->OnSent) {
+        curl_easy_setopt(transfer->Connection->GetHandle(), CURLOPT_PREREQDATA, transfer.get());
+        if (curl_easy_setopt(transfer->Connection->GetHandle(), CURLOPT_PREREQFUNCTION, &Client::Sent) != CURLE_OK) {
+            transfer->OnSent(); // curl's too old to tell us, so it's sent as far as we know
+        }
+    }
+    auto error = loop.ConnectionManager->StartConnection(transfer->Connection);
+    if (error) {
+        LOG_ERROR("Could not start transfer: %s", error.message().c_str());
+        Complete(loop, transfer, false);
+        return;
+    }
+    loop.Running.emplace(transfer);
+}
+
+bool Client::Progress(EventLoop& loop, Transfer* transfer, curl_off_t downloaded)
+{
+    if (transfer->Flag.cancelled()) {
+        return false;
+    }
+    if (downloaded > 0 && transfer->OnFirstBytes) {
+        auto onFirstBytes = std::move(transfer->OnFirstBytes);
+        transfer->OnFirstBytes = nullptr;
+        onFirstBytes();
+    }
+    if (!transfer->Limiter || transfer->ResumeTimer || downloaded <= transfer->Received) {
+        return true;
+    }
+
+    // charged for what came in since the last call, if that puts the limiter in debt we stop receiving until it's paid off
+    auto wait = transfer->Limiter->take(downloaded - transfer->Received);
+    transfer->Received = downloaded;
+    if (wait > token_bucket::clock::duration::zero()) {
+        curl_easy_pause(transfer->Connection->GetHandle(), CURLPAUSE_RECV);
+        transfer->ResumeTimer = std::make_unique<boost::asio::steady_timer>(loop.IoService, wait);
+        transfer->ResumeTimer->async_wait([this, &loop, transfer](const boost::system::error_code& error) {
+            if (error != boost::asio::error::operation_aborted) {
+                Resume(loop, transfer);
+            }
+        });
+    }
+    return true;
 }
 
-std::error_condition Client::StartConnection(const std::shared_ptr<curlion::Connection>& connection)
+int Client::Sent(void* clientp, char* primaryIp, char* localIp, int primaryPort, int localPort)
 {
-    return connection_manager->StartConnection(connection);
+    // called by curl on the transfer's loop, so nothing else is touching it
+    auto transfer = (Transfer*)clientp;
+    if (transfer->OnSent) {
+        transfer->OnSent();
+    }
+    return CURL_PREREQFUNC_OK;
+}
+
+void Client::Resume(EventLoop& loop, Transfer* transfer)
+{
+    transfer->ResumeTimer.reset();
+    curl_easy_pause(transfer->Connection->GetHandle(), CURLPAUSE_CONT);
 }
 
-std::error_condition Client::AbortConnection(const std::shared_ptr<curlion::Connection>& connection)
+void Client::Finished(EventLoop& loop, const std::shared_ptr<Transfer>& transfer)
 {
-    return connection_manager->AbortConnection(connection);
+    transfer->ResumeTimer.reset();
+
+    auto& connection = transfer->Connection;
+    if (transfer->Flag.cancelled()) {
+        Complete(loop, transfer, false);
+        return;
+    }
+
+    if (connection->GetResult() != CURLE_OK) {
+        LOG_ERROR("Curl error %d: %s", connection->GetResult(),
+            strlen(transfer->ErrorBuffer) ?
+            transfer->ErrorBuffer :
+            curl_easy_strerror(connection->GetResult()));
+    }
+    else if (!transfer->AllowNon200 && connection->GetResponseCode() != 200) {
+        LOG_ERROR("Response code was %d. Response data: %s", connection->GetResponseCode(), connection->GetResponseBody().c_str());
+    }
+    else {
+        Complete(loop, transfer, true);
+        return;
+    }
+
+    if (!--transfer->RetryCount) {
+        LOG_ERROR("Ran out of retries");
+        Complete(loop, transfer, false);
+        return;
+    }
+
+    LOG_WARN("Retrying...");
+    connection->Clone();
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_ERRORBUFFER, transfer->ErrorBuffer);
+    // restarted from the loop instead of inside the manager's finished check
+    loop.IoService.post([this, &loop, transfer] {
+        Start(loop, transfer);
+    });
+}
+
+void Client::Complete(EventLoop& loop, std::shared_ptr<Transfer> transfer, bool success)
+{
+    loop.Running.erase(transfer);
+    // the connection holds the callbacks that hold the transfer, let go of them so neither leaks
+    transfer->Connection->SetFinishedCallback(nullptr);
+    transfer->Connection->SetProgressCallback(nullptr);
+    transfer->OnSent = nullptr;
+    transfer->OnFirstBytes = nullptr;
+    transfer->Callback(transfer->Connection, success);
+}
+
+void Client::Abort(EventLoop& loop, std::shared_ptr<Transfer> transfer)
+{
+    transfer->Aborted = true;
+    transfer->ResumeTimer.reset();
+    loop.ConnectionManager->AbortConnection(transfer->Connection); // does nothing if it's waiting to be retried
+    loop.Running.erase(transfer);
+    transfer->Connection->SetFinishedCallback(nullptr);
+    transfer->Connection->SetProgressCallback(nullptr);
+    transfer->OnSent = nullptr;
+    transfer->OnFirstBytes = nullptr;
+}
+
+void Client::StartHedge(EventLoop& loop, const std::shared_ptr<HedgedRequest>& request)
+{
+    request->HedgeTimer.reset();
+    // it could've started receiving since the timer fired
+    if (!request->Original || request->Responded || request->Flag.cancelled()) {
+        return;
+    }
+
+    auto connection = request->CreateHedge();
+    // a new connection, the original's might be multiplexed over a stalled one
+    curl_easy_setopt(connection->GetHandle(), CURLOPT_FRESH_CONNECT, 1L);
+    request->Hedge = CreateTransfer(connection, request->Flag, [this, &loop, request](const std::shared_ptr<curlion::HttpConnection>&, bool success) {
+        HedgeFinished(loop, request, true, success);
+    }, false, request->Original->Limiter);
+    request->Hedge->Request = request->Original->Request;
+    request->Running++;
+    Start(loop, request->Hedge);
+}
+
+void Client::HedgeFinished(EventLoop& loop, const std::shared_ptr<HedgedRequest>& request, bool hedge, bool success)
+{
+    request->Running--;
+    if (!success && request->Running) {
+        return; // the other one could still get it
+    }
+
+    auto winner = hedge ? request->Hedge : request->Original;
+    auto loser = hedge ? request->Original : request->Hedge;
+    if (loser && request->Running) {
+        Abort(loop, loser);
+    }
+    if (hedge && !request->Responded) {
+        // the original never started receiving, so all we know is that it takes at least this long
+        AddFirstByteTime(std::chrono::steady_clock::now() - request->Started);
+    }
+    auto outcome = !request->Hedge ? HedgeOutcome::NotHedged : hedge ? HedgeOutcome::HedgeWon : HedgeOutcome::OriginalWon;
+
+    request->HedgeTimer.reset();
+    request->Original.reset();
+    request->Hedge.reset();
+    loop.Hedged.erase(request);
+    request->Callback(winner->Connection, success, outcome);
+}
+
+void Client::AddFirstByteTime(std::chrono::steady_clock::duration time)
+{
+    std::lock_guard<std::mutex> lock(FirstByteMutex);
+    if (FirstByteTimes.size() < HEDGE_SAMPLE_COUNT) {
+        FirstByteTimes.emplace_back(time);
+    }
+    else {
+        FirstByteTimes[FirstByteNext] = time;
+    }
+    FirstByteNext = (FirstByteNext + 1) % HEDGE_SAMPLE_COUNT;
+}
+
+std::chrono::steady_clock::duration Client::GetHedgeDelay()
+{
+    std::vector<std::chrono::steady_clock::duration> times;
+    {
+        std::lock_guard<std::mutex> lock(FirstByteMutex);
+        if (FirstByteTimes.size() < HEDGE_MIN_SAMPLES) {
+            return HEDGE_DEFAULT_DELAY;
+        }
+        times = FirstByteTimes;
+    }
+    auto p95 = times.begin() + times.size() * 95 / 100;
+    std::nth_element(times.begin(), p95, times.end());
+    return std::clamp<std::chrono::steady_clock::duration>(*p95, HEDGE_MIN_DELAY, HEDGE_MAX_DELAY);
 }
 
 bool Client::Execute(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, bool allowNon200)
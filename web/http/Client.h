@@ -1,18 +1,56 @@
 #pragma once
 
 #include "../../containers/cancel_flag.h"
+#include "../../containers/token_bucket.h"
 
 #include <chrono>
 #include <curlion.h>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <vector>
 
+// Runs transfers on loopCount event loop threads instead of blocking a thread per transfer
+// Everything public can be called from any thread
 class Client {
 public:
-	Client();
+	// success is false if it ran out of retries or was cancelled
+	using finished_callback = std::function<void(const std::shared_ptr<curlion::HttpConnection>& connection, bool success)>;
+
+	// Which of a hedged request's transfers it was called back with
+	enum class HedgeOutcome : uint8_t {
+		NotHedged, // it was done before it needed a hedge
+		OriginalWon,
+		HedgeWon
+	};
+	using hedged_callback = std::function<void(const std::shared_ptr<curlion::HttpConnection>& connection, bool success, HedgeOutcome outcome)>;
+	using connection_factory = std::function<std::shared_ptr<curlion::HttpConnection>()>;
+
+	Client(uint32_t loopCount = 1);
+	// Transfers that are still running or waiting to start are aborted and called back with success = false
+	// Transfers started from those callbacks aren't run or called back
 	~Client();
 
-	std::error_condition StartConnection(const std::shared_ptr<curlion::Connection>& connection);
-	std::error_condition AbortConnection(const std::shared_ptr<curlion::Connection>& connection);
+	// Returns right away, the callback is called on an event loop thread (so it shouldn't block) once the transfer is done
+	// Retries like Execute does, flag has to outlive the transfer and aborts it when it's cancelled
+	// If there's a limiter, the transfer is paused whenever it's received more than the limiter allows (it has to outlive the transfer too)
+	void ExecuteAsync(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, finished_callback callback, bool allowNon200 = false, token_bucket* limiter = nullptr);
+	std::future<bool> ExecuteAsync(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, bool allowNon200 = false);
+	// Like ExecuteAsync, but if nothing's been received after the hedge delay, createHedge's connection is started alongside it
+	// The hedge gets a new connection, so it isn't multiplexed onto the same (possibly slow) server
+	// Whichever succeeds first is called back and the other is aborted, it only fails once both have
+	// The delay is the 95th percentile of how long this client's hedged requests took to start receiving after they were sent
+	// It's timed from when the request is sent, not while it's waiting for a connection
+	void ExecuteHedgedAsync(const std::shared_ptr<curlion::HttpConnection>& connection, connection_factory createHedge, cancel_flag& flag, hedged_callback callback, token_bucket* limiter = nullptr);
+
+	// Changes the limiter of a running transfer, nullptr lets it go at full speed
+	void SetLimiter(const std::shared_ptr<curlion::HttpConnection>& connection, token_bucket* limiter);
+
+	// Caps the connections each event loop opens, transfers past that wait for one (or share one over HTTP/2)
+	// A few more are allowed for hedges, so keep the transfers themselves under the cap
+	// -1: default
+	void SetMaxConnections(long maxConnections);
 	
 	// -1: default
 	static inline void SetPoolSize(long poolSize) {
@@ -35,6 +73,34 @@ private:
 
 	static FILE* CreateTempFile();
 
-	void* io_service;
-	std::unique_ptr<curlion::ConnectionManager> connection_manager;
+	struct EventLoop;
+	struct Transfer;
+	struct HedgedRequest;
+
+	std::shared_ptr<Transfer> CreateTransfer(const std::shared_ptr<curlion::HttpConnection>& connection, cancel_flag& flag, finished_callback callback, bool allowNon200, token_bucket* limiter);
+	EventLoop& GetNextLoop();
+	void Start(EventLoop& loop, const std::shared_ptr<Transfer>& transfer);
+	// Returns false to abort the transfer
+	bool Progress(EventLoop& loop, Transfer* transfer, curl_off_t downloaded);
+	// CURLOPT_PREREQFUNCTION, calls the transfer's OnSent
+	static int Sent(void* clientp, char* primaryIp, char* localIp, int primaryPort, int localPort);
+	void Resume(EventLoop& loop, Transfer* transfer);
+	// Retries it if it failed and has retries left
+	void Finished(EventLoop& loop, const std::shared_ptr<Transfer>& transfer);
+	// By value, the connection's callbacks it lets go of could be holding the only other reference
+	void Complete(EventLoop& loop, std::shared_ptr<Transfer> transfer, bool success);
+	// Stops it without calling back, even if it's waiting to be retried
+	void Abort(EventLoop& loop, std::shared_ptr<Transfer> transfer);
+	void StartHedge(EventLoop& loop, const std::shared_ptr<HedgedRequest>& request);
+	void HedgeFinished(EventLoop& loop, const std::shared_ptr<HedgedRequest>& request, bool hedge, bool success);
+
+	// How long hedged requests took to start receiving, the newest replace the oldest
+	void AddFirstByteTime(std::chrono::steady_clock::duration time);
+	std::chrono::steady_clock::duration GetHedgeDelay();
+	std::mutex FirstByteMutex;
+	std::vector<std::chrono::steady_clock::duration> FirstByteTimes;
+	size_t FirstByteNext;
+
+	std::vector<std::unique_ptr<EventLoop>> Loops;
+	std::atomic_uint32_t NextLoop;
 };
\ No newline at end of file
@@ -5,6 +5,8 @@
 #endif
 
 #include "../../Logger.h"
+#include "../../containers/guid.h"
+#include "../../storage/compression.h"
 
 #include <libdeflate.h>
 #include <numeric>
@@ -192,9 +194,8 @@ Manifest::Manifest(FILE* fp)
 	{
 		auto compData = std::make_unique<char[]>(DataSizeCompressed);
 		fread(compData.get(), DataSizeCompressed, 1, fp);
-		auto decompressor = libdeflate_alloc_decompressor(); // TODO: use ctxmanager for this
+		auto decompressor = Compressor::GetZlibDecompressor();
 		auto result = libdeflate_zlib_decompress(decompressor, compData.get(), DataSizeCompressed, data.get(), DataSizeUncompressed, NULL);
-		libdeflate_free_decompressor(decompressor);
 	}
 	else {
 		fread(data.get(), DataSizeUncompressed, 1, fp);
@@ -354,3 +355,19 @@ uint64_t Manifest::GetInstallSize()
 				});
 		});
 }
+
+std::vector<std::shared_ptr<Chunk>> Manifest::GetChunksInFileOrder()
+{
+	std::vector<std::shared_ptr<Chunk>> ret;
+	ret.reserve(ChunkManifestList.size());
+	std::unordered_set<guid_key, guid_hash> seen;
+	seen.reserve(ChunkManifestList.size());
+	for (auto& file : FileManifestList) {
+		for (auto& part : file.ChunkParts) {
+			if (seen.emplace(part.Chunk->Guid).second) {
+				ret.emplace_back(part.Chunk);
+			}
+		}
+	}
+	return ret;
+}
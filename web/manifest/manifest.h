@@ -14,6 +14,8 @@ public:
 
 	uint64_t GetDownloadSize();
 	uint64_t GetInstallSize();
+	// Chunks in the order they're first used by the files, so chunks of the same file are stored near each other
+	std::vector<std::shared_ptr<Chunk>> GetChunksInFileOrder();
 
 	EFeatureLevel FeatureLevel;
 	bool bIsFileData;